@@ -0,0 +1,613 @@
+﻿#define _CRT_SECURE_NO_WARNINGS 1
+
+#include "AllocTracer.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+#ifdef __linux__
+	#include <sys/syscall.h>
+#endif
+
+static const char TRACE_MAGIC[8] = { 'C', 'M', 'P', 'T', 'R', 'A', 'C', 'E' };
+static const size_t FILE_HEADER_BYTES = 24;
+static const size_t CHUNK_HEADER_BYTES = 16;
+
+// 每个线程的记录状态, 放在一起只取一次 TLS 地址(libcmpool.so 里每次取 TLS 地址都是一次函数调用)
+struct TraceTls
+{
+	void* _thread = nullptr;	// 当前线程的 TraceThread
+	bool _released = false;		// 已经在线程退出时回收了
+	bool _inTracer = false;		// 后台写文件的线程, 以及 Start 里自己申请内存的时候: 不记录(换缓冲区要拿 _mtx, 会锁住自己)
+};
+
+static thread_local TraceTls tlsTrace;
+
+// x 最高位的 1 在第几位(x 不能为0)
+static inline size_t HighestBit(uint64_t x)
+{
+#ifdef _MSC_VER
+	unsigned long index = 0;
+#ifdef _WIN64
+	_BitScanReverse64(&index, x);
+#else
+	if (_BitScanReverse(&index, (unsigned long)(x >> 32)))
+		index += 32;
+	else
+		_BitScanReverse(&index, (unsigned long)x);
+#endif
+	return index;
+#else
+	return 63 - (size_t)__builtin_clzll(x);
+#endif
+}
+
+// 整数按小端写进文件头/块头, 不依赖本机字节序
+static inline void PutLE(uint8_t* p, unsigned long long v, size_t bytes)
+{
+	for (size_t i = 0; i < bytes; ++i)
+	{
+		p[i] = (uint8_t)(v >> (8 * i));
+	}
+}
+
+static unsigned long long GetLE(const uint8_t* p, size_t bytes)
+{
+	unsigned long long v = 0;
+	for (size_t i = 0; i < bytes; ++i)
+	{
+		v |= (unsigned long long)p[i] << (8 * i);
+	}
+	return v;
+}
+
+// 前缀 varint: 第一个字节最低的几位是长度(n-1 个 0 再跟一个 1), 剩下的位是数值, 和 LEB128 一样每个字节存 7 位;
+// 但编码时不用逐字节循环: 算出长度以后一次写 8 个字节, 申请大小随机时也没有难预测的分支
+// 不小于 2^56 的值(很少见)写成一个 0 字节再跟 8 个字节的原值
+// 会多写最多 7 个字节, 所以缓冲区要留 MAX_RECORD_BYTES 的余量
+static inline void PutVarint(uint8_t*& p, unsigned long long v)
+{
+	if (v >= (1ull << 56))
+	{
+		*p = 0;
+		PutLE(p + 1, v, 8);
+		p += 9;
+		return;
+	}
+
+	size_t n = (HighestBit(v | 1) + 7) / 7;
+	PutLE(p, (v << n) | (1ull << (n - 1)), 8);
+	p += n;
+}
+
+static bool GetVarint(const uint8_t*& p, const uint8_t* end, unsigned long long& v)
+{
+	if (p == end)
+		return false;
+
+	size_t n = 1;
+	if (*p == 0)
+		n = 9;
+	else
+		while ((*p & (1u << (n - 1))) == 0) ++n;
+	if ((size_t)(end - p) < n)
+		return false;
+
+	v = n == 9 ? GetLE(p + 1, 8) : GetLE(p, n) >> n;
+	p += n;
+	return true;
+}
+
+// 有符号的差值: 0, -1, 1, -2, 2 ... 映射成 0, 1, 2, 3, 4 ..., 小的负数也只占一个字节
+static unsigned long long ZigZag(long long v)
+{
+	return ((unsigned long long)v << 1) ^ (unsigned long long)(v >> 63);
+}
+
+static long long UnZigZag(unsigned long long v)
+{
+	return (long long)(v >> 1) ^ -(long long)(v & 1);
+}
+
+// 线程退出时把还没交出去的记录交给后台线程
+struct AllocTraceReleaser
+{
+	~AllocTraceReleaser()
+	{
+		tlsTrace._released = true;
+
+		AllocTracer::TraceThread* t = (AllocTracer::TraceThread*)tlsTrace._thread;
+		if (t == nullptr)
+			return;
+
+		tlsTrace._thread = nullptr;
+		AllocTracer::getInstance()->UnregisterThread(t);
+	}
+};
+
+AllocTracer::AllocTracer()
+{
+	allocTraceState.store(TRACE_OFF, std::memory_order_relaxed);
+
+	AsymmetricBarrier::Init();
+
+	const char* path = getenv("CMP_ALLOC_TRACE");
+	if (path != nullptr && path[0] != '\0')
+		Start(path);
+}
+
+AllocTracer::~AllocTracer()
+{
+	// 进程退出时把缓冲区里剩下的记录写完
+	Stop();
+}
+
+bool AllocTracer::Start(const char* path)
+{
+	std::unique_lock<std::mutex> control(_controlMtx);
+	if (IsRecording())
+	{
+		control.unlock();
+		Stop();
+		control.lock();
+	}
+
+	tlsTrace._inTracer = true;
+	FILE* file = fopen(path, "wb");
+	if (file == nullptr)
+	{
+		tlsTrace._inTracer = false;
+		return false;
+	}
+
+	// 测一下 TSC 的频率
+	unsigned long long ticksPerSecond = 1000000000ull;
+#ifdef CMP_TRACE_TSC
+	unsigned long long ns0 = NowNs(), ticks0 = NowTicks();
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	unsigned long long ns1 = NowNs(), ticks1 = NowTicks();
+	ticksPerSecond = (unsigned long long)((double)(ticks1 - ticks0) * 1e9 / (double)(ns1 - ns0));
+#endif
+
+	uint8_t header[FILE_HEADER_BYTES] = {};
+	memcpy(header, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+	PutLE(header + 8, FORMAT_VERSION, 4);
+	PutLE(header + 16, ticksPerSecond, 8);
+	fwrite(header, 1, sizeof(header), file);
+
+	{
+		std::unique_lock<std::mutex> lock(_mtx);
+
+		// 上一次停止以后才写进缓冲区的记录不要了
+		TakeThreadBuffers(false);
+
+		_file = file;
+		_stopping = false;
+		_startTicks = NowTicks();
+		_ticksPerSecond = ticksPerSecond;
+		_events.Set(0);
+		_writtenBytes.Set(sizeof(header));
+		_dropped.store(0, std::memory_order_relaxed);
+	}
+
+	_flusher = std::thread(&AllocTracer::FlushLoop, this);
+	tlsTrace._inTracer = false;
+
+	allocTraceState.store(TRACE_ON, std::memory_order_relaxed);
+	return true;
+}
+
+void AllocTracer::Stop()
+{
+	std::unique_lock<std::mutex> control(_controlMtx);
+	if (!IsRecording())
+		return;
+
+	allocTraceState.store(TRACE_OFF, std::memory_order_relaxed);
+	{
+		std::unique_lock<std::mutex> lock(_mtx);
+		_stopping = true;
+	}
+	_cv.notify_one();
+
+	// 后台线程退出前会把所有线程的缓冲区都收走写完
+	_flusher.join();
+	fclose(_file);
+	_file = nullptr;
+}
+
+void AllocTracer::Record(bool isFree, void* ptr, size_t size)
+{
+	TraceTls& tls = tlsTrace;
+	if (allocTraceState.load(std::memory_order_relaxed) != TRACE_ON || tls._inTracer)
+		return;
+
+	TraceThread* t = (TraceThread*)tls._thread;
+	if (t == nullptr && (t = RegisterThread()) == nullptr)
+	{
+		_dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	unsigned long long now = NowTicks();
+	t->_handshake.Enter();
+	TraceBuffer* b = t->_cur;
+	if (b == nullptr || b->_used + MAX_RECORD_BYTES > BUFFER_BYTES)
+	{
+		// 换缓冲区要拿 _mtx, 后台线程是拿着 _mtx 等本线程写完的, 所以这里先退出来
+		t->_cur = nullptr;
+		t->_handshake.Leave();
+		b = SwapBuffer(b, t->_id);
+		if (b == nullptr)
+			return;
+		t->_handshake.Enter();
+		t->_cur = b;
+	}
+
+	if (b->_used == 0)
+	{
+		b->_baseTicks = now;
+		b->_lastTicks = now;
+		b->_lastPtr = 0;
+	}
+
+	uintptr_t id = (uintptr_t)ptr >> 3;
+	uint8_t* p = b->_data + b->_used;
+	PutVarint(p, ((now - b->_lastTicks) << 1) | (isFree ? 1 : 0));
+	PutVarint(p, size);
+	PutVarint(p, ZigZag((long long)(id - b->_lastPtr)));
+
+	b->_used = p - b->_data;
+	b->_records++;
+	b->_lastTicks = now;
+	b->_lastPtr = id;
+	t->_handshake.Leave();
+}
+
+AllocTracer::TraceThread* AllocTracer::RegisterThread()
+{
+	if (tlsTrace._released)
+		return nullptr;
+
+	TraceThread* t = nullptr;
+	{
+		std::unique_lock<std::mutex> lock(_mtx);
+		if (_freeThreads != nullptr)
+		{
+			t = _freeThreads;
+			_freeThreads = t->_next;
+		}
+		else
+		{
+			t = _threadPool.New();
+			if (t == nullptr)
+				return nullptr;
+		}
+		t->_id = _nextThreadId++;
+		t->_cur = nullptr;
+		t->_next = _threads;
+		_threads = t;
+	}
+
+	// 和 ThreadCache::Create 一样先设置 TLS 再构造 releaser: 注册析构函数时 glibc 可能调 calloc 又走回这里
+	tlsTrace._thread = t;
+	static thread_local AllocTraceReleaser releaser;
+	(void)releaser;
+
+	return t;
+}
+
+void AllocTracer::UnregisterThread(TraceThread* t)
+{
+	bool submitted = false;
+	{
+		// 收缓冲区的后台线程也要拿 _mtx, 拿到 _mtx 以后 _cur 就只有本线程在碰了
+		std::unique_lock<std::mutex> lock(_mtx);
+		TraceBuffer* b = t->_cur;
+		t->_cur = nullptr;
+
+		if (b != nullptr)
+		{
+			if (b->_used > 0 && IsRecording())
+			{
+				SubmitBuffer(b);
+				submitted = true;
+			}
+			else
+			{
+				RecycleBuffer(b);
+			}
+		}
+
+		for (TraceThread** pp = &_threads; *pp != nullptr; pp = &(*pp)->_next)
+		{
+			if (*pp == t)
+			{
+				*pp = t->_next;
+				break;
+			}
+		}
+		t->_next = _freeThreads;
+		_freeThreads = t;
+	}
+
+	if (submitted)
+		_cv.notify_one();
+}
+
+AllocTracer::TraceBuffer* AllocTracer::SwapBuffer(TraceBuffer* full, uint32_t thread)
+{
+	TraceBuffer* b = nullptr;
+	bool submitted = false;
+	{
+		std::unique_lock<std::mutex> lock(_mtx);
+		if (full != nullptr)
+		{
+			if (full->_used > 0 && IsRecording())
+			{
+				SubmitBuffer(full);
+				submitted = true;
+			}
+			else
+			{
+				RecycleBuffer(full);
+			}
+		}
+
+		if (IsRecording())
+			b = NewBuffer(thread);
+	}
+
+	if (submitted)
+		_cv.notify_one();
+	return b;
+}
+
+AllocTracer::TraceBuffer* AllocTracer::NewBuffer(uint32_t thread)
+{
+	TraceBuffer* b = _freeBuffers;
+	if (b != nullptr)
+	{
+		_freeBuffers = b->_next;
+	}
+	else
+	{
+		// 缓冲区很大, 直接按页向系统申请, 用完放回空闲链表, 不还给系统
+		size_t pages = SizeClass::_RoundUp(sizeof(TraceBuffer), 1 << PAGE_SHIFT) >> PAGE_SHIFT;
+		void* mem = SystemAlloc(pages);
+		if (mem == nullptr)
+			return nullptr;
+		b = new(mem)TraceBuffer;
+	}
+
+	b->_thread = thread;
+	b->_used = 0;
+	b->_records = 0;
+	b->_next = nullptr;
+	return b;
+}
+
+void AllocTracer::SubmitBuffer(TraceBuffer* b)
+{
+	b->_next = _full;
+	_full = b;
+}
+
+void AllocTracer::RecycleBuffer(TraceBuffer* b)
+{
+	b->_next = _freeBuffers;
+	_freeBuffers = b;
+}
+
+// 先把所有线程都标记成要收, 一次重的屏障以后, 还没开始写的线程一定能看到标记; 再等正在写的线程写完
+// 线程下一次记录时会自己换一个新的缓冲区
+void AllocTracer::TakeThreadBuffers(bool submit)
+{
+	if (_threads == nullptr)
+		return;
+
+	for (TraceThread* t = _threads; t != nullptr; t = t->_next)
+	{
+		t->_handshake.Claim();
+	}
+	AsymmetricBarrier::Heavy();
+
+	for (TraceThread* t = _threads; t != nullptr; t = t->_next)
+	{
+		while (t->_handshake.Busy())
+		{
+			std::this_thread::yield();
+		}
+
+		TraceBuffer* b = t->_cur;
+		if (b != nullptr && (b->_used > 0 || !submit))
+		{
+			t->_cur = nullptr;
+			if (submit)
+				SubmitBuffer(b);
+			else
+				RecycleBuffer(b);
+		}
+		t->_handshake.Release();
+	}
+}
+
+void AllocTracer::FlushLoop()
+{
+	tlsTrace._inTracer = true;
+
+	unsigned long long lastCollect = NowNs();
+	std::unique_lock<std::mutex> lock(_mtx);
+	while (true)
+	{
+		_cv.wait_for(lock, std::chrono::milliseconds((long long)FLUSH_INTERVAL_MS),
+			[this]() { return _stopping || _full != nullptr; });
+
+		// 一直有线程写满缓冲区时也要定时去收别的线程没写满的, 否则不怎么申请内存的线程的记录一直写不出去
+		bool stopping = _stopping;
+		unsigned long long now = NowNs();
+		if (stopping || now - lastCollect >= FLUSH_INTERVAL_MS * 1000000ull)
+		{
+			TakeThreadBuffers(true);
+			lastCollect = now;
+		}
+
+		TraceBuffer* list = _full;
+		_full = nullptr;
+
+		// 交上来的顺序是后进先出, 倒过来按交上来的顺序写
+		TraceBuffer* fifo = nullptr;
+		while (list != nullptr)
+		{
+			TraceBuffer* next = list->_next;
+			list->_next = fifo;
+			fifo = list;
+			list = next;
+		}
+
+		lock.unlock();
+		{
+			std::unique_lock<std::mutex> fileLock(_fileMtx);
+			WriteBuffers(fifo);
+		}
+		lock.lock();
+
+		while (fifo != nullptr)
+		{
+			TraceBuffer* next = fifo->_next;
+			RecycleBuffer(fifo);
+			fifo = next;
+		}
+
+		if (stopping)
+			break;
+	}
+}
+
+void AllocTracer::WriteBuffers(TraceBuffer* list)
+{
+	if (list == nullptr)
+		return;
+
+	for (TraceBuffer* b = list; b != nullptr; b = b->_next)
+	{
+		uint8_t header[CHUNK_HEADER_BYTES];
+		PutLE(header, b->_used, 4);
+		PutLE(header + 4, b->_thread, 4);
+		PutLE(header + 8, b->_baseTicks >= _startTicks ? b->_baseTicks - _startTicks : 0, 8);
+		fwrite(header, 1, sizeof(header), _file);
+		fwrite(b->_data, 1, b->_used, _file);
+
+		_writtenBytes.Add(sizeof(header) + b->_used);
+		_events.Add(b->_records);
+	}
+
+	// 每一轮都刷到文件里, 读的一方能马上看到
+	fflush(_file);
+}
+
+#ifndef _WIN32
+void AllocTracer::AtForkPrepare()
+{
+	AllocTracer* tracer = getInstance();
+	tracer->_controlMtx.lock();
+	tracer->_fileMtx.lock();
+	tracer->_mtx.lock();
+}
+
+void AllocTracer::AtForkParent()
+{
+	AllocTracer* tracer = getInstance();
+	tracer->_mtx.unlock();
+	tracer->_fileMtx.unlock();
+	tracer->_controlMtx.unlock();
+}
+
+void AllocTracer::AtForkChild()
+{
+	AllocTracer* tracer = getInstance();
+	allocTraceState.store(TRACE_OFF, std::memory_order_relaxed);
+
+	// 文件归父进程写; 后台线程在子进程里不存在, 重新构造一个空的 std::thread, 否则退出时析构会 terminate,
+	// 条件变量也要重新构造: 它还记着父进程里后台线程在等它, 析构时会一直等那个线程离开
+	tracer->_file = nullptr;
+	new(&tracer->_flusher)std::thread;
+	new(&tracer->_cv)std::condition_variable;
+
+	tracer->_mtx.unlock();
+	tracer->_fileMtx.unlock();
+	tracer->_controlMtx.unlock();
+}
+#endif
+
+bool AllocTracer::ReadTrace(const char* path, std::vector<TraceEvent>& events)
+{
+	FILE* file = fopen(path, "rb");
+	if (file == nullptr)
+		return false;
+
+	uint8_t header[FILE_HEADER_BYTES];
+	if (fread(header, 1, sizeof(header), file) != sizeof(header)
+		|| memcmp(header, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0
+		|| GetLE(header + 8, 4) != FORMAT_VERSION)
+	{
+		fclose(file);
+		return false;
+	}
+	double nsPerTick = 1e9 / (double)std::max<unsigned long long>(1, GetLE(header + 16, 8));
+
+	bool ok = true;
+	size_t first = events.size();
+	std::vector<uint8_t> data;
+	while (ok)
+	{
+		uint8_t chunk[CHUNK_HEADER_BYTES];
+		size_t bytes = 0;
+		if (fread(chunk, 1, sizeof(chunk), file) != sizeof(chunk)
+			|| (bytes = (size_t)GetLE(chunk, 4)) > BUFFER_BYTES)
+			break;
+
+		data.resize(bytes);
+		if (fread(data.data(), 1, bytes, file) != bytes)
+			break;
+
+		uint32_t thread = (uint32_t)GetLE(chunk + 4, 4);
+		unsigned long long time = GetLE(chunk + 8, 8);
+		uintptr_t id = 0;
+
+		const uint8_t* p = data.data();
+		const uint8_t* end = p + bytes;
+		while (p < end)
+		{
+			unsigned long long head, size, delta;
+			if (!GetVarint(p, end, head) || !GetVarint(p, end, size) || !GetVarint(p, end, delta))
+			{
+				ok = false;
+				break;
+			}
+
+			time += head >> 1;
+			id += (uintptr_t)UnZigZag(delta);
+
+			// 先按 tick 存, 排好序以后再换算成纳秒(换算以后可能有相等的, 就分不出先后了)
+			TraceEvent ev;
+			ev._timeNs = time;
+			ev._thread = thread;
+			ev._free = (head & 1) != 0;
+			ev._size = (size_t)size;
+			ev._ptr = id << 3;
+			events.push_back(ev);
+		}
+	}
+	fclose(file);
+
+	// 同一个线程的事件在文件里本来就是按顺序的, 稳定排序不会打乱时间相同的事件
+	std::stable_sort(events.begin() + first, events.end(), [](const TraceEvent& a, const TraceEvent& b) {
+		return a._timeNs < b._timeNs;
+	});
+	for (size_t i = first; i < events.size(); ++i)
+	{
+		events[i]._timeNs = (unsigned long long)((double)events[i]._timeNs * nsPerTick);
+	}
+	return ok;
+}
@@ -0,0 +1,222 @@
+﻿#pragma once
+
+#include "Common.h"
+
+#include <cstdio>
+#include <string>
+#include <condition_variable>
+
+#if defined(_M_X64) || defined(_M_IX86)
+	#include <intrin.h>
+	#define CMP_TRACE_TSC 1
+#elif defined(__x86_64__) || defined(__i386__)
+	#include <x86intrin.h>
+	#define CMP_TRACE_TSC 1
+#endif
+
+// 申请释放序列的记录(默认关闭): 把每一次 ConcurrentAlloc / ConcurrentFree 记成一条事件写到文件里,
+// 之后可以用 BenchMark --replay 回放, 或者统计真实的申请大小分布给 SizeClassGen 用
+// 打开方式: 环境变量 CMP_ALLOC_TRACE=文件 (进程第一次申请内存时开始), 或者 ConcurrentStartAllocationTrace
+//
+// 每个线程往自己的缓冲区里追加记录, 线程之间没有竞争; 缓冲区写满了交给后台线程,
+// 后台线程每 FLUSH_INTERVAL_MS 毫秒也会把没写满的缓冲区收走, 一起写进文件
+// 收缓冲区和线程写记录之间用非对称的屏障同步(和 folly 的 hazard pointer 一样): 记录时只是两次普通的写和一次读,
+// 重的那一半由后台线程承担(linux 的 membarrier / windows 的 FlushProcessWriteBuffers, 每次收缓冲区一次系统调用)
+//
+// 时间戳在 x86 上直接读 TSC(现代 CPU 的 TSC 频率恒定、各核同步, 比 steady_clock 便宜得多), 其他平台用 steady_clock 的纳秒;
+// 每秒多少个 tick 在开始记录时测出来写进文件头
+//
+// 文件格式(小端):
+//   文件头  "CMPTRACE" + uint32 版本 + uint32 保留 + uint64 每秒的 tick 数
+//   之后是一个接一个的块, 每个块是某个线程的一段连续记录:
+//     块头  uint32 记录部分的字节数 + uint32 线程编号 + uint64 第一条记录的时间(从开始记录算起, tick)
+//     记录  varint((和上一条的时间差 << 1) | op) + varint(size) + varint(zigzag(地址/8 和上一条的差))
+//           op: 0 申请, 1 释放; 块里第一条记录的时间差和地址差都相对块头/0
+//           size: 申请记录是传给 ConcurrentAlloc 的大小; 释放记录是对象在内存池里占的大小(span 的 _objSize),
+//                 小对象是大小类的大小(带不带大小释放都一样), 大对象和申请记录相同
+//           地址: 申请和释放记的都是 ConcurrentAlloc 返回的地址, 按比一页还大的对齐申请时释放的是 span 中间的地址, 也记 span 开头
+//           varint 是前缀编码: 第一个字节最低位开始数, 第 n 位是第一个 1 就一共 n 个字节, 其余的位是数值(小端);
+//           第一个字节是 0 时后面跟 8 个字节的原值
+// 块和块之间互不依赖, 所以文件可以边写边读(tail -f 管道给别的程序), 时间差和地址差都很小, 用 zstd/gzip 压缩效果很好
+
+// 0: 还没初始化(第一次走到慢路径时读环境变量), 1: 关闭, 2: 正在记录
+inline std::atomic<int> allocTraceState{ 0 };
+
+// 解出来的一条事件
+struct TraceEvent
+{
+	unsigned long long _timeNs = 0;		// 从开始记录算起
+	uint32_t _thread = 0;				// 线程编号(记录时按线程第一次申请的顺序分配)
+	bool _free = false;
+	size_t _size = 0;					// 申请和释放记录里的 size 含义不同, 见上面的文件格式
+	uintptr_t _ptr = 0;
+};
+
+class AllocTracer
+{
+public:
+	enum State
+	{
+		TRACE_UNINIT = 0,
+		TRACE_OFF = 1,
+		TRACE_ON = 2,
+	};
+
+	static AllocTracer* getInstance()
+	{
+		static AllocTracer sInst;
+		return &sInst;
+	}
+
+	// 申请路径: 没打开时只是一次读和比较
+	static void OnAlloc(void* ptr, size_t size)
+	{
+		if (allocTraceState.load(std::memory_order_relaxed) != TRACE_OFF)
+			getInstance()->Record(false, ptr, size);
+	}
+
+	// 释放路径: 要在对象真正释放之前记, 这样同一个地址被别的线程重新申请时, 释放的时间一定在前面
+	static void OnFree(void* ptr, size_t size)
+	{
+		if (allocTraceState.load(std::memory_order_relaxed) != TRACE_OFF)
+			getInstance()->Record(true, ptr, size);
+	}
+
+	// 开始记录到 path(覆盖原来的文件), 正在记录时先停掉上一次的
+	bool Start(const char* path);
+
+	// 停止记录: 所有线程缓冲区里的记录都写进文件以后再返回
+	void Stop();
+
+	bool IsRecording()
+	{
+		return allocTraceState.load(std::memory_order_relaxed) == TRACE_ON;
+	}
+
+	// 这一次记录写了多少条事件、多少字节, 有多少条因为线程已经退出而丢掉了
+	size_t RecordedEvents()
+	{
+		return _events.Get();
+	}
+
+	size_t WrittenBytes()
+	{
+		return _writtenBytes.Get();
+	}
+
+	size_t DroppedEvents()
+	{
+		return _dropped.load(std::memory_order_relaxed);
+	}
+
+	// 读回记录的文件, 所有线程的事件按时间排好序; 文件最后一个块不完整(还在写)时只读到它前面
+	static bool ReadTrace(const char* path, std::vector<TraceEvent>& events);
+
+#ifndef _WIN32
+	// fork 的时候后台线程不会跟到子进程里: fork 之前拿住所有的锁, 子进程里不再记录
+	// 由 AtFork.cpp 统一注册, 要在内存池的锁之前拿(后台线程拿着 _fileMtx 写文件时会申请内存)
+	static void AtForkPrepare();
+	static void AtForkParent();
+	static void AtForkChild();
+#endif
+
+	static const size_t BUFFER_BYTES = 64 * 1024;		// 每个线程缓冲区的大小
+	static const size_t MAX_RECORD_BYTES = 32;			// 一条记录最长(三个 varint, 加上一次写 8 字节多出来的部分)
+	static const unsigned FLUSH_INTERVAL_MS = 100;		// 后台线程多久收一次没写满的缓冲区
+	static const uint32_t FORMAT_VERSION = 1;
+
+private:
+	// 一个块: 同一个线程的一段连续记录
+	struct TraceBuffer
+	{
+		uint32_t _thread = 0;
+		size_t _used = 0;
+		size_t _records = 0;
+		unsigned long long _baseTicks = 0;	// 第一条记录的时间
+		unsigned long long _lastTicks = 0;	// 上一条记录的时间
+		uintptr_t _lastPtr = 0;				// 上一条记录的地址/8
+		TraceBuffer* _next = nullptr;
+		uint8_t _data[BUFFER_BYTES];
+	};
+
+	// 每个线程一份, 线程退出时还回来给之后的线程用
+	struct TraceThread
+	{
+		ClaimHandshake _handshake;	// 本线程写缓冲区时 Enter / Leave, 后台线程收缓冲区时 Claim
+		uint32_t _id = 0;
+		TraceBuffer* _cur = nullptr;
+		TraceThread* _next = nullptr;
+	};
+
+	void Record(bool isFree, void* ptr, size_t size);
+
+	// 第一次记录时注册当前线程, 线程已经退出(在跑别的 thread_local 析构函数)时返回空
+	TraceThread* RegisterThread();
+
+	// 线程退出: 缓冲区交给后台线程, TraceThread 放回空闲链表
+	void UnregisterThread(TraceThread* t);
+	friend struct AllocTraceReleaser;
+
+	// 写满的缓冲区交给后台线程, 换一个空的回来
+	TraceBuffer* SwapBuffer(TraceBuffer* full, uint32_t thread);
+
+	// 以下在 _mtx 里调用
+	TraceBuffer* NewBuffer(uint32_t thread);
+	void SubmitBuffer(TraceBuffer* b);
+	void RecycleBuffer(TraceBuffer* b);
+
+	// 把所有线程手里没写满的缓冲区收走(在 _mtx 里调用), submit 为 false 时直接扔掉
+	void TakeThreadBuffers(bool submit);
+
+	// 后台线程: 把交上来的缓冲区写进文件
+	void FlushLoop();
+	void WriteBuffers(TraceBuffer* list);
+
+	static unsigned long long NowNs()
+	{
+		return (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	static unsigned long long NowTicks()
+	{
+#ifdef CMP_TRACE_TSC
+		return __rdtsc();
+#else
+		return NowNs();
+#endif
+	}
+
+private:
+	// 拿锁的顺序: _controlMtx -> _fileMtx -> _mtx -> 线程自己的锁
+	std::mutex _controlMtx;					// Start / Stop 互斥
+	std::mutex _fileMtx;					// 后台线程写文件时拿着, fork 时文件的缓冲区里不会有写了一半的数据
+	std::mutex _mtx;						// 保护下面所有的链表
+	std::condition_variable _cv;
+
+	TraceThread* _threads = nullptr;		// 注册了的线程
+	TraceThread* _freeThreads = nullptr;	// 退出了的线程留下的, 可以复用
+	uint32_t _nextThreadId = 1;
+
+	TraceBuffer* _full = nullptr;			// 等着写进文件的缓冲区(后进先出, 写之前倒过来)
+	TraceBuffer* _freeBuffers = nullptr;
+
+	FILE* _file = nullptr;					// 只有后台线程写
+	std::thread _flusher;
+	bool _stopping = false;
+	unsigned long long _startTicks = 0;		// 开始记录的时间, 块头里的时间都相对它
+	unsigned long long _ticksPerSecond = 0;
+
+	StatCounter _events;					// 只有后台线程改(写进文件时按块累加)
+	StatCounter _writtenBytes;
+	std::atomic<size_t> _dropped{ 0 };
+
+	ObjectPool<TraceThread> _threadPool;
+
+private:
+	AllocTracer();
+	~AllocTracer();
+
+	AllocTracer(const AllocTracer&) = delete;
+	AllocTracer operator=(const AllocTracer&) = delete;
+};
@@ -0,0 +1,80 @@
+﻿#define _CRT_SECURE_NO_WARNINGS 1
+
+#include "AtFork.h"
+#include "ThreadCache.h"
+#include "CpuCache.h"
+#include "CentralCache.h"
+#include "PageCache.h"
+#include "HeapProfiler.h"
+#include "AllocTracer.h"
+
+#ifdef _WIN32
+
+// windows 没有 fork
+void RegisterForkHandlers()
+{}
+
+#else
+
+#include <pthread.h>
+
+// prepare 时记录器和按 CPU 缓存是否已经创建, parent / child 只放开 prepare 拿到的锁
+// (记录器没创建时不能在这里创建它: 构造时可能按环境变量打开记录, 起后台线程)
+static bool forkTracer = false;
+static CpuCache* forkCpuCache = nullptr;
+
+static void ForkPrepare()
+{
+	// 单例在拿锁之前先构造好, 拿着锁的时候不能再走第一次构造的路径
+	CentralCache* central = CentralCache::getInstance();
+	PageCache* page = PageCache::getInstance();
+	HeapProfiler* profiler = HeapProfiler::getInstance();
+
+	forkTracer = allocTraceState.load(std::memory_order_acquire) != AllocTracer::TRACE_UNINIT;
+	if (forkTracer)
+		AllocTracer::AtForkPrepare();
+
+	SizeClass::LockForFork();
+	ThreadCache::LockForFork();
+	forkCpuCache = CpuCache::Existing();
+	if (forkCpuCache != nullptr)
+		forkCpuCache->LockForFork();
+	central->LockForFork();
+	page->LockForFork();
+	profiler->LockForFork();
+	PoolMutex::LockForFork();
+}
+
+// 和 ForkPrepare 反过来
+static void UnlockAfterFork()
+{
+	PoolMutex::UnlockAfterFork();
+	HeapProfiler::getInstance()->UnlockAfterFork();
+	PageCache::getInstance()->UnlockAfterFork();
+	CentralCache::getInstance()->UnlockAfterFork();
+	if (forkCpuCache != nullptr)
+		forkCpuCache->UnlockAfterFork();
+	ThreadCache::UnlockAfterFork();
+	SizeClass::UnlockAfterFork();
+}
+
+static void ForkParent()
+{
+	UnlockAfterFork();
+	if (forkTracer)
+		AllocTracer::AtForkParent();
+}
+
+static void ForkChild()
+{
+	UnlockAfterFork();
+	if (forkTracer)
+		AllocTracer::AtForkChild();
+}
+
+void RegisterForkHandlers()
+{
+	pthread_atfork(ForkPrepare, ForkParent, ForkChild);
+}
+
+#endif
@@ -0,0 +1,12 @@
+﻿#pragma once
+
+// fork 只把调用 fork 的线程带到子进程里, 别的线程这时拿着的锁在子进程里永远不会被释放,
+// 子进程(比如 fork 完还没 exec 就申请内存)一碰到这把锁就卡死了
+// 所以 fork 之前把内存池所有的锁按固定顺序全部拿到, fork 之后父子进程再一起放开, 子进程里每一级缓存都是完整的
+//
+// 拿锁的顺序和平时嵌套的顺序一致, 外层的先拿:
+// 记录器(AllocTracer) -> 大小类 -> ThreadCache 注册链表 -> 每个 CPU 的 slab -> central cache 的桶锁和转运缓存的锁
+// -> page cache 的分片缓存 -> _pageMtx -> 堆采样 -> 所有定长内存池
+//
+// 子进程里只剩一个线程, 别的线程的 ThreadCache 里缓存的对象就泄漏了, 和 tcmalloc 一样不去回收
+void RegisterForkHandlers();
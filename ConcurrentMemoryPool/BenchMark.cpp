@@ -1,130 +1,1131 @@
-#define _CRT_SECURE_NO_WARNINGS 1
+﻿#define _CRT_SECURE_NO_WARNINGS 1
 
-// Ŀۺϲ
-#include"ConcurrentAlloc.h"
+// 对项目进行综合测试
+// 以前只测一种模式(每个线程申请 (16+i)%8192+1 字节再全部释放), 用 clock() 计时:
+// clock() 是整个进程的 CPU 时间, 多个线程的时间叠在一起, 而且看不出每次申请的延迟分布和内存占用
+//
+// 现在是一个矩阵: 分配器 x 场景 x 大小分布 x 线程数, 每一组配置报告
+//   - 墙上时间算出来的 ns/op 和吞吐量
+//   - 申请和释放各自的延迟分位数(p50 / p99 / p999)
+//   - 峰值 RSS 和稳定阶段的 RSS(都是相对开始前的增量)
+// 结果打印成表格, 也可以写成 CSV / JSON 方便跟踪性能回退
+//
+// 场景:
+//   batch            每个线程申请一批再自己释放(ThreadCache 最理想的情况)
+//   ring/fanin/fanout 对象通过队列交给别的线程释放, 测跨线程释放的开销
+//   frag             每个线程留着一半大块内存不放, 另一半反复释放、申请, 测碎片很多时 page cache 大锁的持有时间
+//   replay           回放记录下来的 (thread, op, size, id) 事件序列
+//
+// 用法:
+//   BenchMark [--scenarios batch,ring,fanin,fanout,frag] [--replay 事件文件]
+//             [--threads 1,2,4,8] [--dists fixed,uniform,powerlaw,trace] [--trace 直方图文件]
+//             [--allocators pool,malloc,jemalloc,tcmalloc] [--ops 每个线程的操作数] [--batch 每批对象数]
+//             [--csv 文件] [--json 文件] [--no-fork] [--quick]
+#include "ConcurrentAlloc.h"
 
-// ntimes һͷڴĴ
-// rounds ִ
-// nworks ߳
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <string>
+#include <random>
+#include <fstream>
+#include <sstream>
+#include <deque>
+#include <memory>
+#include <functional>
 
-//  malloc / free
-void BenchmarkMalloc(size_t ntimes, size_t nworks, size_t rounds)
+#ifdef _WIN32
+	#include <psapi.h>
+	#pragma comment(lib, "psapi.lib")
+#else
+	#include <dlfcn.h>
+	#include <unistd.h>
+	#include <sys/wait.h>
+#endif
+
+/////////////////////////////////////////////////////////////////////////////
+// 被测的分配器
+
+struct Allocator
 {
-	std::vector<std::thread> vthread(nworks);
-	std::atomic<size_t> malloc_costtime = 0;
-	std::atomic<size_t> free_costtime = 0;
+	std::string _name;
+	void* (*_alloc)(size_t);
+	void (*_free)(void*);
+};
+
+static void* PoolAlloc(size_t size)
+{
+	return ConcurrentAlloc(size);
+}
 
-	for (size_t k = 0; k < nworks; ++k)
+static void PoolFree(void* ptr)
+{
+	ConcurrentFree(ptr);
+}
+
+static void* LibcMalloc(size_t size)
+{
+	return malloc(size);
+}
+
+static void LibcFree(void* ptr)
+{
+	free(ptr);
+}
+
+#ifndef _WIN32
+// 机器上装了 jemalloc / tcmalloc 的话用 dlopen 加载进来, 直接调它们的 malloc / free
+// RTLD_LOCAL 加载, 不会替换掉进程里别的代码用的 malloc
+static bool LoadAllocator(const char* name, const char* const* libs, Allocator& a)
+{
+	for (const char* const* lib = libs; *lib != nullptr; ++lib)
 	{
-		vthread[k] = std::thread([&, k]() {
-			std::vector<void*> v;
-			v.reserve(ntimes);
+		void* handle = dlopen(*lib, RTLD_NOW | RTLD_LOCAL);
+		if (handle == nullptr)
+			continue;
 
-			for (size_t j = 0; j < rounds; ++j)
-			{
-				size_t begin1 = clock();
-				for (size_t i = 0; i < ntimes; i++)
-				{
-					//v.push_back(malloc(16));
-					v.push_back(malloc((16 + i) % 8192 + 1));
-				}
-				size_t end1 = clock();
+		void* m = dlsym(handle, "malloc");
+		void* f = dlsym(handle, "free");
 
-				size_t begin2 = clock();
-				for (size_t i = 0; i < ntimes; i++)
-				{
-					free(v[i]);
-				}
-				size_t end2 = clock();
-				v.clear();
+		// dlsym 也会在依赖库(libc)里找, 要确认找到的真是这个库自己的 malloc
+		Dl_info info;
+		if (m != nullptr && f != nullptr && dladdr(m, &info) != 0 && info.dli_fname != nullptr
+			&& strstr(info.dli_fname, name) != nullptr)
+		{
+			a._name = name;
+			a._alloc = (void* (*)(size_t))m;
+			a._free = (void (*)(void*))f;
+			return true;
+		}
+		dlclose(handle);
+	}
+	return false;
+}
+#endif
+
+// 按名字找分配器, 找不到(没装)返回 false
+static bool FindAllocator(const std::string& name, Allocator& a)
+{
+	if (name == "pool")
+	{
+		a = { "pool", PoolAlloc, PoolFree };
+		return true;
+	}
+	if (name == "malloc")
+	{
+		a = { "malloc", LibcMalloc, LibcFree };
+		return true;
+	}
+#ifndef _WIN32
+	if (name == "jemalloc")
+	{
+		static const char* const libs[] = { "libjemalloc.so.2", "libjemalloc.so", nullptr };
+		return LoadAllocator("jemalloc", libs, a);
+	}
+	if (name == "tcmalloc")
+	{
+		static const char* const libs[] = { "libtcmalloc_minimal.so.4", "libtcmalloc.so.4", "libtcmalloc.so", nullptr };
+		return LoadAllocator("tcmalloc", libs, a);
+	}
+#endif
+	return false;
+}
 
-				malloc_costtime += (end1 - begin1);
-				free_costtime += (end2 - begin2);
+/////////////////////////////////////////////////////////////////////////////
+// 申请大小的分布
+
+struct Config
+{
+	std::vector<std::string> _scenarios = { "batch", "ring", "fanin", "fanout", "frag" };
+	std::vector<size_t> _threads = { 1, 2, 4, 8 };
+	std::vector<std::string> _dists = { "fixed", "uniform", "powerlaw" };
+	std::vector<std::string> _allocators = { "pool", "malloc", "jemalloc", "tcmalloc" };
+	std::string _traceFile;
+	std::string _replayFile;
+	std::string _csvFile;
+	std::string _jsonFile;
+	size_t _ops = 400000;	// 每个线程的操作数(申请和释放各算一次)
+	size_t _batch = 1000;	// 每批申请多少个对象再一起释放
+	bool _fork = true;		// 每组配置在单独的子进程里跑, RSS 互不影响
+};
+
+// 直方图文件(和 SizeClassGen 的输入一样, 每行 "size count"), 按实际记录的申请大小分布抽样
+static std::vector<size_t> traceSizes;
+static std::vector<double> traceWeights;
+
+static bool LoadTrace(const std::string& path)
+{
+	std::ifstream in(path);
+	if (!in)
+		return false;
+
+	std::string line;
+	while (std::getline(in, line))
+	{
+		if (line.empty() || line[0] == '#')
+			continue;
+		std::istringstream ss(line);
+		size_t size = 0;
+		double count = 0;
+		if (ss >> size >> count && size > 0 && count > 0)
+		{
+			traceSizes.push_back(size);
+			traceWeights.push_back(count);
+		}
+	}
+	return !traceSizes.empty();
+}
+
+// 提前生成好一个线程要申请的所有大小, 计时的时候不掺杂随机数的开销
+static std::vector<size_t> GenerateSizes(const std::string& dist, size_t n, uint64_t seed)
+{
+	std::mt19937_64 rng(seed);
+	std::vector<size_t> sizes(n);
+
+	if (dist == "fixed")
+	{
+		// 固定 16 字节, 最常见的小对象
+		std::fill(sizes.begin(), sizes.end(), (size_t)16);
+	}
+	else if (dist == "uniform")
+	{
+		// 1 ~ 8KB 均匀分布, 覆盖小对象的大部分大小类
+		std::uniform_int_distribution<size_t> d(1, 8192);
+		for (size_t& s : sizes)
+			s = d(rng);
+	}
+	else if (dist == "powerlaw")
+	{
+		// 帕累托分布(alpha = 1.3, 最小 16 字节): 绝大多数是小对象, 偶尔有一个很大的(最大 1MB, 会走到大对象路径)
+		std::uniform_real_distribution<double> u(0.0, 1.0);
+		for (size_t& s : sizes)
+		{
+			double x = 16.0 / std::pow(1.0 - u(rng), 1.0 / 1.3);
+			s = x > 1024.0 * 1024.0 ? 1024 * 1024 : (size_t)x;
+		}
+	}
+	else if (dist == "trace")
+	{
+		std::discrete_distribution<size_t> d(traceWeights.begin(), traceWeights.end());
+		for (size_t& s : sizes)
+			s = traceSizes[d(rng)];
+	}
+	return sizes;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// RSS
+
+static size_t CurrentRssKb()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+		return pmc.WorkingSetSize / 1024;
+	return 0;
+#else
+	FILE* f = fopen("/proc/self/statm", "r");
+	if (f == nullptr)
+		return 0;
+	unsigned long size = 0, resident = 0;
+	int n = fscanf(f, "%lu %lu", &size, &resident);
+	fclose(f);
+	if (n != 2)
+		return 0;
+	return resident * (size_t)sysconf(_SC_PAGESIZE) / 1024;
+#endif
+}
+
+// 跑的过程中每毫秒采一次 RSS: 最大的是峰值, 后一半时间的中位数当作稳定阶段的 RSS
+class RssMonitor
+{
+public:
+	void Start()
+	{
+		_baseKb = CurrentRssKb();
+		_stop = false;
+		_thread = std::thread([this]() {
+			while (!_stop.load(std::memory_order_relaxed))
+			{
+				_samples.push_back(CurrentRssKb());
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
 			}
-			});
+		});
 	}
 
-	for (auto& t : vthread)
+	void Stop(size_t& peakKb, size_t& steadyKb)
 	{
-		t.join();
+		_stop = true;
+		_thread.join();
+		_samples.push_back(CurrentRssKb());
+
+		size_t peak = *std::max_element(_samples.begin(), _samples.end());
+		std::vector<size_t> tail(_samples.begin() + _samples.size() / 2, _samples.end());
+		std::nth_element(tail.begin(), tail.begin() + tail.size() / 2, tail.end());
+		size_t steady = tail[tail.size() / 2];
+
+		peakKb = peak > _baseKb ? peak - _baseKb : 0;
+		steadyKb = steady > _baseKb ? steady - _baseKb : 0;
 	}
 
-	printf("%u ִ̲߳ %u ִ, ÿ malloc  %u ,  %u ms\n",
-		nworks, rounds, ntimes, malloc_costtime.load());
+private:
+	size_t _baseKb = 0;
+	std::atomic<bool> _stop{ false };
+	std::thread _thread;
+	std::vector<size_t> _samples;
+};
 
-	printf("%u ִ̲߳ %u ִ, ÿ free  %u ,  %u ms\n",
-		nworks, rounds, ntimes, free_costtime.load());
+/////////////////////////////////////////////////////////////////////////////
+// 跑一组配置
 
-	printf("%u ̲߳ malloc && free  %u , ܼƻ %u ms\n",
-		nworks, nworks * rounds * ntimes, malloc_costtime.load() + free_costtime.load());
+// 一组配置的结果, 在子进程里算好通过管道传回来, 所以只能是 POD
+struct RunResult
+{
+	double _wallMs = 0;
+	size_t _ops = 0;
+	double _nsPerOp = 0;		// 每个线程平均每次操作的墙上时间
+	double _mops = 0;			// 所有线程加起来每秒多少百万次操作
+	double _allocP50 = 0, _allocP99 = 0, _allocP999 = 0;
+	double _freeP50 = 0, _freeP99 = 0, _freeP999 = 0;
+	size_t _rssPeakKb = 0;
+	size_t _rssSteadyKb = 0;
+	double _pageHoldP50 = 0, _pageHoldP99 = 0;	// page cache 大锁每次拿着多久, 只有 frag 场景下的内存池才统计
+	size_t _threads = 0;		// 实际跑的线程数(回放时是 trace 里的线程数)
+	bool _ok = false;
+};
+
+static unsigned long long NowNs()
+{
+	return (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
+// 每 LATENCY_SAMPLE 次操作单独计一次时, 计时本身(两次读时钟)的开销不会算进每一次操作里
+static const size_t LATENCY_SAMPLE = 16;
 
-// ntimesִͷŴ 
-// nworks߳ 
-// roundsִ
+// 每个线程自己的延迟样本, 申请和释放都经过它
+class Latency
+{
+public:
+	void Reserve(size_t allocs, size_t frees)
+	{
+		_alloc.reserve(allocs / LATENCY_SAMPLE + 1);
+		_free.reserve(frees / LATENCY_SAMPLE + 1);
+	}
 
-// Լдĸ߲ڴ
-void BenchmarkConcurrentMalloc(size_t ntimes, size_t nworks, size_t rounds)
+	void* Alloc(const Allocator& a, size_t size)
+	{
+		void* ptr;
+		if (_allocCount++ % LATENCY_SAMPLE == 0)
+		{
+			unsigned long long t0 = NowNs();
+			ptr = a._alloc(size);
+			_alloc.push_back(Clamp(NowNs() - t0));
+		}
+		else
+		{
+			ptr = a._alloc(size);
+		}
+		if (ptr == nullptr)
+			abort();
+		return ptr;
+	}
+
+	void Free(const Allocator& a, void* ptr)
+	{
+		if (_freeCount++ % LATENCY_SAMPLE == 0)
+		{
+			unsigned long long t0 = NowNs();
+			a._free(ptr);
+			_free.push_back(Clamp(NowNs() - t0));
+		}
+		else
+		{
+			a._free(ptr);
+		}
+	}
+
+	std::vector<uint32_t> _alloc;
+	std::vector<uint32_t> _free;
+
+private:
+	static uint32_t Clamp(unsigned long long ns)
+	{
+		return (uint32_t)std::min<unsigned long long>(ns, UINT32_MAX);
+	}
+
+	size_t _allocCount = 0;
+	size_t _freeCount = 0;
+};
+
+static double Percentile(std::vector<uint32_t>& v, double p)
 {
-	std::vector<std::thread> vthread(nworks);
-	std::atomic<size_t> malloc_costtime = 0;
-	std::atomic<size_t> free_costtime = 0;
+	if (v.empty())
+		return 0;
+	size_t k = (size_t)(p * (v.size() - 1));
+	std::nth_element(v.begin(), v.begin() + k, v.end());
+	return v[k];
+}
 
-	for (size_t k = 0; k < nworks; ++k)
+// 所有场景共用的部分: 起 nthreads 个线程, 都准备好了再一起开始, 计墙上时间、采 RSS、汇总延迟
+// body(t, lat) 是第 t 个线程要做的事, 返回它做了多少次操作
+static RunResult RunThreads(size_t nthreads, const std::function<size_t(size_t, Latency&)>& body)
+{
+	std::vector<Latency> lat(nthreads);
+	std::vector<size_t> ops(nthreads, 0);
+
+	RssMonitor rss;
+	rss.Start();
+
+	std::atomic<size_t> ready{ 0 };
+	std::atomic<bool> go{ false };
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < nthreads; ++t)
+	{
+		threads.emplace_back([&, t]() {
+			++ready;
+			while (!go.load(std::memory_order_acquire))
+				std::this_thread::yield();
+
+			ops[t] = body(t, lat[t]);
+		});
+	}
+
+	while (ready.load() < nthreads)
+		std::this_thread::yield();
+	unsigned long long start = NowNs();
+	go.store(true, std::memory_order_release);
+	for (auto& th : threads)
+		th.join();
+	unsigned long long wall = std::max<unsigned long long>(1, NowNs() - start);
+
+	RunResult res;
+	rss.Stop(res._rssPeakKb, res._rssSteadyKb);
+
+	std::vector<uint32_t> al, fl;
+	for (size_t t = 0; t < nthreads; ++t)
 	{
-		vthread[k] = std::thread([&]() {
-			std::vector<void*> v;
-			v.reserve(ntimes);
+		al.insert(al.end(), lat[t]._alloc.begin(), lat[t]._alloc.end());
+		fl.insert(fl.end(), lat[t]._free.begin(), lat[t]._free.end());
+		res._ops += ops[t];
+	}
+
+	res._threads = nthreads;
+	res._wallMs = wall / 1e6;
+	res._nsPerOp = res._ops == 0 ? 0 : (double)wall * nthreads / res._ops;
+	res._mops = res._ops / (wall / 1e9) / 1e6;
+	res._allocP50 = Percentile(al, 0.50);
+	res._allocP99 = Percentile(al, 0.99);
+	res._allocP999 = Percentile(al, 0.999);
+	res._freeP50 = Percentile(fl, 0.50);
+	res._freeP99 = Percentile(fl, 0.99);
+	res._freeP999 = Percentile(fl, 0.999);
+	res._ok = true;
+	return res;
+}
+
+// 每组多少批: 每个线程大约做 ops 次操作(申请和释放各算一次)
+static size_t Rounds(const Config& cfg)
+{
+	return std::max<size_t>(1, cfg._ops / (2 * cfg._batch));
+}
+
+// batch: 每个线程一批申请 batch 个对象(写一下第一个字节), 再按申请的顺序全部释放, 重复 rounds 次
+// 对象都在申请它的线程上释放, 是 ThreadCache 最理想的情况
+static RunResult RunBatch(const Allocator& a, const std::string& dist, size_t nthreads, const Config& cfg)
+{
+	size_t rounds = Rounds(cfg);
+	size_t perThread = rounds * cfg._batch;
+
+	std::vector<std::vector<size_t>> sizes(nthreads);
+	for (size_t t = 0; t < nthreads; ++t)
+		sizes[t] = GenerateSizes(dist, perThread, 12345 + t);
+
+	return RunThreads(nthreads, [&](size_t t, Latency& lat) {
+		const std::vector<size_t>& sz = sizes[t];
+		std::vector<void*> v(cfg._batch);
+		lat.Reserve(perThread, perThread);
+
+		size_t k = 0;
+		for (size_t r = 0; r < rounds; ++r)
+		{
+			for (size_t i = 0; i < cfg._batch; ++i, ++k)
+			{
+				v[i] = lat.Alloc(a, sz[k]);
+				*(char*)v[i] = (char)k;
+			}
+			for (size_t i = 0; i < cfg._batch; ++i)
+				lat.Free(a, v[i]);
+		}
+		return 2 * perThread;
+	});
+}
+
+// 线程之间传一批对象用的队列; 一次传一整批(默认 1000 个对象), 加锁的 deque 就够了, 锁的开销摊得很薄
+struct Batch
+{
+	std::vector<void*> _ptrs;
+	size_t _owner = 0;		// 哪个线程申请的, 释放完以后批还给它
+};
+
+class BatchQueue
+{
+public:
+	void Push(Batch* b)
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		_q.push_back(b);
+	}
+
+	Batch* TryPop()
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		if (_q.empty())
+			return nullptr;
+		Batch* b = _q.front();
+		_q.pop_front();
+		return b;
+	}
+
+private:
+	std::mutex _mtx;
+	std::deque<Batch*> _q;
+};
+
+// 每个生产者同时在路上的批数, 限制住没释放的对象有多少
+static const size_t BATCHES_IN_FLIGHT = 4;
+
+// 跨线程释放: 生产者申请一批对象发给消费者, 消费者全部释放以后把空批还回去
+//   ring   : n 个线程围成一圈, 每个线程申请的对象交给下一个线程释放, 每个线程既是生产者也是消费者
+//   fanin  : n-1 个生产者, 1 个消费者释放所有对象
+//   fanout : 1 个生产者, 轮流发给 n-1 个消费者
+// 释放的对象都不是当前线程申请的, 会走到 ListTooLong -> ReleaseListToSpans 把对象还回别的线程切出来的 Span
+static RunResult RunCrossThread(const Allocator& a, const std::string& scenario, const std::string& dist,
+	size_t nthreads, const Config& cfg)
+{
+	struct Role
+	{
+		size_t _produce = 0;				// 要生产多少批
+		size_t _consume = 0;				// 要消费多少批
+		std::vector<size_t> _targets;		// 生产的批轮流发给谁
+	};
+
+	size_t rounds = Rounds(cfg);
+	std::vector<Role> roles(nthreads);
+	if (scenario == "ring")
+	{
+		for (size_t t = 0; t < nthreads; ++t)
+		{
+			roles[t]._produce = roles[t]._consume = rounds;
+			roles[t]._targets.push_back((t + 1) % nthreads);
+		}
+	}
+	else if (scenario == "fanin")
+	{
+		for (size_t t = 0; t + 1 < nthreads; ++t)
+		{
+			roles[t]._produce = rounds;
+			roles[t]._targets.push_back(nthreads - 1);
+		}
+		roles[nthreads - 1]._consume = rounds * (nthreads - 1);
+	}
+	else
+	{
+		roles[0]._produce = rounds * (nthreads - 1);
+		for (size_t t = 1; t < nthreads; ++t)
+		{
+			roles[0]._targets.push_back(t);
+			roles[t]._consume = rounds;
+		}
+	}
+
+	std::vector<std::vector<size_t>> sizes(nthreads);
+	std::vector<BatchQueue> inbox(nthreads), empty(nthreads);
+	std::vector<std::unique_ptr<Batch>> batches;
+	for (size_t t = 0; t < nthreads; ++t)
+	{
+		if (roles[t]._produce == 0)
+			continue;
+
+		sizes[t] = GenerateSizes(dist, roles[t]._produce * cfg._batch, 12345 + t);
+		for (size_t i = 0; i < BATCHES_IN_FLIGHT; ++i)
+		{
+			batches.emplace_back(new Batch);
+			batches.back()->_ptrs.resize(cfg._batch);
+			batches.back()->_owner = t;
+			empty[t].Push(batches.back().get());
+		}
+	}
 
-			for (size_t j = 0; j < rounds; ++j)
+	return RunThreads(nthreads, [&](size_t t, Latency& lat) {
+		const Role& role = roles[t];
+		const std::vector<size_t>& sz = sizes[t];
+		lat.Reserve(role._produce * cfg._batch, role._consume * cfg._batch);
+
+		size_t produced = 0, consumed = 0, k = 0;
+		while (produced < role._produce || consumed < role._consume)
+		{
+			bool progress = false;
+			if (produced < role._produce)
 			{
-				size_t begin1 = clock();
-				for (size_t i = 0; i < ntimes; i++)
+				if (Batch* b = empty[t].TryPop())
 				{
-					//v.push_back(ConcurrentAlloc(16));
-					v.push_back(ConcurrentAlloc((16 + i) % 8192 + 1));
+					for (void*& p : b->_ptrs)
+					{
+						p = lat.Alloc(a, sz[k]);
+						*(char*)p = (char)k++;
+					}
+					inbox[role._targets[produced % role._targets.size()]].Push(b);
+					++produced;
+					progress = true;
 				}
-				size_t end1 = clock();
-
-				size_t begin2 = clock();
-				for (size_t i = 0; i < ntimes; i++)
+			}
+			if (consumed < role._consume)
+			{
+				if (Batch* b = inbox[t].TryPop())
 				{
-					ConcurrentFree(v[i]);
+					for (void* p : b->_ptrs)
+						lat.Free(a, p);
+					empty[b->_owner].Push(b);
+					++consumed;
+					progress = true;
 				}
-				size_t end2 = clock();
-				v.clear();
+			}
+			if (!progress)
+				std::this_thread::yield();
+		}
+		return (produced + consumed) * cfg._batch;
+	});
+}
+
+// 锁持有时间直方图的分位数: 桶是从 128ns 开始翻倍分的, 返回落到的那个桶的上界
+static double HoldPercentile(const size_t* hist, double p)
+{
+	size_t total = 0;
+	for (size_t i = 0; i < LockStats::HOLD_BUCKETS; ++i)
+		total += hist[i];
+	if (total == 0)
+		return 0;
 
-				malloc_costtime += (end1 - begin1);
-				free_costtime += (end2 - begin2);
+	size_t seen = 0;
+	for (size_t i = 0; i < LockStats::HOLD_BUCKETS; ++i)
+	{
+		seen += hist[i];
+		if (seen >= p * total)
+			return (double)(128ull << i);
+	}
+	return (double)(128ull << (LockStats::HOLD_BUCKETS - 1));
+}
+
+// frag: 每个线程交替申请 2 * batch 个对象, 放掉奇数位置的, 之后每一轮把这一半申请回来再按随机顺序释放
+// 大小是 MAX_BYTES 加上分布里的大小, 每个对象都是单独的span(大多是 33 页), 直接从 page cache 的桶里取、还回桶里;
+// 每个空闲span两边都是在用的span, 合并不起来, 同一个桶里一直挂着很多地址乱序的span
+// 内存池额外报告 page cache 大锁每次拿着多久: 碎片再多也不能变长
+static RunResult RunFrag(const Allocator& a, const std::string& dist, size_t nthreads, const Config& cfg)
+{
+	size_t rounds = Rounds(cfg);
+	std::vector<std::vector<size_t>> sizes(nthreads);
+	for (size_t t = 0; t < nthreads; ++t)
+	{
+		sizes[t] = GenerateSizes(dist, 2 * cfg._batch, 12345 + t);
+		for (size_t& s : sizes[t])
+			s += MAX_BYTES;
+	}
+
+	// 只在这个场景里打开锁统计, 不影响别的场景的计时
+	bool pool = a._alloc == PoolAlloc;
+	bool lockStats = lockStatsEnabled.load(std::memory_order_relaxed);
+	LockStatsSnapshot before;
+	if (pool)
+	{
+		ConcurrentSetLockStats(true);
+		before = ConcurrentGetStats()._pageHeap._lock;
+	}
+
+	RunResult res = RunThreads(nthreads, [&](size_t t, Latency& lat) {
+		const std::vector<size_t>& sz = sizes[t];
+		std::vector<void*> v(2 * cfg._batch);
+		std::vector<size_t> churn;
+		std::mt19937_64 rng(777 + t);
+		lat.Reserve(v.size() + rounds * cfg._batch, v.size() + rounds * cfg._batch);
+
+		for (size_t i = 0; i < v.size(); ++i)
+		{
+			v[i] = lat.Alloc(a, sz[i]);
+			*(char*)v[i] = (char)i;
+			if (i % 2 == 1)
+				churn.push_back(i);
+		}
+		for (size_t i : churn)
+			lat.Free(a, v[i]);
+
+		for (size_t r = 0; r < rounds; ++r)
+		{
+			for (size_t i : churn)
+			{
+				v[i] = lat.Alloc(a, sz[i]);
+				*(char*)v[i] = (char)r;
 			}
-			});
+			std::shuffle(churn.begin(), churn.end(), rng);
+			for (size_t i : churn)
+				lat.Free(a, v[i]);
+		}
+
+		for (size_t i = 0; i < v.size(); i += 2)
+			lat.Free(a, v[i]);
+		return 2 * (v.size() + rounds * churn.size());
+	});
+
+	if (pool)
+	{
+		LockStatsSnapshot after = ConcurrentGetStats()._pageHeap._lock;
+		size_t hist[LockStats::HOLD_BUCKETS];
+		for (size_t i = 0; i < LockStats::HOLD_BUCKETS; ++i)
+			hist[i] = after._holdHistogram[i] - before._holdHistogram[i];
+		res._pageHoldP50 = HoldPercentile(hist, 0.50);
+		res._pageHoldP99 = HoldPercentile(hist, 0.99);
+		ConcurrentSetLockStats(lockStats);
+	}
+	return res;
+}
+
+// 回放记录下来的申请释放序列, 两种格式:
+//   文本格式, 每行一个事件 "thread op size id": op 是 a(申请) 或 f(释放), id 标识一个对象, 释放以后可以被重用
+//   CMP_ALLOC_TRACE / ConcurrentStartAllocationTrace 记录的二进制文件(见 AllocTracer.h), id 就是对象地址
+// 事件按发生的顺序排列; 回放时每个 thread 一个线程, 按自己的事件顺序执行,
+// 释放别的线程申请的对象时先等那个线程把它申请出来, 这样跨线程的申请释放关系和记录时一致
+struct ReplayEvent
+{
+	uint32_t _slot;		// 对象编号(同一个 id 每次申请都是一个新的对象)
+	uint32_t _size;
+	bool _free;
+};
+
+static std::vector<std::vector<ReplayEvent>> replayThreads;
+static size_t replaySlots = 0;
+
+// 按发生的顺序一条一条加事件, 分到各自的线程, 给每个对象编号
+class ReplayBuilder
+{
+public:
+	void Add(unsigned long long thread, bool isFree, unsigned long long size, unsigned long long id)
+	{
+		auto ti = _threadIndex.find(thread);
+		if (ti == _threadIndex.end())
+		{
+			ti = _threadIndex.emplace(thread, replayThreads.size()).first;
+			replayThreads.emplace_back();
+		}
+
+		ReplayEvent ev;
+		ev._size = (uint32_t)std::max<unsigned long long>(1, size);
+		if (!isFree)
+		{
+			ev._slot = (uint32_t)replaySlots++;
+			ev._free = false;
+			_live[id] = ev._slot;
+		}
+		else
+		{
+			// 记录开始前就申请好的对象, 回放里没有, 跳过
+			auto it = _live.find(id);
+			if (it == _live.end())
+				return;
+			ev._slot = it->second;
+			ev._free = true;
+			_live.erase(it);
+		}
+		replayThreads[ti->second].push_back(ev);
 	}
 
-	for (auto& t : vthread)
+private:
+	std::unordered_map<unsigned long long, size_t> _threadIndex;
+	std::unordered_map<unsigned long long, uint32_t> _live;		// id -> 当前还没释放的对象编号
+};
+
+static bool LoadReplay(const std::string& path)
+{
+	ReplayBuilder builder;
+
+	// 先当成二进制的记录文件读, 文件头对不上再按文本读
+	std::vector<TraceEvent> events;
+	if (AllocTracer::ReadTrace(path.c_str(), events))
 	{
-		t.join();
+		for (const TraceEvent& ev : events)
+			builder.Add(ev._thread, ev._free, ev._size, ev._ptr);
+		return !replayThreads.empty();
 	}
 
-	printf("%u ִ̲߳ %u ִ, ÿ concurrent Alloc  %u ,  %u ms\n",
-		nworks, rounds, ntimes, malloc_costtime.load());
+	std::ifstream in(path);
+	if (!in)
+		return false;
 
-	printf("%u ִ̲߳ %u ִ, ÿ Concurrent Dealloc  %u ,  %u ms\n",
-		nworks, rounds, ntimes, free_costtime.load());
+	std::string line;
+	while (std::getline(in, line))
+	{
+		if (line.empty() || line[0] == '#')
+			continue;
 
-	printf("%u ̲߳ Concurrent Alloc && Concurrent Dealloc  %u , ܼƻ %u ms\n",
-		nworks, nworks * rounds * ntimes, malloc_costtime.load() + free_costtime.load());
+		std::istringstream ss(line);
+		unsigned long long thread = 0, size = 0, id = 0;
+		std::string op;
+		if (!(ss >> thread >> op >> size >> id) || (op != "a" && op != "f"))
+			return false;
+		builder.Add(thread, op == "f", size, id);
+	}
+	return !replayThreads.empty();
 }
 
-int main()
+static RunResult RunReplay(const Allocator& a)
 {
-	size_t n = 10000;
-	cout << "==========================================================" << endl;
-	BenchmarkConcurrentMalloc(n, 4, 10);
-	cout << endl << endl;
+	std::unique_ptr<std::atomic<void*>[]> slots(new std::atomic<void*>[replaySlots]);
+	for (size_t i = 0; i < replaySlots; ++i)
+		slots[i].store(nullptr, std::memory_order_relaxed);
 
-	BenchmarkMalloc(n, 4, 10);
-	cout << "==========================================================" << endl;
+	RunResult res = RunThreads(replayThreads.size(), [&](size_t t, Latency& lat) {
+		const std::vector<ReplayEvent>& events = replayThreads[t];
+		lat.Reserve(events.size(), events.size());
 
+		for (const ReplayEvent& ev : events)
+		{
+			if (!ev._free)
+			{
+				void* p = lat.Alloc(a, ev._size);
+				*(char*)p = 0;
+				slots[ev._slot].store(p, std::memory_order_release);
+			}
+			else
+			{
+				void* p;
+				while ((p = slots[ev._slot].load(std::memory_order_acquire)) == nullptr)
+					std::this_thread::yield();
+				slots[ev._slot].store(nullptr, std::memory_order_relaxed);
+				lat.Free(a, p);
+			}
+		}
+		return events.size();
+	});
+
+	// 记录结束时还没释放的对象, 不计时
+	for (size_t i = 0; i < replaySlots; ++i)
+	{
+		if (void* p = slots[i].load(std::memory_order_relaxed))
+			a._free(p);
+	}
+	return res;
+}
+
+static RunResult RunScenario(const Allocator& a, const std::string& scenario, const std::string& dist,
+	size_t nthreads, const Config& cfg)
+{
+	if (scenario == "batch")
+		return RunBatch(a, dist, nthreads, cfg);
+	if (scenario == "replay")
+		return RunReplay(a);
+	if (scenario == "frag")
+		return RunFrag(a, dist, nthreads, cfg);
+	return RunCrossThread(a, scenario, dist, nthreads, cfg);
+}
+
+// linux 下在子进程里跑: 每组配置的 RSS 从干净的进程开始算, 分配器之间也不会互相影响
+static RunResult RunIsolated(const Allocator& a, const std::string& scenario, const std::string& dist,
+	size_t nthreads, const Config& cfg)
+{
+#ifndef _WIN32
+	if (cfg._fork)
+	{
+		int fds[2];
+		if (pipe(fds) == 0)
+		{
+			pid_t pid = fork();
+			if (pid == 0)
+			{
+				close(fds[0]);
+				RunResult res = RunScenario(a, scenario, dist, nthreads, cfg);
+				ssize_t n = write(fds[1], &res, sizeof(res));
+				_exit(n == (ssize_t)sizeof(res) ? 0 : 1);
+			}
+
+			close(fds[1]);
+			RunResult res;
+			if (pid > 0)
+			{
+				ssize_t n = read(fds[0], &res, sizeof(res));
+				int status = 0;
+				waitpid(pid, &status, 0);
+				if (n != (ssize_t)sizeof(res))
+					res._ok = false;
+			}
+			close(fds[0]);
+			if (pid > 0)
+				return res;
+		}
+	}
+#endif
+	return RunScenario(a, scenario, dist, nthreads, cfg);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// 输出
+
+struct Row
+{
+	std::string _allocator;
+	std::string _scenario;
+	std::string _dist;
+	RunResult _res;
+};
+
+static void PrintHeader()
+{
+	printf("%-10s %-10s %-9s %7s %10s %8s %8s %28s %28s %20s %20s\n",
+		"allocator", "scenario", "dist", "threads", "ops", "ns/op", "Mops/s",
+		"alloc p50/p99/p999 ns", "free p50/p99/p999 ns", "rss peak/steady MB", "page hold p50/p99 ns");
+}
+
+static void PrintRow(const Row& r)
+{
+	const RunResult& x = r._res;
+	char alloc[64], fr[64], rss[64], hold[64];
+	snprintf(alloc, sizeof(alloc), "%.0f/%.0f/%.0f", x._allocP50, x._allocP99, x._allocP999);
+	snprintf(fr, sizeof(fr), "%.0f/%.0f/%.0f", x._freeP50, x._freeP99, x._freeP999);
+	snprintf(rss, sizeof(rss), "%.1f/%.1f", x._rssPeakKb / 1024.0, x._rssSteadyKb / 1024.0);
+	if (x._pageHoldP99 > 0)
+		snprintf(hold, sizeof(hold), "%.0f/%.0f", x._pageHoldP50, x._pageHoldP99);
+	else
+		snprintf(hold, sizeof(hold), "-");
+	printf("%-10s %-10s %-9s %7zu %10zu %8.1f %8.2f %28s %28s %20s %20s\n",
+		r._allocator.c_str(), r._scenario.c_str(), r._dist.c_str(), x._threads, x._ops,
+		x._nsPerOp, x._mops, alloc, fr, rss, hold);
+}
+
+static bool WriteCsv(const std::string& path, const std::vector<Row>& rows)
+{
+	FILE* f = fopen(path.c_str(), "w");
+	if (f == nullptr)
+		return false;
+	fprintf(f, "allocator,scenario,dist,threads,ops,wall_ms,ns_per_op,mops,"
+		"alloc_p50_ns,alloc_p99_ns,alloc_p999_ns,free_p50_ns,free_p99_ns,free_p999_ns,rss_peak_kb,rss_steady_kb,"
+		"page_hold_p50_ns,page_hold_p99_ns\n");
+	for (const Row& r : rows)
+	{
+		const RunResult& x = r._res;
+		fprintf(f, "%s,%s,%s,%zu,%zu,%.3f,%.3f,%.3f,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f,%zu,%zu,%.0f,%.0f\n",
+			r._allocator.c_str(), r._scenario.c_str(), r._dist.c_str(), x._threads, x._ops, x._wallMs, x._nsPerOp, x._mops,
+			x._allocP50, x._allocP99, x._allocP999, x._freeP50, x._freeP99, x._freeP999, x._rssPeakKb, x._rssSteadyKb,
+			x._pageHoldP50, x._pageHoldP99);
+	}
+	fclose(f);
+	return true;
+}
+
+static bool WriteJson(const std::string& path, const std::vector<Row>& rows)
+{
+	FILE* f = fopen(path.c_str(), "w");
+	if (f == nullptr)
+		return false;
+	fprintf(f, "[");
+	for (size_t i = 0; i < rows.size(); ++i)
+	{
+		const Row& r = rows[i];
+		const RunResult& x = r._res;
+		fprintf(f, "%s\n  {\"allocator\": \"%s\", \"scenario\": \"%s\", \"dist\": \"%s\", \"threads\": %zu, \"ops\": %zu, "
+			"\"wall_ms\": %.3f, \"ns_per_op\": %.3f, \"mops\": %.3f, "
+			"\"alloc_ns\": {\"p50\": %.0f, \"p99\": %.0f, \"p999\": %.0f}, "
+			"\"free_ns\": {\"p50\": %.0f, \"p99\": %.0f, \"p999\": %.0f}, "
+			"\"rss_peak_kb\": %zu, \"rss_steady_kb\": %zu, "
+			"\"page_hold_ns\": {\"p50\": %.0f, \"p99\": %.0f}}",
+			i == 0 ? "" : ",", r._allocator.c_str(), r._scenario.c_str(), r._dist.c_str(), x._threads, x._ops,
+			x._wallMs, x._nsPerOp, x._mops, x._allocP50, x._allocP99, x._allocP999,
+			x._freeP50, x._freeP99, x._freeP999, x._rssPeakKb, x._rssSteadyKb, x._pageHoldP50, x._pageHoldP99);
+	}
+	fprintf(f, "\n]\n");
+	fclose(f);
+	return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// "1,2,4" 这样用逗号分开的列表
+static std::vector<std::string> SplitList(const std::string& s)
+{
+	std::vector<std::string> out;
+	std::string item;
+	std::istringstream ss(s);
+	while (std::getline(ss, item, ','))
+	{
+		if (!item.empty())
+			out.push_back(item);
+	}
+	return out;
+}
+
+static void Usage()
+{
+	cout << "usage: BenchMark [--scenarios batch,ring,fanin,fanout,frag] [--replay events]" << endl
+		<< "                 [--threads 1,2,4,8] [--dists fixed,uniform,powerlaw,trace] [--trace histogram]" << endl
+		<< "                 [--allocators pool,malloc,jemalloc,tcmalloc] [--ops N] [--batch N]" << endl
+		<< "                 [--csv file] [--json file] [--no-fork] [--quick]" << endl;
+}
+
+static bool ParseArgs(int argc, char** argv, Config& cfg)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--threads" && hasValue)
+		{
+			cfg._threads.clear();
+			for (const std::string& t : SplitList(argv[++i]))
+				cfg._threads.push_back((size_t)std::max(1, atoi(t.c_str())));
+		}
+		else if (arg == "--scenarios" && hasValue)
+			cfg._scenarios = SplitList(argv[++i]);
+		else if (arg == "--replay" && hasValue)
+			cfg._replayFile = argv[++i];
+		else if (arg == "--dists" && hasValue)
+			cfg._dists = SplitList(argv[++i]);
+		else if (arg == "--allocators" && hasValue)
+			cfg._allocators = SplitList(argv[++i]);
+		else if (arg == "--trace" && hasValue)
+			cfg._traceFile = argv[++i];
+		else if (arg == "--ops" && hasValue)
+			cfg._ops = (size_t)strtoull(argv[++i], nullptr, 10);
+		else if (arg == "--batch" && hasValue)
+			cfg._batch = std::max<size_t>(1, (size_t)strtoull(argv[++i], nullptr, 10));
+		else if (arg == "--csv" && hasValue)
+			cfg._csvFile = argv[++i];
+		else if (arg == "--json" && hasValue)
+			cfg._jsonFile = argv[++i];
+		else if (arg == "--no-fork")
+			cfg._fork = false;
+		else if (arg == "--quick")
+		{
+			// 冒烟测试用: 很少的操作数, 只跑 1 和 2 个线程
+			cfg._ops = 20000;
+			cfg._batch = 500;
+			cfg._threads = { 1, 2 };
+		}
+		else
+			return false;
+	}
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	Config cfg;
+	if (!ParseArgs(argc, argv, cfg))
+	{
+		Usage();
+		return 1;
+	}
+
+	// 给了直方图文件就加上按记录的大小分布跑的那一组
+	if (!cfg._traceFile.empty())
+	{
+		if (!LoadTrace(cfg._traceFile))
+		{
+			cout << "cannot read trace histogram: " << cfg._traceFile << endl;
+			return 1;
+		}
+		if (std::find(cfg._dists.begin(), cfg._dists.end(), "trace") == cfg._dists.end())
+			cfg._dists.push_back("trace");
+	}
+	else
+	{
+		cfg._dists.erase(std::remove(cfg._dists.begin(), cfg._dists.end(), "trace"), cfg._dists.end());
+	}
+
+	// 给了事件文件就加上回放
+	if (!cfg._replayFile.empty())
+	{
+		if (!LoadReplay(cfg._replayFile))
+		{
+			cout << "cannot read replay events: " << cfg._replayFile << endl;
+			return 1;
+		}
+		if (std::find(cfg._scenarios.begin(), cfg._scenarios.end(), "replay") == cfg._scenarios.end())
+			cfg._scenarios.push_back("replay");
+	}
+	else
+	{
+		cfg._scenarios.erase(std::remove(cfg._scenarios.begin(), cfg._scenarios.end(), "replay"), cfg._scenarios.end());
+	}
+
+	for (const std::string& s : cfg._scenarios)
+	{
+		if (s != "batch" && s != "ring" && s != "fanin" && s != "fanout" && s != "frag" && s != "replay")
+		{
+			cout << "unknown scenario: " << s << endl;
+			return 1;
+		}
+	}
+
+	std::vector<Allocator> allocators;
+	for (const std::string& name : cfg._allocators)
+	{
+		Allocator a;
+		if (FindAllocator(name, a))
+			allocators.push_back(a);
+		else
+			cout << "allocator " << name << " not found, skipped" << endl;
+	}
+
+	std::vector<Row> rows;
+	PrintHeader();
+	auto run = [&](const Allocator& a, const std::string& scenario, const std::string& dist, size_t nthreads) {
+		Row row = { a._name, scenario, dist, RunIsolated(a, scenario, dist, nthreads, cfg) };
+		if (!row._res._ok)
+		{
+			cout << a._name << " " << scenario << " " << dist << " " << nthreads << " threads failed" << endl;
+			return false;
+		}
+		PrintRow(row);
+		rows.push_back(row);
+		return true;
+	};
+
+	for (const std::string& scenario : cfg._scenarios)
+	{
+		// 回放的线程数和大小都来自事件文件
+		if (scenario == "replay")
+		{
+			for (const Allocator& a : allocators)
+			{
+				if (!run(a, scenario, "-", replayThreads.size()))
+					return 1;
+			}
+			continue;
+		}
+
+		for (const std::string& dist : cfg._dists)
+		{
+			for (size_t nthreads : cfg._threads)
+			{
+				// fanin / fanout 至少要一个生产者和一个消费者
+				if ((scenario == "fanin" || scenario == "fanout") && nthreads < 2)
+					continue;
+
+				for (const Allocator& a : allocators)
+				{
+					if (!run(a, scenario, dist, nthreads))
+						return 1;
+				}
+			}
+		}
+	}
+
+	if (!cfg._csvFile.empty() && !WriteCsv(cfg._csvFile, rows))
+	{
+		cout << "cannot write " << cfg._csvFile << endl;
+		return 1;
+	}
+	if (!cfg._jsonFile.empty() && !WriteJson(cfg._jsonFile, rows))
+	{
+		cout << "cannot write " << cfg._jsonFile << endl;
+		return 1;
+	}
 	return 0;
-}
\ No newline at end of file
+}
@@ -1,112 +1,153 @@
-#define _CRT_SECURE_NO_WARNINGS 1
+﻿#define _CRT_SECURE_NO_WARNINGS 1
 
 #include "CentralCache.h"
 #include "PageCache.h"
+#include "Stats.h"
 
-// ʼ̬Ա
-CentralCache CentralCache::_sInst;
+// span 里是否还有对象可以分配: 还回来的对象, 或者还没切过的部分
+static inline bool HasFreeObject(Span* span)
+{
+	return span->_freelist != nullptr || span->_carved < span->_capacity;
+}
 
-// SpanListpage cacheȡһǿյspan
+// 从SpanList或者page cache获取一个非空的span
 Span* CentralCache::GetOneSpan(SpanList& list, size_t size)
 {
-	// 1. 鿴ǰspanlistǷδspan
-	Span* it = list.Begin();
-	while (it != list.End())
+	// 1. 查看当前的spanlist中是否还有未分配对象的span
+	// 分配满了的span都挪到了 _fullSpanLists 里, 所以这里只要不空, 第一个就有对象
+	if (!list.Empty())
 	{
-		// spanlistΪ, ô˵ж
-		if (it->_freelist != nullptr)
-		{
-			return it;
-		}
-		else // Ϊ, ôȥһspan
-		{
-			it = it->_next;
-		}
+		assert(HasFreeObject(list.Begin()));
+		return list.Begin();
 	}
 
-	// page cache֮ǰȰcentralͰ
-	// ߳ͷŻͲ
+	// 在找page cache之前，先把central的桶锁给解除掉，
+	// 这样如果其他线程释放回来，就不会阻塞
 	list._mtx.unlock();
 
-	// 2. ߵ˵ûпеspan, ֻpage cacheҪ
-	PageCache::getInstance()->_pageMtx.lock();	// page cache
+	// 2. 走到这里说明没有空闲的span了, 只能找page cache要
+	PageCache::getInstance()->_pageMtx.lock();	// 给page cache整体加锁
 	Span* span = PageCache::getInstance()->NewSpan(SizeClass::NumMovePage(size));
-	span->_isUse = true;
-	span->_objSize = size;
-	PageCache::getInstance()->_pageMtx.unlock();// page cache
-
-	// ǶԻȡspanз֣ҪΪ̷߳ʲspan
-
-	//	2.1 ͨҳţspanҳĴڴʼַҳ <<= page_shift ( ҳ * ÿҳĴС * 1024)
-	char* start = (char*)(span->_pageId << PAGE_SHIFT);
-
-	//	2.2 spanĴڴĴС
-	size_t bytes = span->_n << PAGE_SHIFT;
-	char* end = start + bytes;
-
-	// 3. spanз, Ѵڴг
-	//	3.1 һȥͷβ
-	span->_freelist = start;
-	start += size;
-	void* tail = span->_freelist;
-	// β
-	// Ҫעһһbug£spanһСڴ
-	// ܲСȥʹûԽ⣬԰
-	// ""ɣõڴй©ΪspanĶʹԺpage cache
-	// ǰҳյģСڴֻȥˡ
-	// while (start < end) bugд
-	while (start + size < end)
-	{
-		NextObj(tail) = start;
-		tail = NextObj(tail);
-		start += size;
-	}
-	NextObj(tail) = nullptr;
-
-	// кspanԺҪspanҵͰȥʱټ
+	if (span != nullptr)
+	{
+		span->_isUse = true;
+		span->_objSize = size;
+	}
+	PageCache::getInstance()->_pageMtx.unlock();// 给page cache整体解锁
+
+	// 向系统要不到内存了: 锁都恢复成进来时的样子(桶锁拿着), 由调用方解锁后返回失败
+	if (span == nullptr)
+	{
+		list._mtx.lock();
+		return nullptr;
+	}
+
+	// 以前这里要把整个span切成自由链表: 要写span里每一个对象(最多 1MB), 还没分配出去就把所有页都访问了一遍
+	// 现在只记下能切多少个对象, 分配时再从头往后切(见 FetchRangeObj), 用到哪页才会访问哪页
+	// 最后不够一个对象的零头不用, span 的对象都还回来以后 page cache 按页回收, 这点零头也就回去了
+	span->_freelist = nullptr;
+	span->_carved = 0;
+	span->_capacity = (span->_n << PAGE_SHIFT) / size;
+
+	// 需要把span挂到桶里面去的时候，再加锁
 	list._mtx.lock();
 
-	// 3.2 span뵽listȥ
+	// 3. 把span插入到list里面去
 	list.PushFront(span);
 
+	size_t index = SizeClass::Index(size);
+	_numSpans[index].Add(1);
+	_spanFetches[index].Add(1);
+	_numObjects[index].Add(span->_capacity);
+	_numFreeObjects[index].Add(span->_capacity);
+
 	return span;
 }
 
-// ĻȡһĶthread cache
+// 从中心缓存获取一定数量的对象给thread cache
 size_t CentralCache::FetchRangeObj(void*& start, void*& end, size_t batchNum, size_t size)
 {
-	// 1. Ͱλ(Ϊ thread cache  central cache ĹϣͰһһӦ, һ, ҪĸͰ)
+	// 1. 计算桶的位置(因为 thread cache 和 central cache 的哈希桶的一一对应的, 所以先算一下, 要的是哪个桶里面的)
 	size_t index = SizeClass::Index(size);
 
-	_spanLists[index]._mtx.lock(); // ȼ
+	// 要的正好是一整批, 先看转运缓存里有没有现成的
+	if (batchNum == SizeClass::ClassNumMoveSize(index))
+	{
+		TransferCache& tc = _transferCaches[index];
+		std::unique_lock<std::mutex> lock(tc._mtx);
+		size_t count = tc._count.Get();
+		if (count > 0)
+		{
+			tc._count.Set(count - 1);
+			start = tc._start[count - 1];
+			end = tc._end[count - 1];
+			return batchNum;
+		}
+	}
+
+	_spanLists[index]._mtx.lock(); // 先加锁
 
-	//  span лȡ batchNum 
-	//  batchNum , ôжöٸ
-	// ȥ spanList һǿյ Span, ûҵ, ôҪȥ page cache 
+	// 从 span 中获取 batchNum 个对象
+	// 如果不够 batchNum 个, 那么就有多少拿多少个
+	// 先去 spanList 里面找一个非空的 Span, 如果没有找到, 那么就需要去 page cache 里面申请
 	Span* span = GetOneSpan(_spanLists[index], size);
-	assert(span);
-	assert(span->_freelist);
+	if (span == nullptr)
+	{
+		_spanLists[index]._mtx.unlock();
+		return 0;
+	}
+	assert(HasFreeObject(span));
+
+	start = nullptr;
+	end = nullptr;
+	size_t actualNum = 0;
+
+	// 1. 先拿还回来的对象, 它们已经串成链表了
+	if (span->_freelist != nullptr)
+	{
+		start = span->_freelist;
+		end = start;
+		actualNum = 1;
+		while (actualNum < batchNum && NextObj(end) != nullptr)	// end->next != nullptr
+		{
+			end = NextObj(end);	// end = end->next
+			++actualNum;
+		}
+		span->_freelist = NextObj(end);
+		NextObj(end) = nullptr;
+	}
 
-	start = span->_freelist;
-	end = start;
-	size_t actualNum = 1;
-	size_t i = 0;
-	while (i < batchNum - 1 && NextObj(end) != nullptr)	// end->next != nullptr
+	// 2. 不够的话再从还没切过的部分按顺序切, 只写真正分出去的对象
+	char* base = (char*)(span->_pageId << PAGE_SHIFT);
+	while (actualNum < batchNum && span->_carved < span->_capacity)
 	{
-		end = NextObj(end);	// end = end->next
-		++i;
+		void* obj = base + span->_carved * span->_objSize;
+		++span->_carved;
+
+		NextObj(obj) = nullptr;
+		if (start == nullptr)
+			start = obj;
+		else
+			NextObj(end) = obj;
+		end = obj;
 		++actualNum;
 	}
-	span->_freelist = NextObj(end);
-	NextObj(end) = nullptr;
-	span->_usecount += actualNum; // ͷõ
+	span->_usecount += actualNum; // 释放流程用的
+	_numFreeObjects[index].Sub(actualNum);
+
+	// span 的对象分完了, 挪到满的链表里, 下次找非空span时就不会再看到它
+	if (!HasFreeObject(span))
+	{
+		_spanLists[index].Erase(span);
+		_fullSpanLists[index].PushFront(span);
+	}
 
-	_spanLists[index]._mtx.unlock(); // ٽ
+	_spanLists[index]._mtx.unlock(); // 再解锁
 
 	return actualNum;
 }
 
-// ThreadCacheһͰһιҵ span
+// ThreadCache把它一个桶里面的一段挂的链表 还给span
 void CentralCache::ReleaseListToSpans(void* start, size_t size)
 {
 	size_t index = SizeClass::Index(size);
@@ -116,36 +157,153 @@ void CentralCache::ReleaseListToSpans(void* start, size_t size)
 	{
 		void* next = NextObj(start);
 
-		// ʼͷ
+		// 开始头插
 		Span* span = PageCache::getInstance()->MapObjectToSpan(start);
+
+		// 满的span还回来第一个对象, 挪回非空的链表
+		if (!HasFreeObject(span))
+		{
+			_fullSpanLists[index].Erase(span);
+			_spanLists[index].PushFront(span);
+		}
+
 		NextObj(start) = span->_freelist;
 		span->_freelist = start;
 		span->_usecount--;
-		
-		// ʱ˵spanзֳȥСڴ涼
+		_numFreeObjects[index].Add(1);
+
+		// 此时，说明span切分出去的所有小块儿内存都回来了
 		if (0 == span->_usecount)	
 		{
-			// 1. Ͱȡspan
+			// 1. 从桶下面取出完整的span
 			_spanLists[index].Erase(span);
+			_numSpans[index].Sub(1);
+			_numObjects[index].Sub(span->_capacity);
+			_numFreeObjects[index].Sub(span->_capacity);
 			span->_freelist = nullptr;
+			span->_carved = 0;
+			span->_capacity = 0;
 			span->_next = nullptr;
 			span->_prev = nullptr;
 
-			// Central CacheͰ
-			// Ϊ߳ҲпܻͰ / ͷڴ
+			// 解除Central Cache的桶锁
+			// 因为其他线程也有可能会在桶里面申请 / 释放内存
 			_spanLists[index]._mtx.unlock();
 
-			// 2. spanͿٻոpage cacheȻpage cacheٳȥǰҳĺϲ
-			// , ͷspanPageCacheʱҪʹPageCache
+			// 2. 这个span就可以再回收给page cache，然后page cache可以再尝试去做前后页的合并
+			// 另外, 释放span给PageCache时，需要使用PageCache的整体锁
 			PageCache::getInstance()->_pageMtx.lock();
 			PageCache::getInstance()->ReleaseSpanToPageCache(span);
 			PageCache::getInstance()->_pageMtx.unlock();
 
-			// Central CacheͰ
+			// 添加Central Cache的桶锁
 			_spanLists[index]._mtx.lock();
 		}
 
 		start = next;
 	}
 	_spanLists[index]._mtx.unlock();
-}
\ No newline at end of file
+}
+
+size_t CentralCache::TransferCapacity(size_t index)
+{
+	size_t batchBytes = SizeClass::ClassNumMoveSize(index) * SizeClass::ClassSize(index);
+	size_t capacity = MAX_TRANSFER_BYTES / batchBytes;
+	if (capacity < 1)
+		capacity = 1;
+	if (capacity > MAX_TRANSFER_BATCHES)
+		capacity = MAX_TRANSFER_BATCHES;
+	return capacity;
+}
+
+void CentralCache::InsertRange(void* start, void* end, size_t n, size_t size)
+{
+	size_t index = SizeClass::Index(size);
+	if (n == SizeClass::ClassNumMoveSize(index))
+	{
+		TransferCache& tc = _transferCaches[index];
+		std::unique_lock<std::mutex> lock(tc._mtx);
+		size_t count = tc._count.Get();
+		if (count < TransferCapacity(index))
+		{
+			tc._start[count] = start;
+			tc._end[count] = end;
+			tc._count.Set(count + 1);
+			return;
+		}
+	}
+
+	// 不是整批或者转运缓存满了
+	ReleaseListToSpans(start, size);
+}
+
+void CentralCache::FlushTransferCaches()
+{
+	for (size_t i = 0; i < NFREELISTS; ++i)
+	{
+		TransferCache& tc = _transferCaches[i];
+		void* starts[MAX_TRANSFER_BATCHES];
+		size_t count = 0;
+		{
+			// 先取出来再还给span, 不要拿着转运缓存的锁去抢桶锁
+			std::unique_lock<std::mutex> lock(tc._mtx);
+			count = tc._count.Get();
+			for (size_t j = 0; j < count; ++j)
+			{
+				starts[j] = tc._start[j];
+			}
+			tc._count.Set(0);
+		}
+
+		for (size_t j = 0; j < count; ++j)
+		{
+			ReleaseListToSpans(starts[j], SizeClass::ClassSize(i));
+		}
+	}
+}
+
+size_t CentralCache::NumTransferBatches(size_t index)
+{
+	std::unique_lock<std::mutex> lock(_transferCaches[index]._mtx);
+	return _transferCaches[index]._count.Get();
+}
+
+// 桶锁和转运缓存的锁从来不会同时拿着, 所以先拿哪种都行
+void CentralCache::LockForFork()
+{
+	for (size_t i = 0; i < NFREELISTS; ++i)
+	{
+		_spanLists[i]._mtx.lock();
+	}
+	for (size_t i = 0; i < NFREELISTS; ++i)
+	{
+		_transferCaches[i]._mtx.lock();
+	}
+}
+
+void CentralCache::UnlockAfterFork()
+{
+	for (size_t i = 0; i < NFREELISTS; ++i)
+	{
+		_transferCaches[i]._mtx.unlock();
+	}
+	for (size_t i = 0; i < NFREELISTS; ++i)
+	{
+		_spanLists[i]._mtx.unlock();
+	}
+}
+
+void CentralCache::CollectStats(AllocatorStats& stats)
+{
+	for (size_t i = 0; i < sizeClassTable._numClasses; ++i)
+	{
+		SizeClassStats& cls = stats._classes[i];
+		cls._spans = _numSpans[i].Get();
+		cls._spanBytes = cls._spans * (SizeClass::ClassNumMovePage(i) << PAGE_SHIFT);
+		cls._objects = _numObjects[i].Get();
+		cls._centralFreeObjects = _numFreeObjects[i].Get();
+		cls._transferObjects = _transferCaches[i]._count.Get() * SizeClass::ClassNumMoveSize(i);
+		cls._spanFetches = _spanFetches[i].Get();
+		cls._lock.Read(_bucketLockStats[i]);
+	}
+}
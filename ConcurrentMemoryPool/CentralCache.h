@@ -1,42 +1,96 @@
-#pragma once
+﻿#pragma once
 
 #include "Common.h"
 
-// ģʽʽ
+struct AllocatorStats;
+
+// 单例模式（懒汉式, Meyers Singleton）
 /*
-* ʽʹ
-* ŵ㣺̰߳ȫC++ ̬Աʼڳʱִ߳У
-* ȱ㣺ʱռڴ棬δʹ˷Դ
+* 原来是饿汉式（程序启动就创建）, 但是把内存池编成 libcmpool.so 替换 malloc 以后,
+* 别的库的全局构造函数可能比我们的静态成员先跑, 那时候调 malloc 就会用到还没构造的单例。
+* 所以改成函数内的静态局部变量: 第一次调用 getInstance 时构造, C++11 保证线程安全。
 */
 class CentralCache
 {
 public:
-	// 3. ̬ԱȫΨһȡʵ
+	// 3. 公共静态成员函数：全局唯一获取实例的入口
 	static CentralCache* getInstance()
 	{
-		return &_sInst;
+		static CentralCache sInst;
+		return &sInst;
 	}
 
-	// ĻȡһĶthread cache
+	// 从中心缓存获取一定数量的对象给thread cache, 向系统要不到内存时返回 0
 	size_t FetchRangeObj(void*& start, void*& end, size_t batchNum, size_t size);
 
-	// SpanListpage cacheȡһǿյspan
+	// 从SpanList或者page cache获取一个非空的span
+	// list 里的 span 都还有空闲对象, 所以直接取第一个就行, 和 span 的个数无关
+	// 向系统要不到内存时返回 nullptr, 返回时桶锁仍然拿着
 	Span* GetOneSpan(SpanList& list, size_t size);
 
-	// һĶͷŵspan
+	// 将一定数量的对象释放到span跨度
 	void ReleaseListToSpans(void* start, size_t size);
 
+	// thread cache 还回来一段链表(start 到 end, 共 n 个对象)
+	// 正好是一整批并且转运缓存没满时直接存进转运缓存, 否则还是一个一个还给span
+	void InsertRange(void* start, void* end, size_t n, size_t size);
+
+	// 把转运缓存里的对象都还给span, span 的对象全回来了才能还给 page cache
+	void FlushTransferCaches();
+
+	// 某个桶的转运缓存里存了几批
+	size_t NumTransferBatches(size_t index);
+
+	// 把每个桶的span数、对象数和转运缓存里的对象数填进统计, 只读计数器, 不加桶锁
+	void CollectStats(AllocatorStats& stats);
+
+	// fork 前后拿住/放开所有的桶锁和转运缓存的锁(见 AtFork.h)
+	void LockForFork();
+	void UnlockAfterFork();
+
 private:
-	SpanList _spanLists[NFREELISTS];	// 뷽ʽӳ
+	// 每个桶的span分成两个链表, 都由 _spanLists[i]._mtx 这把桶锁保护:
+	// 如果都挂在一个链表里, 一个大小类有成千上万个分配满了的span时, 每次找非空span都要从头遍历
+	// span 的 _freelist 为空就在 _fullSpanLists 里, 否则就在 _spanLists 里
+	SpanList _spanLists[NFREELISTS];	// 按对齐方式映射, 还有空闲对象的span
+	SpanList _fullSpanLists[NFREELISTS];	// 对象全部分配出去了的span
+
+	// 转运缓存: 每个桶缓存若干整批(正好 NumMoveSize 个)已经串好的对象链表
+	// 一个线程释放、另一个线程申请的场景下, 整批对象直接在线程之间转手, O(1), 不用一个个查span再挂回span
+	// 用自己的锁, 存取一批只是数组里放一下拿一下, 不会被 span 上的慢操作拖住
+	static const size_t MAX_TRANSFER_BATCHES = 64;		// 每个桶最多存几批
+	static const size_t MAX_TRANSFER_BYTES = 1024 * 1024;	// 每个桶最多存多少字节(至少一批, 中等大小的对象一批大约 256KB)
+	struct TransferCache
+	{
+		std::mutex _mtx;
+		StatCounter _count;	// 存了几批, 在锁里修改, 统计时不加锁读
+		void* _start[MAX_TRANSFER_BATCHES] = {};
+		void* _end[MAX_TRANSFER_BATCHES] = {};
+	};
+	TransferCache _transferCaches[NFREELISTS];
+
+	// 统计用的计数器, 都在桶锁里修改
+	StatCounter _numSpans[NFREELISTS];		// 这个桶有几个span
+	StatCounter _numObjects[NFREELISTS];	// 这些span一共能切多少个对象
+	StatCounter _numFreeObjects[NFREELISTS];	// 其中还在span里空闲的(还回来的和还没切的)
+	StatCounter _spanFetches[NFREELISTS];	// 一共找 page cache 要过几次span
+	LockStats _bucketLockStats[NFREELISTS];	// 桶锁的竞争情况
+
+	// 这个桶的转运缓存最多存几批
+	static size_t TransferCapacity(size_t index);
 
 private:
-	// 1. ˽й캯ֹⲿͨ new/ջʵ
+	// 1. 私有构造函数：禁止外部通过 new/栈实例创建
 	CentralCache()
-	{}
-
-	// 2. ֹ͸ֵ⸴Ƴʵ
-	CentralCache(const CentralCache&) = delete;				// ÿ
-	CentralCache operator=(const CentralCache&) = delete;	// øֵ
+	{
+		LockStats::InitFromEnv();
+		for (size_t i = 0; i < NFREELISTS; ++i)
+		{
+			_spanLists[i]._mtx.SetStats(&_bucketLockStats[i]);
+		}
+	}
 
-	static CentralCache _sInst;	// ʱͳʼʱ
+	// 2. 禁止拷贝构造和赋值运算符（避免复制出多个实例）
+	CentralCache(const CentralCache&) = delete;				// 禁用拷贝构造
+	CentralCache operator=(const CentralCache&) = delete;	// 禁用赋值
 };
\ No newline at end of file
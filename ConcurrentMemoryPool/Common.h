@@ -11,9 +11,17 @@
 #include <ctime>
 #include <atomic>
 #include <cassert>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <chrono>
 
 #include "ObjectPool.h"
 
+#ifdef __linux__
+	#include <sys/syscall.h>
+#endif
+
 using std::cout;
 using std::endl;
 
@@ -28,12 +36,16 @@ static const size_t MAX_BYTES = 256 * 1024;
 static const size_t NFREELISTS = 208; // 哈希桶的总数量
 static const size_t NPAGES = 129;
 static const size_t PAGE_SHIFT = 13; // 页大小转换偏移, 即一页定义为2^13,也就是8KB
+static const size_t HUGEPAGE_SHIFT = 21; // 大页(透明大页 / hugetlbfs)是2^21, 也就是2MB
+static const size_t HUGEPAGE_PAGES = (size_t)1 << (HUGEPAGE_SHIFT - PAGE_SHIFT); // 一个大页有256页
 
 // 32 位平台下: 2^(32-13)=2¹⁹页
-#ifdef _WIN32 
-	typedef size_t PAGE_ID; 
-#elif _WIN64 
+// 64 位平台下: 2^(64-13)=2⁵¹页, size_t不一定够用, 所以用unsigned long long
+// 注意: 64位Windows下_WIN32和_WIN64都有定义, 所以要先判断_WIN64
+#if defined(_WIN64) || defined(__x86_64__) || defined(__aarch64__) || defined(__LP64__)
 	typedef unsigned long long PAGE_ID;
+#else
+	typedef size_t PAGE_ID; 
 #endif
 
 
@@ -71,12 +83,149 @@ inline static void SystemFree(void* ptr)
 #endif
 }*/
 
+// 非对称屏障: 两个线程各写自己的标记再读对方的标记(像 Dekker 算法那样), 中间必须有完整的内存屏障
+// 经常走的一边(线程自己申请释放、写记录)只用编译器屏障 Light, 很少走的一边(从别的线程那里收东西)用 Heavy:
+// 发一次 membarrier, 让所有正在运行的线程都执行一次完整的内存屏障(windows 下是 FlushProcessWriteBuffers)
+// 内核不支持(或者容器里禁用了)时两边都退回到普通的 seq_cst 屏障
+// 用 Light 之前本线程要先调过一次 Init(放在慢路径上, 比如注册线程的时候)
+class AsymmetricBarrier
+{
+public:
+	static void Init()
+	{
+		static bool registered = (_heavyAvailable.store(Register(), std::memory_order_relaxed), true);
+		(void)registered;
+	}
+
+	static void Light()
+	{
+		if (_heavyAvailable.load(std::memory_order_relaxed))
+			std::atomic_signal_fence(std::memory_order_seq_cst);
+		else
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+	}
+
+	static void Heavy()
+	{
+		Init();
+		if (!_heavyAvailable.load(std::memory_order_relaxed))
+		{
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			return;
+		}
+#if defined(__linux__) && defined(__NR_membarrier)
+		syscall(__NR_membarrier, MEMBARRIER_PRIVATE_EXPEDITED, 0);
+#elif defined(_WIN32)
+		FlushProcessWriteBuffers();
+#endif
+	}
+
+private:
+#if defined(__linux__) && defined(__NR_membarrier)
+	static const int MEMBARRIER_PRIVATE_EXPEDITED = 1 << 3;				// linux/membarrier.h 里的命令, 4.14 开始支持
+	static const int MEMBARRIER_REGISTER_PRIVATE_EXPEDITED = 1 << 4;
+#endif
+
+	static bool Register()
+	{
+#if defined(__linux__) && defined(__NR_membarrier)
+		return syscall(__NR_membarrier, MEMBARRIER_REGISTER_PRIVATE_EXPEDITED, 0) == 0;
+#elif defined(_WIN32)
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	inline static std::atomic<bool> _heavyAvailable{ false };
+};
+
+// 属于某个线程的东西(线程缓存、记录用的缓冲区)偶尔要被别的线程收走时的握手
+// 自己的线程用 Enter / Leave 包住读写; 别的线程先 Claim, 做一次 AsymmetricBarrier::Heavy, 等到不 Busy 了再动它, 动完 Release
+// 两边都是先写自己的标记再读对方的, 至少有一边能看到对方: 自己的线程只多两次普通的写和一次读
+// 要收很多个线程时可以先全部 Claim, 只做一次 Heavy
+class ClaimHandshake
+{
+public:
+	void Enter()
+	{
+		while (true)
+		{
+			_busy.store(true, std::memory_order_relaxed);
+			AsymmetricBarrier::Light();
+			if (!_claimed.load(std::memory_order_acquire))
+				return;
+
+			// 别的线程正在收, 让它先收完
+			_busy.store(false, std::memory_order_release);
+			while (_claimed.load(std::memory_order_acquire))
+			{
+				std::this_thread::yield();
+			}
+		}
+	}
+
+	void Leave()
+	{
+		_busy.store(false, std::memory_order_release);
+	}
+
+	void Claim()
+	{
+		_claimed.store(true, std::memory_order_relaxed);
+	}
+
+	bool Busy()
+	{
+		return _busy.load(std::memory_order_acquire);
+	}
+
+	void Release()
+	{
+		_claimed.store(false, std::memory_order_release);
+	}
+
+private:
+	std::atomic<bool> _busy{ false };		// 自己的线程正在读写
+	std::atomic<bool> _claimed{ false };	// 别的线程正在收, 自己的线程要等它收完
+};
+
 // 获取内存对象中存储的头4 or 8字节值，即链接的下一个对象的地址
 static void*& NextObj(void* obj)
 {
 	return *(void**)obj;
 }
 
+// 统计用的计数器: 修改的时候已经持有锁(或者只有一个线程会改), 读的时候不加锁
+// 所以修改用 load + store 而不是 fetch_add, x86 上就是普通的读写, 不会多出一条带 lock 前缀的指令;
+// 读到的值可能稍微过时, 但不会是读了一半的值
+class StatCounter
+{
+public:
+	void Add(size_t n)
+	{
+		_value.store(_value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+	void Sub(size_t n)
+	{
+		_value.store(_value.load(std::memory_order_relaxed) - n, std::memory_order_relaxed);
+	}
+
+	void Set(size_t n)
+	{
+		_value.store(n, std::memory_order_relaxed);
+	}
+
+	size_t Get() const
+	{
+		return _value.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<size_t> _value{ 0 };
+};
+
 // 管理小对象的自由链表
 class FreeList
 {
@@ -93,7 +242,7 @@ public:
 		NextObj(obj) = _freeList;
 		_freeList = obj;
 
-		++_size;
+		_size.Add(1);
 	}
 
 	// 从链表头部取出一个对象，然后返回地址，并从链表头部移除
@@ -105,7 +254,7 @@ public:
 		// 头删
 		void* obj = _freeList;
 		_freeList = NextObj(obj);
-		--_size;
+		_size.Sub(1);
 
 		return obj;
 	}
@@ -116,12 +265,12 @@ public:
 		NextObj(end) = _freeList;
 		_freeList = start;
 
-		_size += n;
+		_size.Add(n);
 	}
 
 	void PopRange(void*& start, void*& end, size_t n)
 	{
-		assert(n >= _size);
+		assert(n <= _size.Get());
 		start = _freeList;
 		end = start;
 
@@ -132,7 +281,7 @@ public:
 		
 		_freeList = NextObj(end);
 		NextObj(end) = nullptr;
-		_size -= n;
+		_size.Sub(n);
 	}
 
 	// 判断链表是否为空
@@ -149,13 +298,13 @@ public:
 
 	size_t Size()
 	{
-		return _size;
+		return _size.Get();
 	}
 
 private:
 	void* _freeList = nullptr;
 	size_t _maxSize = 1;
-	size_t _size = 0;	// 记录个数
+	StatCounter _size;	// 记录个数, 统计接口会在别的线程里读(见 ThreadCache::CollectStats)
 };
 
 
@@ -195,7 +344,7 @@ public:
 	}*/
 
 	// 第二种写法
-	static inline size_t _RoundUp(size_t bytes, size_t alignNum)
+	static constexpr inline size_t _RoundUp(size_t bytes, size_t alignNum)
 	{
 		/*
 		注意：按位与& ---> 两位同时为“1”，结果才为“1”，否则为0
@@ -215,8 +364,11 @@ public:
 	// 注意：把成员函数定义成 static 静态，那么可以直接这样用 SizeClass::RoundUp
 	//       就不需要用对象来调用类内函数
 
+	// 下面这几个 Calc 函数是按区间计算的原始规则, 每次申请释放都走一串 if/else
+	// 现在只在编译期用它们生成大小类表(见后面的 SizeClassTable), 运行时直接查表
+
 	// 对齐大小计算
-	static inline size_t RoundUp(size_t size)
+	static constexpr size_t CalcRoundUp(size_t size)
 	{
 		if (size <= 128)
 		{
@@ -269,7 +421,7 @@ public:
 	// 如果 对齐数alignNum = 8，那么 align_shift = 3，因为 2^3 = 8
 	// 同时 1 << 3 ---> 1 * 2 * 2 * 2 = 1 * 2^3 = 8
 	//		1 >> 3 ---> 1 / 2^3 = 1 / 8 = 0
-	static inline size_t _Index(size_t bytes, size_t align_shift)
+	static constexpr inline size_t _Index(size_t bytes, size_t align_shift)
 	{
 		/*
 		左乘：每次左移一位，相当于乘以 2
@@ -288,12 +440,12 @@ public:
 	}
 
 	// 计算映射的哪一个自由链表桶
-	static inline size_t Index(size_t bytes)
+	static constexpr size_t CalcIndex(size_t bytes)
 	{
 		assert(bytes <= MAX_BYTES);
 
 		// 每个区间有多少个链
-		static int group_array[4] = { 16, 56, 56, 56 };
+		const size_t group_array[4] = { 16, 56, 56, 56 };
 		if (bytes <= 128) 
 		{
 			return _Index(bytes, 3);
@@ -324,14 +476,14 @@ public:
 	}
 
 	// 一次 thread cache 从中心缓存获取多少个(对象)
-	static size_t NumMoveSize(size_t size)
+	static constexpr size_t CalcNumMoveSize(size_t size)
 	{
 		assert(size > 0);
 
 		// [2, 512]，一次批量移动多少个对象的(慢启动)上限值
 		// 小对象一次批量上限高
 		// 小对象一次批量上限低
-		int num = MAX_BYTES / size;
+		size_t num = MAX_BYTES / size;
 		if (num < 2)
 			num = 2;
 		if (num > 512)
@@ -343,9 +495,9 @@ public:
 	// 单个对象 8byte
 	// ...
 	// 单个对象 256KB
-	static size_t NumMovePage(size_t size)
+	static constexpr size_t CalcNumMovePage(size_t size)
 	{
-		size_t num = NumMoveSize(size);
+		size_t num = CalcNumMoveSize(size);
 		size_t npage = num * size;
 
 		npage >>= PAGE_SHIFT;
@@ -353,8 +505,148 @@ public:
 			npage = 1;
 		return npage;
 	}
+
+	// 查表的接口(定义在 SizeClassTable 后面)
+	// 小对象先用 ClassArrayIndex 把 size 映射到一个字节数组的下标, 字节数组里存的是桶号,
+	// 桶号再去取这个大小类的对齐大小和批量数, 没有分支
+	//   size <= 1024:          (size + 7) >> 3, 每 8 字节一格, 共 129 格
+	//   1024 < size <= 256KB:  (size + 127 + (120 << 7)) >> 7, 每 128 字节一格, 接在后面
+	// 各个区间的对齐数都是这一格大小的倍数, 所以同一格里的 size 一定落在同一个桶
+	static constexpr size_t ClassArrayIndex(size_t size)
+	{
+		return size <= 1024 ? (size + 7) >> 3 : (size + 127 + (120 << 7)) >> 7;
+	}
+
+	static inline size_t Index(size_t bytes);
+	static inline size_t RoundUp(size_t size);
+	static inline size_t NumMoveSize(size_t size);
+	static inline size_t NumMovePage(size_t size);
+
+	// 已经知道桶号时直接取这个大小类的信息
+	static inline size_t ClassSize(size_t index);
+	static inline size_t ClassNumMoveSize(size_t index);
+	static inline size_t ClassNumMovePage(size_t index);
+
+	// 换一套大小类(见 SizeClass.cpp 和 SizeClassGen.cpp), 必须在第一次申请内存之前调用,
+	// 因为各级缓存里的对象是按桶号挂的; 已经开始用了或者文件格式不对都返回 false
+	static bool LoadTable(const char* path);
+
+	// 第一次用到大小类之前调用(ThreadCache/CpuCache 创建时):
+	// 如果设置了环境变量 CMP_SIZE_CLASSES, 就从这个文件加载大小类; 之后大小类就不能再换了
+	static void InitTable();
+
+	// fork 前后拿住/放开加载大小类的锁(见 AtFork.h)
+	static void LockForFork();
+	static void UnlockAfterFork();
+};
+
+// 一个大小类的全部信息, 对齐大小只在这里存一份
+struct ClassInfo
+{
+	uint32_t _size = 0;			// 对齐以后的大小
+	uint16_t _numToMove = 0;	// thread cache 一次最多从 central cache 拿多少个
+	uint16_t _pages = 0;		// central cache 一次向 page cache 要几页
 };
 
+// 大小类表, 默认的一套是编译期按 SizeClass 的区间规则生成的
+// 也可以在运行时换成 SizeClassGen 按实际的申请大小分布生成的一套(最多 NFREELISTS 个大小类)
+struct SizeClassTable
+{
+	static const size_t CLASS_ARRAY_SIZE = SizeClass::ClassArrayIndex(MAX_BYTES) + 1;
+
+	uint8_t _classArray[CLASS_ARRAY_SIZE] = {};	// ClassArrayIndex(size) -> 桶号
+	ClassInfo _info[NFREELISTS] = {};			// 桶号 -> 大小类信息
+	size_t _numClasses = 0;
+
+	constexpr SizeClassTable()
+	{
+		// 每一格里最大的 size 就能代表这一格(size = 0 也按 1 算, 放进第 0 号桶)
+		for (size_t i = 1; i < CLASS_ARRAY_SIZE; ++i)
+		{
+			size_t index = SizeClass::CalcIndex(MaxSizeOfSlot(i));
+			_classArray[i] = (uint8_t)index;
+
+			size_t alignSize = SizeClass::CalcRoundUp(MaxSizeOfSlot(i));
+			_info[index]._size = (uint32_t)alignSize;
+			_info[index]._numToMove = (uint16_t)SizeClass::CalcNumMoveSize(alignSize);
+			_info[index]._pages = (uint16_t)SizeClass::CalcNumMovePage(alignSize);
+		}
+		_classArray[0] = 0;
+		_numClasses = NFREELISTS;
+	}
+
+	// 字节数组第 i 格里最大的 size
+	static constexpr size_t MaxSizeOfSlot(size_t i)
+	{
+		return i <= 128 ? i << 3 : (i - 120) << 7;
+	}
+
+	size_t Index(size_t bytes) const
+	{
+		assert(bytes <= MAX_BYTES);
+		return _classArray[SizeClass::ClassArrayIndex(bytes)];
+	}
+
+	// 用一组大小类重新生成这张表, 大小类必须满足:
+	// 从小到大排列, <= 1024 的是 8 的倍数, > 1024 的是 128 的倍数(字节数组一格的大小), 最后一个是 MAX_BYTES;
+	// 页数在 [1, NPAGES-1] 而且至少放得下一个对象, 批量数至少是 1. 不满足时返回 false, 表不变
+	bool Build(const ClassInfo* classes, size_t n);
+
+	// 解析文本格式的大小类(SizeClassGen 的输出): 每行 "size pages batch", # 开头的是注释
+	bool Parse(const char* text, size_t len);
+};
+
+static_assert(NFREELISTS <= 256, "桶号要能放进一个字节");
+static_assert(SizeClass::ClassArrayIndex(1024) + 1 == SizeClass::ClassArrayIndex(1025), "两段下标要接上");
+static_assert(SizeClassTable()._info[NFREELISTS - 1]._size == MAX_BYTES, "最后一个桶就是 MAX_BYTES");
+
+// 当前使用的大小类表: 构造函数是 constexpr 的, 所以是在编译期(静态初始化阶段)初始化的,
+// 比任何全局构造函数里的 malloc 都早
+inline SizeClassTable sizeClassTable;
+
+// 计算映射的哪一个自由链表桶
+inline size_t SizeClass::Index(size_t bytes)
+{
+	return sizeClassTable.Index(bytes);
+}
+
+// 对齐大小计算
+inline size_t SizeClass::RoundUp(size_t size)
+{
+	if (size <= MAX_BYTES)
+		return sizeClassTable._info[Index(size)]._size;
+
+	// 如果申请的内存大于256KB, 那么就以一页为单位进行对齐
+	return _RoundUp(size, 1 << PAGE_SHIFT);
+}
+
+// 一次 thread cache 从中心缓存获取多少个(对象)
+inline size_t SizeClass::NumMoveSize(size_t size)
+{
+	return sizeClassTable._info[Index(size)]._numToMove;
+}
+
+// 计算一次向系统获取几个页
+inline size_t SizeClass::NumMovePage(size_t size)
+{
+	return sizeClassTable._info[Index(size)]._pages;
+}
+
+inline size_t SizeClass::ClassSize(size_t index)
+{
+	return sizeClassTable._info[index]._size;
+}
+
+inline size_t SizeClass::ClassNumMoveSize(size_t index)
+{
+	return sizeClassTable._info[index]._numToMove;
+}
+
+inline size_t SizeClass::ClassNumMovePage(size_t index)
+{
+	return sizeClassTable._info[index]._pages;
+}
+
 
 // Span管理一个跨度的大块内存, 管理以页为单位的大块内存
 struct Span
@@ -366,11 +658,114 @@ struct Span
 	Span* _next = nullptr;
 	Span* _prev = nullptr;
 
-	void* _freelist = nullptr;  // 大块内存切小链接起来，这样回收回来的内存也方便链接
+	void* _freelist = nullptr;  // 还回来的小块内存链接起来
 	size_t _usecount = 0;   // 使用计数，==0 说明所有对象都回来了
+
+	// 懒切分: span 不会一开始就整个切成自由链表, 而是分配时从头往后一个一个切
+	// [0, _carved) 是切出去过的对象, 之后还回来的挂在 _freelist 上; [_carved, _capacity) 还没碰过
+	size_t _carved = 0;		// 已经切出去的对象个数
+	size_t _capacity = 0;	// 这个 span 一共能切多少个对象
 	
 	bool _isUse = false;	// 是否在使用
+	bool _isReturned = false;	// 空闲时物理页是否已经还给了操作系统(虚拟地址还在)
 	size_t _objSize = 0;	// 切出来的单个对象的大小
+
+	unsigned long long _freeTime = 0;	// 超过128页的空闲span放进 page cache / 大对象放进分片缓存的时间(毫秒), 放久了就还回去
+
+	StatCounter _sampledObjects;	// 被堆采样采到、还没释放的对象个数, 为0时释放就不用查采样表(见 HeapProfiler.h)
+};
+
+// 是否统计锁的竞争情况, 默认关闭; 环境变量 CMP_LOCK_STATS=1 或者 ConcurrentSetLockStats 打开
+inline std::atomic<bool> lockStatsEnabled{ false };
+
+// 一把锁的统计: 申请了几次、其中几次要等、一共等了多久、每次拿着锁多久的分布
+// 计数器都是拿到锁以后才改的, 同一时刻只有一个线程在改, 所以用 StatCounter
+struct LockStats
+{
+	// 持有时间的直方图: 第0个桶是 128ns 以内, 之后每个桶翻一倍, 最后一个桶是 2^21ns(约2ms)以上
+	static const size_t HOLD_BUCKETS = 16;
+
+	StatCounter _acquisitions;
+	StatCounter _contended;
+	StatCounter _waitNs;
+	StatCounter _holdHistogram[HOLD_BUCKETS];
+
+	static unsigned long long NowNs()
+	{
+		return (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	static size_t HoldBucket(unsigned long long ns)
+	{
+		size_t bucket = 0;
+		for (ns >>= 7; ns != 0 && bucket < HOLD_BUCKETS - 1; ns >>= 1)
+		{
+			++bucket;
+		}
+		return bucket;
+	}
+
+	// CentralCache 和 PageCache 构造时读一下环境变量
+	static void InitFromEnv()
+	{
+		const char* env = getenv("CMP_LOCK_STATS");
+		if (env != nullptr && env[0] == '1')
+			lockStatsEnabled.store(true, std::memory_order_relaxed);
+	}
+};
+
+// 可以统计竞争情况的互斥锁, 用法和 std::mutex 一样(可以配合 std::unique_lock)
+// 没打开统计或者没有设置统计记录时, 只比 std::mutex 多一次判断
+class InstrumentedMutex
+{
+public:
+	void lock()
+	{
+		if (_stats == nullptr || !lockStatsEnabled.load(std::memory_order_relaxed))
+		{
+			_mtx.lock();
+			_lockedAt = 0;
+			return;
+		}
+
+		// 先试一下, 拿不到才算竞争, 只有这时才计时
+		unsigned long long waitNs = 0;
+		bool contended = !_mtx.try_lock();
+		if (contended)
+		{
+			unsigned long long start = LockStats::NowNs();
+			_mtx.lock();
+			waitNs = LockStats::NowNs() - start;
+		}
+
+		_stats->_acquisitions.Add(1);
+		if (contended)
+		{
+			_stats->_contended.Add(1);
+			_stats->_waitNs.Add(waitNs);
+		}
+		_lockedAt = LockStats::NowNs();
+	}
+
+	void unlock()
+	{
+		// 拿锁的时候统计了才记持有时间, 中间打开/关闭统计也不会记错
+		if (_lockedAt != 0)
+			_stats->_holdHistogram[LockStats::HoldBucket(LockStats::NowNs() - _lockedAt)].Add(1);
+		_mtx.unlock();
+	}
+
+	// 统计记录到哪里, 不设置就不统计
+	void SetStats(LockStats* stats)
+	{
+		_stats = stats;
+	}
+
+private:
+	std::mutex _mtx;
+	LockStats* _stats = nullptr;
+	unsigned long long _lockedAt = 0;	// 拿到锁的时间, 为0表示这次没有统计
 };
 
 // 带头双向循环链表
@@ -382,7 +777,7 @@ public:
 		// _head = new Span;
 		// 修正一bug，之前这里直接使用new，我们目标是要替代new/malloc
 		// 所以这里也要替换掉，使用对象池
-		static ObjectPool<Span> spanPool;
+		static LockFreeObjectPool<Span> spanPool;
 		_head = spanPool.New();
 
 		_head->_next = _head;
@@ -437,6 +832,19 @@ public:
 		pos->_prev = newSpan;
 	}
 
+	// 链表头上最多 limit 个span里页号最小的那个, 链表为空时返回 End()
+	Span* LowestAmongFirst(size_t limit)
+	{
+		Span* lowest = Begin();
+		Span* span = Begin();
+		for (size_t n = 0; span != End() && n < limit; ++n, span = span->_next)
+		{
+			if (span->_pageId < lowest->_pageId)
+				lowest = span;
+		}
+		return lowest;
+	}
+
 	// 在 pos 位置删除(这里不是真的删除, 只是解除链接)
 	void Erase(Span* pos)
 	{
@@ -462,5 +870,5 @@ private:
 public:
 	// 如果两个线程访问同一个桶, 那么就会存在竞争, 故而需要加锁
 	// 加了锁以后, A 线程在获取资源的同时, B 线程只能阻塞等待
-	std::mutex _mtx;	// 桶锁
+	InstrumentedMutex _mtx;	// 桶锁
 };
\ No newline at end of file
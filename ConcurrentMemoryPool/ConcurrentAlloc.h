@@ -1,88 +1,247 @@
-#pragma once
+﻿#pragma once
 
 #include "ThreadCache.h"
+#include "CpuCache.h"
+#include "CentralCache.h"
 #include "PageCache.h"
 #include "ObjectPool.h"
+#include "Stats.h"
+#include "HeapProfiler.h"
+#include "AllocTracer.h"
 
-// 
+// 申请, 向系统要不到内存时返回 nullptr
+// 不抛 bad_alloc: 失败是在 page cache 的锁里发现的, 替换了 malloc 以后抛异常要申请内存, 会卡在同一把锁上
+// 所以一路返回空指针, 每一层先放掉自己的锁
 static void* ConcurrentAlloc(size_t size)
 {
-	if (size > MAX_BYTES)	// ڴ256KB
+	if (size > MAX_BYTES)	// 如果申请的内存大于256KB
 	{
 		size_t alignSize = SizeClass::RoundUp(size);
 		size_t kpage = alignSize >> PAGE_SHIFT;
 
-		//cout << "alignSize(С): " << alignSize << ", " << "kpage(ҳС): " << kpage << endl;
+		//cout << "alignSize(对齐大小): " << alignSize << ", " << "kpage(申请的页大小): " << kpage << endl;
 		
-		PageCache::getInstance()->_pageMtx.lock();
-		Span* span = PageCache::getInstance()->NewSpan(kpage); // ȥpage cacheҪһKҳspanҳתĵַ
+		// 先去分片缓存里找同样页数的span, 命中的话就不用抢 page cache 的大锁了
+		Span* span = PageCache::getInstance()->FetchLargeSpan(kpage);
+		if (span == nullptr)
+		{
+			std::unique_lock<InstrumentedMutex> lock(PageCache::getInstance()->_pageMtx);
+			span = PageCache::getInstance()->NewSpan(kpage); // 去page cache里面要一个K页的span的页号转换出来的地址
+			if (span == nullptr)
+				return nullptr;
+			span->_isUse = true;	// 和GetOneSpan一样要标记为在使用, 否则相邻span回收时会把它合并掉
+		}
 		span->_objSize = size;
-		PageCache::getInstance()->_pageMtx.unlock();
 
 		void* ptr = (void*)(span->_pageId << PAGE_SHIFT);
 
+		HeapProfiler::OnAlloc(ptr, size);
+		AllocTracer::OnAlloc(ptr, size);
 		return ptr;
 	}
 	else
 	{
-	// ͨ TLS ÿ߳̿ĻȡԼר ThreadCache 
-	//  ThreadCache Ӧ size ӳ ϣͰ жôֱ Pop() һ£Чʷǳ
-	// ʱж̲߳еߣġ
-	// ΪľǷǳҵģǻкܶĵģ绥֮ģAеʱBͲУBҪȴ
+		void* ptr = nullptr;
+#ifdef CMP_PER_CPU_CACHE
+		// 按 CPU 缓存的前端: 缓存的内存随核数增长, 而不是随线程数增长
+		ptr = CpuCache::getInstance()->Allocate(size);
+#else
+	// 通过 TLS 每个线程可以无锁的获取自己专属的 ThreadCache 对象
+	// 如果 ThreadCache 对应的 size 映射的 哈希桶 里面有对象，那么直接 Pop() 一下，效率非常高
+	// 此时，你有多个线程并行的走，并且是无锁的。
+	// 因为锁的竞争是非常激烈的，并且是会有很多消耗的，比如互斥锁之类的，A运行的时候，B就不能运行，B要阻塞等待
 		if (pTLSthreadcache == nullptr)
 		{
 			//pTLSthreadcache = new ThreadCache;
 
-			// Ҳʹöڴؽ滻
-			static ObjectPool<ThreadCache> tcPool;
-			pTLSthreadcache = tcPool.New();
+			// 也是使用定长内存池进行替换
+			//static ObjectPool<ThreadCache> tcPool;
+			//pTLSthreadcache = tcPool.New();
+
+			// 定长内存池挪到了 ThreadCache.cpp 里, 线程退出时 ThreadCache 会被还回去
+			if (ThreadCache::Create() == nullptr)
+			{
+				// 线程正在退出, ThreadCache 已经回收了, 这时的申请也不采样了
+				return ThreadCache::AllocateUncached(size);
+			}
 		}
 
-		//cout << std::this_thread::get_id() << ":" << pTLSthreadcache << "ɹ" << endl;
+		//cout << std::this_thread::get_id() << ":" << pTLSthreadcache << "申请对象成功" << endl;
 
-		return pTLSthreadcache->Allocate(size);
+		ptr = pTLSthreadcache->Allocate(size);
+#endif
+		if (ptr == nullptr)
+			return nullptr;
+
+		// 堆采样: 不采样时只是一次减法和比较; 没在记录申请序列时也只多一次比较
+		HeapProfiler::OnAlloc(ptr, size);
+		AllocTracer::OnAlloc(ptr, size);
+		return ptr;
 	}	
 }
 
-// ͷ
-/*
-static void ConcurrentFree(void* ptr, size_t size)
+// 把 page cache 里所有空闲页的物理内存都还给操作系统(虚拟地址保留, 之后还能接着用)
+static size_t ConcurrentReleaseFreeMemory()
 {
-	if (size > MAX_BYTES)
-	{
-		Span* span = PageCache::getInstance()->MapObjectToSpan(ptr);
-		
-		PageCache::getInstance()->_pageMtx.lock();
-		PageCache::getInstance()->ReleaseSpanToPageCache(span);
-		PageCache::getInstance()->_pageMtx.unlock();
-	}
-	else
+	// 先把转运缓存里的对象还给span, 大对象分片缓存里的span还给 page cache, 它们才能被归还
+	CentralCache::getInstance()->FlushTransferCaches();
+	PageCache::getInstance()->FlushLargeSpanCache();
+
+	std::unique_lock<InstrumentedMutex> lock(PageCache::getInstance()->_pageMtx);
+	return PageCache::getInstance()->ReleaseFreeMemory();
+}
+
+// 设置 page cache 自动把空闲页还给操作系统的速度, 0 表示不自动归还
+static void ConcurrentSetReleaseRate(double rate)
+{
+	std::unique_lock<InstrumentedMutex> lock(PageCache::getInstance()->_pageMtx);
+	PageCache::getInstance()->SetReleaseRate(rate);
+}
+
+// 设置超过1MB(128页)的空闲内存的缓存: 最多缓存 bytes 字节, 超过 decayMs 毫秒没被复用就还给系统
+// 反复申请释放大缓冲区时可以省掉每次的 mmap/munmap
+static void ConcurrentSetLargeSpanCache(size_t bytes, unsigned long long decayMs)
+{
+	std::unique_lock<InstrumentedMutex> lock(PageCache::getInstance()->_pageMtx);
+	PageCache::getInstance()->SetLargeSpanCache(bytes >> PAGE_SHIFT, decayMs);
+}
+
+// 设置 page cache 的大页模式, 之后向系统要的内存从按 2MB 对齐的大页 arena 里切
+// 也可以通过环境变量 CMP_HUGEPAGE=thp / hugetlb 打开
+static void ConcurrentSetHugePageMode(PageCache::HugePageMode mode)
+{
+	std::unique_lock<InstrumentedMutex> lock(PageCache::getInstance()->_pageMtx);
+	PageCache::getInstance()->SetHugePageMode(mode);
+}
+
+// 打开/关闭中心缓存桶锁和 page cache 大锁的竞争统计(也可以用环境变量 CMP_LOCK_STATS=1 打开), 结果在 ConcurrentGetStats 里
+static void ConcurrentSetLockStats(bool enabled)
+{
+	lockStatsEnabled.store(enabled, std::memory_order_relaxed);
+}
+
+// 设置所有线程的 ThreadCache 加起来最多缓存多少字节
+static void ConcurrentSetThreadCacheBudget(size_t bytes)
+{
+	ThreadCache::SetOverallCacheSize(bytes);
+}
+
+// 内存池各级缓存的统计信息, 用 ToText() / ToJson() 输出
+// 只读各级缓存自己维护的计数器, 不加分配路径上的锁, 可以在线上定时调用
+static AllocatorStats ConcurrentGetStats()
+{
+	AllocatorStats stats;
+#ifdef CMP_PER_CPU_CACHE
+	CpuCache::getInstance()->CollectStats(stats);
+#else
+	ThreadCache::CollectStats(stats);
+#endif
+	CentralCache::getInstance()->CollectStats(stats);
+	PageCache::getInstance()->CollectStats(stats);
+	stats.Finish();
+	return stats;
+}
+
+// 堆采样: 平均每申请 bytes 字节采一个样, 0 表示关闭
+static void ConcurrentSetHeapSampleInterval(size_t bytes)
+{
+	HeapProfiler::getInstance()->SetSampleInterval(bytes);
+}
+
+// 现在的堆按调用栈汇总, 折叠栈格式(flamegraph.pl 可以直接画)
+static std::string ConcurrentHeapProfile()
+{
+	return HeapProfiler::getInstance()->LiveHeapProfile();
+}
+
+// 从现在开始统计申请(不管释放没有), 之后用 ConcurrentAllocationProfile 取结果
+static void ConcurrentStartAllocationProfile()
+{
+	HeapProfiler::getInstance()->StartAllocationProfile();
+}
+
+static std::string ConcurrentAllocationProfile()
+{
+	return HeapProfiler::getInstance()->AllocationProfile();
+}
+
+// 把之后的每一次申请释放记录到 path 里(覆盖原来的文件), 也可以用环境变量 CMP_ALLOC_TRACE=文件 打开
+// 记录下来的文件可以用 BenchMark --replay 回放, 或者用 AllocTracer::ReadTrace 读回来
+static bool ConcurrentStartAllocationTrace(const char* path)
+{
+	return AllocTracer::getInstance()->Start(path);
+}
+
+// 停止记录, 返回之前所有线程缓冲区里的记录都已经写进文件
+static void ConcurrentStopAllocationTrace()
+{
+	AllocTracer::getInstance()->Stop();
+}
+
+// 把小对象还给当前线程(或当前CPU)的缓存
+static void ConcurrentFreeSmall(void* ptr, size_t size)
+{
+#ifdef CMP_PER_CPU_CACHE
+	CpuCache::getInstance()->Deallocate(ptr, size);
+#else
+	// 线程可能只释放别的线程申请的对象, 自己还没有 ThreadCache
+	if (pTLSthreadcache == nullptr && ThreadCache::Create() == nullptr)
 	{
-		assert(pTLSthreadcache);
-		cout << std::this_thread::get_id() << ":" << pTLSthreadcache << "ͷŶɹ" << endl;
-		// Ҫ sizeĻҲ֪ҪĸλµĹϣͰ
-		pTLSthreadcache->Deallocate(ptr, size);
+		ThreadCache::DeallocateUncached(ptr, size);
+		return;
 	}
-}*/
-
+	//cout << std::this_thread::get_id() << ":" << pTLSthreadcache << "释放对象成功" << endl;
+	// 还需要给出 size，如果不给的话，我不知道你要还给哪个位置下的哈希桶
+	pTLSthreadcache->Deallocate(ptr, size);
+#endif
+}
 
+// 释放
 static void ConcurrentFree(void* ptr)
 {
 	Span* span = PageCache::getInstance()->MapObjectToSpan(ptr);
 	size_t size = span->_objSize;
 
+	// 被采样的对象要从采样表里删掉; 记录申请序列时要在真正释放之前记
+	// 大对象记 span 开头的地址: 按比一页还大的对齐申请时 ptr 在 span 中间, 申请记录里记的是开头
+	HeapProfiler::OnFree(ptr, span);
+	AllocTracer::OnFree(size > MAX_BYTES ? (void*)(span->_pageId << PAGE_SHIFT) : ptr, size);
+
 	if (size > MAX_BYTES)
 	{
-
-		PageCache::getInstance()->_pageMtx.lock();
-		PageCache::getInstance()->ReleaseSpanToPageCache(span);
-		PageCache::getInstance()->_pageMtx.unlock();
+		// 先放进分片缓存, 下次同样大小的申请可以直接拿走; 放不下再还给 page cache
+		if (!PageCache::getInstance()->CacheLargeSpan(span))
+		{
+			PageCache::getInstance()->_pageMtx.lock();
+			PageCache::getInstance()->ReleaseSpanToPageCache(span);
+			PageCache::getInstance()->_pageMtx.unlock();
+		}
 	}
 	else
 	{
-		assert(pTLSthreadcache);
-		//cout << std::this_thread::get_id() << ":" << pTLSthreadcache << "ͷŶɹ" << endl;
-		// Ҫ sizeĻҲ֪ҪĸλµĹϣͰ
-		pTLSthreadcache->Deallocate(ptr, size);
+		ConcurrentFreeSmall(ptr, size);
+	}
+}
+
+// 调用方知道对象大小时的释放(比如 C++14 的 sized delete), size 是申请时传给 ConcurrentAlloc 的大小
+// 小对象直接按 size 找到 ThreadCache 的桶, 省掉一次基数树查找(查 span 只是为了读 _objSize)
+static void ConcurrentFree(void* ptr, size_t size)
+{
+	if (size > MAX_BYTES)
+	{
+		// 大对象本来就要拿到 span 才能还回去
+		ConcurrentFree(ptr);
+		return;
 	}
+
+	// debug 下核对一下: 调用方给的大小和申请时的大小必须落在同一个大小类里, 否则对象会挂错桶
+	assert(PageCache::getInstance()->MapObjectToSpan(ptr)->_objSize == SizeClass::RoundUp(size));
+
+	// 有采样对象还没释放时才去查 span, 平时不多一次基数树查找
+	if (HeapProfiler::getInstance()->HasLiveSamples())
+		HeapProfiler::OnFree(ptr, PageCache::getInstance()->MapObjectToSpan(ptr));
+	// 和不带大小的释放一样记大小类的大小(也就是 span 里的 _objSize)
+	AllocTracer::OnFree(ptr, SizeClass::RoundUp(size));
+
+	ConcurrentFreeSmall(ptr, size);
 }
\ No newline at end of file
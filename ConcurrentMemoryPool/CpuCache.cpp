@@ -0,0 +1,126 @@
+﻿#define _CRT_SECURE_NO_WARNINGS 1
+
+#include "CpuCache.h"
+#include "CentralCache.h"
+#include "Stats.h"
+
+#ifndef _WIN32
+	#include <sched.h>
+#endif
+
+CpuCache::CpuCache()
+{
+	SizeClass::InitTable();
+
+	// 按系统配置的 CPU 数量开 slab, 这样离线又上线的 CPU 也有自己的 slab
+#ifdef _WIN32
+	_ncpu = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+#else
+	long n = sysconf(_SC_NPROCESSORS_CONF);
+	_ncpu = n > 0 ? (size_t)n : 1;
+#endif
+	if (_ncpu == 0)
+		_ncpu = 1;
+
+	// slab 数组直接按页向系统申请, 不走 new
+	size_t bytes = SizeClass::_RoundUp(sizeof(CpuSlab) * _ncpu, 1 << PAGE_SHIFT);
+	_slabs = (CpuSlab*)SystemAlloc(bytes >> PAGE_SHIFT);
+	if (_slabs == nullptr)
+	{
+		// 一开始就要不到这点内存, 所有 CPU 共用一个静态的 slab, 只是慢一点
+		static CpuSlab fallback;
+		_slabs = &fallback;
+		_ncpu = 1;
+		_instance.store(this, std::memory_order_release);
+		return;
+	}
+	for (size_t i = 0; i < _ncpu; ++i)
+	{
+		new(&_slabs[i])CpuSlab;
+	}
+	_instance.store(this, std::memory_order_release);
+}
+
+CpuCache::CpuSlab& CpuCache::CurrentSlab()
+{
+#ifdef _WIN32
+	size_t cpu = GetCurrentProcessorNumber();
+#else
+	int ret = sched_getcpu();
+	size_t cpu = ret < 0 ? 0 : (size_t)ret;
+#endif
+	// 取完 CPU 号以后线程可能已经被迁移走了, 这没关系, 只是用了别的 CPU 的 slab, 有锁保护
+	return _slabs[cpu % _ncpu];
+}
+
+void* CpuCache::Allocate(size_t size)
+{
+	assert(size <= MAX_BYTES);
+
+	size_t index = SizeClass::Index(size);
+	size_t batchNum = 0;
+	CpuSlab& slab = CurrentSlab();
+	{
+		SlabLock lock(slab);
+		void* obj = slab._cache.PopOrBatchNum(index, batchNum);
+		if (obj != nullptr)
+			return obj;
+	}
+
+	// 桶空了, 放掉 slab 的锁再找 central cache 要:
+	// 拿着自旋锁去走 page cache 和 mmap 的话, 持有者一被抢占, 这个 CPU 上的线程就都在空转
+	void* start = nullptr;
+	void* end = nullptr;
+	size_t n = CentralCache::getInstance()->FetchRangeObj(start, end, batchNum, SizeClass::ClassSize(index));
+	if (n == 0)
+		return nullptr;
+
+	// 线程这时可能已经换了 CPU, 多出来的对象还是放进原来的 slab, 没关系
+	SlabLock lock(slab);
+	return slab._cache.PushFetched(index, start, end, n);
+}
+
+void CpuCache::Deallocate(void* ptr, size_t size)
+{
+	void* start = nullptr;
+	void* end = nullptr;
+	size_t n = 0;
+	CpuSlab& slab = CurrentSlab();
+	{
+		SlabLock lock(slab);
+		n = slab._cache.PushAndTakeOverflow(ptr, size, start, end);
+	}
+
+	// 桶太长了, 摘下来的一批放掉锁以后再还给 central cache
+	if (n > 0)
+	{
+		CentralCache::getInstance()->InsertRange(start, end, n, size);
+	}
+}
+
+void CpuCache::LockForFork()
+{
+	for (size_t i = 0; i < _ncpu; ++i)
+	{
+		while (_slabs[i]._lock.test_and_set(std::memory_order_acquire))
+		{
+			std::this_thread::yield();
+		}
+	}
+}
+
+void CpuCache::UnlockAfterFork()
+{
+	for (size_t i = 0; i < _ncpu; ++i)
+	{
+		_slabs[i]._lock.clear(std::memory_order_release);
+	}
+}
+
+void CpuCache::CollectStats(AllocatorStats& stats)
+{
+	for (size_t i = 0; i < _ncpu; ++i)
+	{
+		_slabs[i]._cache.AddStats(stats);
+	}
+}
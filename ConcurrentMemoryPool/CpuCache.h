@@ -0,0 +1,94 @@
+﻿#pragma once
+
+#include "Common.h"
+#include "ThreadCache.h"
+
+// 每个 CPU 一个缓存(可选的前端, 编译时定义 CMP_PER_CPU_CACHE 打开)
+// ThreadCache 是每个线程一份, 线程很多的时候(比如64核的机器上跑2000个线程),
+// 大量内存挂在空闲线程的自由链表里; 按 CPU 缓存以后, 缓存的内存只和核数有关, 和线程数无关
+//
+// 每个 CPU 的 slab 里就是一个 ThreadCache, 复用它的慢开始和批量回收逻辑
+// 当前 CPU 号用 sched_getcpu() 获取, glibc 2.35 以后它直接读 rseq 注册区里的 cpu_id, 不会陷入内核;
+// slab 上的 push/pop 用一把自旋锁保护, 只有线程在临界区里被抢占或迁移到别的 CPU 时才会有竞争;
+// 找 central cache 要对象、还对象(可能一路走到 page cache 和 mmap)时不拿着这把锁, 临界区里只有几次链表操作
+class CpuCache
+{
+public:
+	static CpuCache* getInstance()
+	{
+		static CpuCache sInst;
+		return &sInst;
+	}
+
+	// 申请和释放内存对象
+	void* Allocate(size_t size);
+	void Deallocate(void* ptr, size_t size);
+
+	// CPU 数量(slab 的个数)
+	size_t NumCpus()
+	{
+		return _ncpu;
+	}
+
+	// 统计每个 CPU 的 slab 里缓存的对象, 不加 slab 的锁
+	void CollectStats(AllocatorStats& stats);
+
+	// 已经创建了的实例, 还没用过就是 nullptr
+	// fork 前要拿住所有 slab 的锁, 但没用按 CPU 缓存的程序不能为此去开 slab
+	static CpuCache* Existing()
+	{
+		return _instance.load(std::memory_order_acquire);
+	}
+
+	// fork 前后拿住/放开所有 slab 的锁(见 AtFork.h)
+	void LockForFork();
+	void UnlockAfterFork();
+
+private:
+	// 按缓存行对齐, 避免相邻 CPU 的 slab 伪共享
+	struct alignas(64) CpuSlab
+	{
+		std::atomic_flag _lock = ATOMIC_FLAG_INIT;
+		ThreadCache _cache;
+	};
+
+	// 当前线程所在 CPU 的 slab
+	CpuSlab& CurrentSlab();
+
+	// RAII 风格的 slab 锁
+	class SlabLock
+	{
+	public:
+		explicit SlabLock(CpuSlab& slab)
+			: _slab(slab)
+		{
+			while (_slab._lock.test_and_set(std::memory_order_acquire))
+			{
+				std::this_thread::yield();
+			}
+		}
+
+		~SlabLock()
+		{
+			_slab._lock.clear(std::memory_order_release);
+		}
+
+		SlabLock(const SlabLock&) = delete;
+		SlabLock& operator=(const SlabLock&) = delete;
+
+	private:
+		CpuSlab& _slab;
+	};
+
+private:
+	CpuSlab* _slabs = nullptr;
+	size_t _ncpu = 0;
+
+	inline static std::atomic<CpuCache*> _instance{ nullptr };
+
+private:
+	CpuCache();
+
+	CpuCache(const CpuCache&) = delete;
+	CpuCache operator=(const CpuCache&) = delete;
+};
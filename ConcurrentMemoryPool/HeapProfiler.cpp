@@ -0,0 +1,332 @@
+﻿#define _CRT_SECURE_NO_WARNINGS 1
+
+#include "HeapProfiler.h"
+#include "PageCache.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+
+#ifndef _WIN32
+	#include <execinfo.h>
+	#include <dlfcn.h>
+	#include <cxxabi.h>
+#endif
+
+// 正在采样或者输出结果的线程: 抓调用栈时(第一次 backtrace 会加载 libgcc_s)可能又调 malloc, 这些申请不再采样
+static thread_local bool tlsInProfiler = false;
+
+// 每个线程自己的随机数(xorshift64*), 用来抽下一次采样的距离
+static thread_local uint64_t tlsSampleRandom = 0;
+
+static double NextRandom()
+{
+	if (tlsSampleRandom == 0)
+	{
+		// 用线程局部变量的地址和时间做种子, 不同线程不会抽到同一个序列
+		uint64_t seed = (uint64_t)(uintptr_t)&tlsSampleRandom
+			^ (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count();
+		tlsSampleRandom = seed != 0 ? seed : 0x2545F4914F6CDD1Dull;
+	}
+	tlsSampleRandom ^= tlsSampleRandom >> 12;
+	tlsSampleRandom ^= tlsSampleRandom << 25;
+	tlsSampleRandom ^= tlsSampleRandom >> 27;
+	uint64_t x = tlsSampleRandom * 0x2545F4914F6CDD1Dull;
+
+	// (0, 1] 之间均匀分布, 不会取到0, 下面取对数不会是无穷大
+	return ((x >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+// 到下一次采样还要申请多少字节: 均值为 interval 的指数分布
+static long long NextSampleDistance(size_t interval)
+{
+	double d = -std::log(NextRandom()) * (double)interval;
+	if (d < 1)
+		return 1;
+	if (d > 1e15)
+		return (long long)1e15;
+	return (long long)d;
+}
+
+// 抓当前的调用栈, 不要最里面的 skip 层(它自己和采样函数)
+// 不能被内联, 否则要跳过的层数就不确定了
+#ifdef _MSC_VER
+__declspec(noinline)
+#else
+__attribute__((noinline))
+#endif
+static int CaptureStack(void** frames, int maxDepth, int skip)
+{
+#ifdef _WIN32
+	return CaptureStackBackTrace((DWORD)skip, (DWORD)maxDepth, frames, nullptr);
+#else
+	void* buf[HeapProfiler::MAX_DEPTH + 4];
+	int n = backtrace(buf, maxDepth + skip);
+	if (n <= skip)
+		return 0;
+	memcpy(frames, buf + skip, (n - skip) * sizeof(void*));
+	return n - skip;
+#endif
+}
+
+HeapProfiler::HeapProfiler()
+{
+	const char* env = getenv("CMP_HEAP_SAMPLE");
+	if (env != nullptr && env[0] != '\0')
+		_interval.store((size_t)strtoull(env, nullptr, 10), std::memory_order_relaxed);
+}
+
+void HeapProfiler::SetSampleInterval(size_t bytes)
+{
+	_interval.store(bytes, std::memory_order_relaxed);
+
+	// 当前线程马上按新的间隔重新抽
+	tlsBytesUntilSample = 0;
+}
+
+// 倒计数减到负数了: 这次申请被采到, 记下调用栈, 再抽下一次的距离
+void HeapProfiler::SampleAllocation(void* ptr, size_t size)
+{
+	size_t interval = _interval.load(std::memory_order_relaxed);
+	if (interval == 0)
+	{
+		// 关闭的时候也要隔一段时间回来看一下, 这样别的线程打开以后这个线程也能开始采样
+		tlsBytesUntilSample = DISABLED_RECHECK_BYTES;
+		return;
+	}
+
+	tlsBytesUntilSample = NextSampleDistance(interval);
+	if (tlsInProfiler)
+		return;
+	tlsInProfiler = true;
+
+	void* frames[MAX_DEPTH];
+	int depth = CaptureStack(frames, MAX_DEPTH, 2);
+
+	// 每申请一个字节被采到的概率是 1/interval, 一个 size 字节的对象被采到的概率是 1 - e^(-size/interval),
+	// 所以一个样本代表 size / (1 - e^(-size/interval)) 字节, 大对象几乎一定被采到, 代表的就是它自己
+	double bytes = (double)size / (1 - std::exp(-(double)size / (double)interval));
+	Span* span = PageCache::getInstance()->MapObjectToSpan(ptr);
+
+	{
+		std::unique_lock<std::mutex> lock(_mtx);
+		if (_samples == nullptr)
+		{
+			size_t pages = SizeClass::_RoundUp(sizeof(Sample*) << SAMPLE_BUCKET_BITS, 1 << PAGE_SHIFT) >> PAGE_SHIFT;
+			_samples = (Sample**)SystemAlloc(pages);
+		}
+
+		// 向系统要不到内存时这个样本就不记了
+		StackTrace* stack = _samples != nullptr ? InternStack(frames, depth) : nullptr;
+		Sample* sample = stack != nullptr ? _samplePool.New() : nullptr;
+		if (sample == nullptr)
+		{
+			lock.unlock();
+			tlsInProfiler = false;
+			return;
+		}
+		stack->_allocBytes += bytes;
+
+		sample->_ptr = ptr;
+		sample->_bytes = bytes;
+		sample->_stack = stack;
+
+		size_t bucket = PtrBucket(ptr);
+		sample->_next = _samples[bucket];
+		_samples[bucket] = sample;
+
+		span->_sampledObjects.Add(1);
+		_liveSamples.Add(1);
+	}
+
+	tlsInProfiler = false;
+}
+
+void HeapProfiler::RemoveSample(void* ptr, Span* span)
+{
+	// 大对象记的是 span 的起始地址, memalign 返回的可能是 span 中间的地址
+	if (span->_objSize > MAX_BYTES)
+		ptr = (void*)(span->_pageId << PAGE_SHIFT);
+
+	std::unique_lock<std::mutex> lock(_mtx);
+	if (_samples == nullptr)
+		return;
+
+	Sample** link = &_samples[PtrBucket(ptr)];
+	while (*link != nullptr && (*link)->_ptr != ptr)
+	{
+		link = &(*link)->_next;
+	}
+
+	// span 里有别的对象被采到了, 这个对象本身没有
+	if (*link == nullptr)
+		return;
+
+	Sample* sample = *link;
+	*link = sample->_next;
+	_samplePool.Delete(sample);
+
+	span->_sampledObjects.Sub(1);
+	_liveSamples.Sub(1);
+}
+
+HeapProfiler::StackTrace* HeapProfiler::InternStack(void** frames, int depth)
+{
+	size_t hash = 14695981039346656037ull;
+	for (int i = 0; i < depth; ++i)
+	{
+		hash = (hash ^ (size_t)(uintptr_t)frames[i]) * 1099511628211ull;
+	}
+
+	StackTrace*& head = _stacks[hash % STACK_BUCKETS];
+	for (StackTrace* st = head; st != nullptr; st = st->_next)
+	{
+		if (st->_hash == hash && st->_depth == depth
+			&& memcmp(st->_frames, frames, depth * sizeof(void*)) == 0)
+			return st;
+	}
+
+	StackTrace* st = _stackPool.New();
+	if (st == nullptr)
+		return nullptr;
+	st->_hash = hash;
+	st->_depth = depth;
+	memcpy(st->_frames, frames, depth * sizeof(void*));
+	st->_next = head;
+	head = st;
+	++_numStacks;
+	return st;
+}
+
+void HeapProfiler::StartAllocationProfile()
+{
+	std::unique_lock<std::mutex> lock(_mtx);
+	for (size_t i = 0; i < STACK_BUCKETS; ++i)
+	{
+		for (StackTrace* st = _stacks[i]; st != nullptr; st = st->_next)
+		{
+			st->_allocBytes = 0;
+		}
+	}
+}
+
+std::string HeapProfiler::LiveHeapProfile()
+{
+	return Dump(true);
+}
+
+std::string HeapProfiler::AllocationProfile()
+{
+	return Dump(false);
+}
+
+// 一层调用栈的名字: 能找到符号就用(反修饰以后的)函数名, 否则用 "模块+偏移", 可以离线用 addr2line 解析
+static void AppendFrame(std::string& out, void* pc)
+{
+	char buf[64];
+#ifndef _WIN32
+	Dl_info info;
+	if (dladdr(pc, &info) != 0)
+	{
+		if (info.dli_sname != nullptr)
+		{
+			int status = 0;
+			char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+			const char* name = (status == 0 && demangled != nullptr) ? demangled : info.dli_sname;
+
+			// 分号是折叠栈里层与层之间的分隔符
+			for (const char* p = name; *p != '\0'; ++p)
+			{
+				out.push_back(*p == ';' ? ':' : *p);
+			}
+			free(demangled);
+			return;
+		}
+		if (info.dli_fname != nullptr)
+		{
+			const char* base = strrchr(info.dli_fname, '/');
+			out += base != nullptr ? base + 1 : info.dli_fname;
+			snprintf(buf, sizeof(buf), "+0x%zx", (size_t)((char*)pc - (char*)info.dli_fbase));
+			out += buf;
+			return;
+		}
+	}
+#endif
+	snprintf(buf, sizeof(buf), "0x%zx", (size_t)(uintptr_t)pc);
+	out += buf;
+}
+
+std::string HeapProfiler::Dump(bool live)
+{
+	struct Entry
+	{
+		StackTrace* _stack;
+		double _bytes;
+	};
+
+	// 拿着 _mtx 的时候不能申请内存(替换了 malloc 以后会走到采样, 再去拿 _mtx), 先按调用栈的个数把数组开好
+	// 调用栈只会增加不会删除, 所以后面拿到的 StackTrace 指针一直有效
+	std::vector<Entry> entries;
+	size_t numStacks = 0;
+	{
+		std::unique_lock<std::mutex> lock(_mtx);
+		numStacks = _numStacks;
+	}
+	entries.reserve(numStacks);
+
+	{
+		std::unique_lock<std::mutex> lock(_mtx);
+		if (live)
+		{
+			for (size_t i = 0; i < STACK_BUCKETS; ++i)
+			{
+				for (StackTrace* st = _stacks[i]; st != nullptr; st = st->_next)
+				{
+					st->_liveBytes = 0;
+				}
+			}
+			if (_samples != nullptr)
+			{
+				for (size_t i = 0; i < ((size_t)1 << SAMPLE_BUCKET_BITS); ++i)
+				{
+					for (Sample* s = _samples[i]; s != nullptr; s = s->_next)
+					{
+						s->_stack->_liveBytes += s->_bytes;
+					}
+				}
+			}
+		}
+
+		// 两次加锁之间新增的调用栈这次不输出
+		for (size_t i = 0; i < STACK_BUCKETS; ++i)
+		{
+			for (StackTrace* st = _stacks[i]; st != nullptr && entries.size() < entries.capacity(); st = st->_next)
+			{
+				double bytes = live ? st->_liveBytes : st->_allocBytes;
+				if (bytes >= 0.5)
+					entries.push_back({ st, bytes });
+			}
+		}
+	}
+
+	// 符号化和拼字符串都在锁外面做
+	std::string out;
+	for (const Entry& e : entries)
+	{
+		// 抓到的调用栈从里往外, 折叠栈要从根开始
+		if (e._stack->_depth == 0)
+			out += "[unknown]";
+		for (int i = e._stack->_depth - 1; i >= 0; --i)
+		{
+			AppendFrame(out, e._stack->_frames[i]);
+			if (i > 0)
+				out.push_back(';');
+		}
+
+		char buf[32];
+		snprintf(buf, sizeof(buf), " %.0f\n", e._bytes);
+		out += buf;
+	}
+	return out;
+}
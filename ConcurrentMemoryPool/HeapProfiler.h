@@ -0,0 +1,147 @@
+﻿#pragma once
+
+#include "Common.h"
+
+#include <string>
+
+// 堆采样(类似 tcmalloc 的 heap profiler): 平均每申请 512KB 采一个样, 记下这次申请的调用栈
+// 被采到的对象释放时再从表里删掉, 这样随时都能看到"现在的堆是哪些调用栈申请的"
+//
+// 是否采样由每个线程自己的倒计数决定: 每次申请减掉申请的字节数, 减到负数才走慢路径,
+// 不采样的申请只多一次减法和一次比较. 两次采样之间的字节数服从指数分布(泊松过程),
+// 所以不会因为申请的模式有周期性而一直采到(或一直采不到)同一个调用点
+//
+// 结果输出成 flamegraph.pl / speedscope / pprof 都能读的折叠栈文本: 每行 "根;...;叶 字节数"
+
+// 当前线程还要再申请多少字节才采下一个样
+inline thread_local long long tlsBytesUntilSample = 0;
+
+class HeapProfiler
+{
+public:
+	static HeapProfiler* getInstance()
+	{
+		static HeapProfiler sInst;
+		return &sInst;
+	}
+
+	// 申请路径: 只是一次减法和一次比较, 减到负数才走慢路径
+	static void OnAlloc(void* ptr, size_t size)
+	{
+		tlsBytesUntilSample -= (long long)size;
+		if (tlsBytesUntilSample < 0)
+			getInstance()->SampleAllocation(ptr, size);
+	}
+
+	// 释放路径: 对象所在的span里没有被采到的对象就什么都不用做
+	static void OnFree(void* ptr, Span* span)
+	{
+		if (span->_sampledObjects.Get() != 0)
+			getInstance()->RemoveSample(ptr, span);
+	}
+
+	// 还有没有没释放的采样对象, 带大小的释放没有查span, 只有这时才需要去查
+	bool HasLiveSamples()
+	{
+		return _liveSamples.Get() != 0;
+	}
+
+	// 平均每申请多少字节采一个样, 0 表示关闭(默认关闭, 也可以用环境变量 CMP_HEAP_SAMPLE 设置)
+	// 调用的线程马上生效, 其他线程最多再申请 DISABLED_RECHECK_BYTES 字节以后生效
+	void SetSampleInterval(size_t bytes);
+
+	size_t GetSampleInterval()
+	{
+		return _interval.load(std::memory_order_relaxed);
+	}
+
+	// 还没释放的采样对象个数
+	size_t LiveSamples()
+	{
+		return _liveSamples.Get();
+	}
+
+	// 现在的堆: 每个调用栈申请的、还没释放的内存(按采样概率估算的字节数)
+	std::string LiveHeapProfile();
+
+	// 从 StartAllocationProfile 开始一共申请的内存(不管释放了没有), 按调用栈汇总
+	void StartAllocationProfile();
+	std::string AllocationProfile();
+
+	// fork 前后拿住/放开 _mtx(见 AtFork.h)
+	void LockForFork()
+	{
+		_mtx.lock();
+	}
+
+	void UnlockAfterFork()
+	{
+		_mtx.unlock();
+	}
+
+	static const size_t DEFAULT_SAMPLE_INTERVAL = 512 * 1024;
+	static const size_t DISABLED_RECHECK_BYTES = 512 * 1024;	// 关闭时每个线程隔多久看一次有没有被打开
+	static const int MAX_DEPTH = 32;	// 调用栈最多记多少层
+
+private:
+	// 慢路径: 重新抽下一次采样的距离, 打开了采样的话记下调用栈
+	void SampleAllocation(void* ptr, size_t size);
+
+	// 被采到的对象释放了, 从表里删掉
+	void RemoveSample(void* ptr, Span* span);
+
+	// 同样的调用栈只存一份
+	struct StackTrace
+	{
+		size_t _hash = 0;
+		int _depth = 0;
+		void* _frames[MAX_DEPTH] = {};
+		double _allocBytes = 0;		// StartAllocationProfile 以后申请的(估算)字节数
+		double _liveBytes = 0;		// 输出现在的堆时临时汇总用
+		StackTrace* _next = nullptr;
+	};
+
+	// 一个采样对象
+	struct Sample
+	{
+		void* _ptr = nullptr;
+		double _bytes = 0;			// 这一个样本代表的(估算)字节数
+		StackTrace* _stack = nullptr;
+		Sample* _next = nullptr;
+	};
+
+	StackTrace* InternStack(void** frames, int depth);
+
+	static size_t PtrBucket(void* ptr)
+	{
+		return (size_t)(((uint64_t)(uintptr_t)ptr >> 4) * 0x9E3779B97F4A7C15ull >> (64 - SAMPLE_BUCKET_BITS));
+	}
+
+	// 按调用栈汇总输出折叠栈文本
+	std::string Dump(bool live);
+
+private:
+	std::atomic<size_t> _interval{ 0 };
+	StatCounter _liveSamples;	// 在 _mtx 里修改
+
+	std::mutex _mtx;
+
+	// 指针 -> 样本: 链式哈希表, 桶数组第一次采样时才向系统申请
+	static const size_t SAMPLE_BUCKET_BITS = 16;
+	Sample** _samples = nullptr;
+
+	// 调用栈表
+	static const size_t STACK_BUCKETS = 4096;
+	StackTrace* _stacks[STACK_BUCKETS] = {};
+	size_t _numStacks = 0;
+
+	// 表里的结点不能用 new (替换了 malloc 以后会递归回来), 用定长内存池
+	ObjectPool<Sample> _samplePool;
+	ObjectPool<StackTrace> _stackPool;
+
+private:
+	HeapProfiler();
+
+	HeapProfiler(const HeapProfiler&) = delete;
+	HeapProfiler operator=(const HeapProfiler&) = delete;
+};
@@ -0,0 +1,339 @@
+﻿#define _CRT_SECURE_NO_WARNINGS 1
+
+// 把内存池编成 libcmpool.so, 替换掉 glibc 的 malloc 系列函数和全局的 operator new/delete
+// 现有的程序不用改代码、不用重新编译, 直接 LD_PRELOAD 就能用上内存池:
+//     LD_PRELOAD=./build/libcmpool.so ./a.out
+//
+// 只在 linux 下编译(见 CMakeLists.txt); 动态库用 -fvisibility=hidden 编译, 只导出下面这些接口,
+// 内存池自己的单例、TLS 变量都是库内部的, 不会和程序里另外链接的内存池冲突
+
+#ifndef _WIN32
+
+#include "ConcurrentAlloc.h"
+
+#include <cerrno>
+#include <malloc.h>
+
+#define CMP_EXPORT __attribute__((visibility("default")))
+
+namespace
+{
+	// 超过这个大小的申请按页取整时会溢出, 而且也不可能申请得到, 直接失败
+	const size_t MAX_MALLOC_SIZE = SIZE_MAX / 2;
+
+	// glibc 的 malloc 保证返回的地址按 16 字节(alignof(max_align_t))对齐, 编译器和不少程序都依赖这一点;
+	// 内存池在 128 字节以内是按 8 字节对齐的(比如 24 字节的对象), 所以大于 8 字节的申请按 16 字节取整
+	const size_t MALLOC_ALIGNMENT = 16;
+
+	// 实际向内存池申请的大小
+	size_t MallocSize(size_t size)
+	{
+		if (size == 0)
+			return 1;	// malloc(0) 也要返回一个能 free 的地址
+		if (size > 8)
+			return SizeClass::_RoundUp(size, MALLOC_ALIGNMENT);
+		return size;
+	}
+
+	void* DoMalloc(size_t size)
+	{
+		if (size > MAX_MALLOC_SIZE)
+		{
+			errno = ENOMEM;
+			return nullptr;
+		}
+
+		// 向系统要内存失败时内存池返回空指针(不抛异常, 见 ConcurrentAlloc)
+		void* ptr = ConcurrentAlloc(MallocSize(size));
+		if (ptr == nullptr)
+			errno = ENOMEM;
+		return ptr;
+	}
+
+	// align 必须是 2 的幂
+	void* DoMemalign(size_t align, size_t size)
+	{
+		if (align <= MALLOC_ALIGNMENT)
+			return DoMalloc(size);
+
+		if (size > MAX_MALLOC_SIZE)
+		{
+			errno = ENOMEM;
+			return nullptr;
+		}
+
+		if (align <= ((size_t)1 << PAGE_SHIFT))
+		{
+			// span 是按页对齐的, 只要大小类是 align 的倍数, 从 span 开头切出来的每个对象就都按 align 对齐了
+			// 默认的大小类里, align 的倍数所在的大小类也是 align 的倍数;
+			// 加载的大小类(CMP_SIZE_CLASSES)不一定, 那就往后找一个是 align 倍数的大小类
+			SizeClass::InitTable();
+			size_t bytes = SizeClass::_RoundUp(size == 0 ? 1 : size, align);
+			while (bytes <= MAX_BYTES && SizeClass::RoundUp(bytes) % align != 0)
+			{
+				bytes = SizeClass::_RoundUp(SizeClass::RoundUp(bytes) + 1, align);
+			}
+			return DoMalloc(bytes);
+		}
+
+		// 比一页还大的对齐: 多申请 align 字节, 而且一定走大对象的路径, 返回中间对齐的地址
+		// 大对象 span 的每一页都有页号映射, 释放时用中间的地址也能找到 span
+		size_t bytes = std::max(size + align, (size_t)MAX_BYTES + 1);
+		char* ptr = (char*)DoMalloc(bytes);
+		if (ptr == nullptr)
+			return nullptr;
+		return (void*)SizeClass::_RoundUp((size_t)ptr, align);
+	}
+
+	// 对象实际能用的字节数
+	size_t UsableSize(void* ptr)
+	{
+		Span* span = PageCache::getInstance()->MapObjectToSpan(ptr);
+		if (span->_objSize <= MAX_BYTES)
+			return span->_objSize;	// 小对象的 _objSize 就是大小类的大小
+
+		// 大对象一直用到 span 的末尾(memalign 返回的可能是 span 中间的地址)
+		char* end = (char*)((span->_pageId + span->_n) << PAGE_SHIFT);
+		return end - (char*)ptr;
+	}
+
+	bool IsPowerOfTwo(size_t x)
+	{
+		return x != 0 && (x & (x - 1)) == 0;
+	}
+
+	// operator new 申请失败时要调用 new_handler, 没有 new_handler 才抛 bad_alloc
+	void* DoNew(size_t size, size_t align)
+	{
+		while (true)
+		{
+			void* ptr = DoMemalign(align, size);
+			if (ptr != nullptr)
+				return ptr;
+
+			std::new_handler handler = std::get_new_handler();
+			if (handler == nullptr)
+				throw std::bad_alloc();
+			handler();
+		}
+	}
+
+	void DoFree(void* ptr)
+	{
+		if (ptr != nullptr)
+			ConcurrentFree(ptr);
+	}
+
+	// sized delete: 大小要和 DoMalloc 一样取整, 才能对上申请时的大小类
+	void DoSizedFree(void* ptr, size_t size)
+	{
+		if (ptr != nullptr)
+			ConcurrentFree(ptr, MallocSize(size));
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// C 接口
+
+extern "C"
+{
+
+CMP_EXPORT void* malloc(size_t size) noexcept
+{
+	return DoMalloc(size);
+}
+
+CMP_EXPORT void free(void* ptr) noexcept
+{
+	DoFree(ptr);
+}
+
+CMP_EXPORT void* calloc(size_t n, size_t size) noexcept
+{
+	if (size != 0 && n > SIZE_MAX / size)
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+
+	// 还回来的对象里是脏数据, 要清零
+	void* ptr = DoMalloc(n * size);
+	if (ptr != nullptr)
+		memset(ptr, 0, n * size);
+	return ptr;
+}
+
+CMP_EXPORT void* realloc(void* ptr, size_t size) noexcept
+{
+	if (ptr == nullptr)
+		return DoMalloc(size);
+
+	if (size == 0)
+	{
+		// 和 glibc 一样: realloc(ptr, 0) 相当于 free
+		DoFree(ptr);
+		return nullptr;
+	}
+
+	// 原来的对象放得下, 而且不至于浪费一半以上的空间, 就不用搬
+	size_t oldSize = UsableSize(ptr);
+	if (size <= oldSize && size >= oldSize / 2)
+		return ptr;
+
+	void* newPtr = DoMalloc(size);
+	if (newPtr == nullptr)
+		return nullptr;	// 失败时原来的内存保持不变
+
+	memcpy(newPtr, ptr, std::min(oldSize, size));
+	DoFree(ptr);
+	return newPtr;
+}
+
+CMP_EXPORT void* memalign(size_t align, size_t size) noexcept
+{
+	// 和 glibc 一样, 不是 2 的幂的对齐向上取成 2 的幂
+	size_t pow2 = 1;
+	while (pow2 < align)
+		pow2 <<= 1;
+	return DoMemalign(pow2, size);
+}
+
+CMP_EXPORT int posix_memalign(void** memptr, size_t align, size_t size) noexcept
+{
+	if (!IsPowerOfTwo(align) || align % sizeof(void*) != 0)
+		return EINVAL;
+
+	void* ptr = DoMemalign(align, size);
+	if (ptr == nullptr)
+		return ENOMEM;
+	*memptr = ptr;
+	return 0;
+}
+
+CMP_EXPORT void* aligned_alloc(size_t align, size_t size) noexcept
+{
+	if (!IsPowerOfTwo(align))
+	{
+		errno = EINVAL;
+		return nullptr;
+	}
+	return DoMemalign(align, size);
+}
+
+CMP_EXPORT void* valloc(size_t size) noexcept
+{
+	return DoMemalign((size_t)getpagesize(), size);
+}
+
+CMP_EXPORT void* pvalloc(size_t size) noexcept
+{
+	size_t pageSize = (size_t)getpagesize();
+	return DoMemalign(pageSize, SizeClass::_RoundUp(size == 0 ? 1 : size, pageSize));
+}
+
+CMP_EXPORT size_t malloc_usable_size(void* ptr) noexcept
+{
+	if (ptr == nullptr)
+		return 0;
+	return UsableSize(ptr);
+}
+
+// 和 glibc 的 malloc_stats 一样把统计信息打印到 stderr, 这里打印的是内存池的各级缓存
+CMP_EXPORT void malloc_stats() noexcept
+{
+	std::string text = ConcurrentGetStats().ToText();
+	fputs(text.c_str(), stderr);
+}
+
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// 全局的 operator new / delete
+
+CMP_EXPORT void* operator new(size_t size)
+{
+	return DoNew(size, 0);
+}
+
+CMP_EXPORT void* operator new[](size_t size)
+{
+	return DoNew(size, 0);
+}
+
+CMP_EXPORT void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+	try
+	{
+		return DoNew(size, 0);
+	}
+	catch (...)
+	{
+		return nullptr;
+	}
+}
+
+CMP_EXPORT void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+	try
+	{
+		return DoNew(size, 0);
+	}
+	catch (...)
+	{
+		return nullptr;
+	}
+}
+
+CMP_EXPORT void* operator new(size_t size, std::align_val_t align)
+{
+	return DoNew(size, (size_t)align);
+}
+
+CMP_EXPORT void* operator new[](size_t size, std::align_val_t align)
+{
+	return DoNew(size, (size_t)align);
+}
+
+CMP_EXPORT void* operator new(size_t size, std::align_val_t align, const std::nothrow_t&) noexcept
+{
+	try
+	{
+		return DoNew(size, (size_t)align);
+	}
+	catch (...)
+	{
+		return nullptr;
+	}
+}
+
+CMP_EXPORT void* operator new[](size_t size, std::align_val_t align, const std::nothrow_t&) noexcept
+{
+	try
+	{
+		return DoNew(size, (size_t)align);
+	}
+	catch (...)
+	{
+		return nullptr;
+	}
+}
+
+// 不带大小的 delete: 对象大小从 span 里查
+CMP_EXPORT void operator delete(void* ptr) noexcept { DoFree(ptr); }
+CMP_EXPORT void operator delete[](void* ptr) noexcept { DoFree(ptr); }
+CMP_EXPORT void operator delete(void* ptr, const std::nothrow_t&) noexcept { DoFree(ptr); }
+CMP_EXPORT void operator delete[](void* ptr, const std::nothrow_t&) noexcept { DoFree(ptr); }
+
+// sized delete(C++14): 编译器把对象大小传进来, 小对象不用再查基数树
+CMP_EXPORT void operator delete(void* ptr, size_t size) noexcept { DoSizedFree(ptr, size); }
+CMP_EXPORT void operator delete[](void* ptr, size_t size) noexcept { DoSizedFree(ptr, size); }
+
+// 按对齐申请的对象大小被取整过(见 DoMemalign), 还是从 span 里查
+CMP_EXPORT void operator delete(void* ptr, std::align_val_t) noexcept { DoFree(ptr); }
+CMP_EXPORT void operator delete[](void* ptr, std::align_val_t) noexcept { DoFree(ptr); }
+CMP_EXPORT void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { DoFree(ptr); }
+CMP_EXPORT void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { DoFree(ptr); }
+CMP_EXPORT void operator delete(void* ptr, size_t, std::align_val_t) noexcept { DoFree(ptr); }
+CMP_EXPORT void operator delete[](void* ptr, size_t, std::align_val_t) noexcept { DoFree(ptr); }
+
+#endif // _WIN32
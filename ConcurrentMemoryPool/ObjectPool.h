@@ -1,36 +1,183 @@
 ﻿#pragma once
 
 #include <mutex>
+#include <atomic>
+#include <new>
+#include <cstdint>
+#include <cstddef>
 
-#ifdef _WIN32 
+#ifdef _WIN32
+	#ifndef NOMINMAX
+		#define NOMINMAX	// 避免 windows.h 的 min/max 宏和 std::min/std::max 冲突
+	#endif
 	#include <windows.h>
 #else
 	// linux下brk / mmap 的头文件
+	#include <sys/mman.h>
+	#include <unistd.h>
 #endif
 
-// 直接去堆上按页申请空间
+// 直接去堆上按页申请空间, 失败时返回 nullptr
+// 不抛异常: 调用方大多拿着 page cache 的锁, 抛异常时 __cxa_allocate_exception 要调 malloc,
+// 用 libcmpool.so 替换了 malloc 以后又会走回内存池去抢同一把锁, 进程就卡死了
 inline static void* SystemAlloc(size_t kpage)
 {
 #ifdef _WIN32
 	void* ptr = VirtualAlloc(0, kpage << 13, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
 #else
-	// linux下brk mmap等
+	// linux下用mmap申请匿名私有映射
+	// MAP_NORESERVE: 不预留swap空间, 物理页在第一次访问时才真正分配
+	// 注意: mmap只保证按系统页(4KB)对齐, 而这里一页是8KB, 页号 = 地址 >> 13 要求起始地址按8KB对齐
+	// (VirtualAlloc是按64KB对齐的, 所以windows下没有这个问题)
+	// 所以多映射一页, 再把头尾多出来的部分还回去
+	const size_t size = kpage << 13;
+	const size_t align = (size_t)1 << 13;
+	void* ptr = nullptr;
+	char* base = (char*)mmap(nullptr, size + align, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base != MAP_FAILED)
+	{
+		char* aligned = (char*)(((uintptr_t)base + align - 1) & ~(uintptr_t)(align - 1));
+		size_t head = aligned - base;
+		if (head > 0)
+			munmap(base, head);
+		if (align - head > 0)
+			munmap(aligned + size, align - head);
+		ptr = aligned;
+	}
 #endif
-	if (ptr == nullptr)
-		throw std::bad_alloc();
 	return ptr;
 }
 
+// 申请一段按大页(2MB)对齐的虚拟内存, 让内核用大页来映射: 一个 TLB 项能覆盖 2MB, 减少 TLB miss
+// hugetlb 为 true 时用 hugetlbfs 预留的大页(MAP_HUGETLB), 系统没有预留足够的大页时会失败;
+// 否则用透明大页: 普通匿名映射 + madvise(MADV_HUGEPAGE), 缺页或者 khugepaged 整理时内核换成大页
+// 失败时返回 nullptr(不抛异常), 由调用者退回普通页; windows 下大页需要 SeLockMemoryPrivilege 权限, 这里不支持
+inline static void* SystemAllocHuge(size_t kpage, bool hugetlb)
+{
+#ifdef _WIN32
+	(void)kpage;
+	(void)hugetlb;
+	return nullptr;
+#else
+	const size_t size = kpage << 13;
+	const size_t align = (size_t)1 << 21;
+	if (hugetlb)
+	{
+#ifdef MAP_HUGETLB
+		// hugetlbfs 的映射内核保证按大页对齐, 长度也必须是大页的整数倍
+		void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		return ptr == MAP_FAILED ? nullptr : ptr;
+#else
+		return nullptr;
+#endif
+	}
+
+	// 和 SystemAlloc 一样多映射一段再把头尾裁掉, 保证起始地址按 2MB 对齐
+	char* base = (char*)mmap(nullptr, size + align, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED)
+		return nullptr;
+
+	char* aligned = (char*)(((uintptr_t)base + align - 1) & ~(uintptr_t)(align - 1));
+	size_t head = aligned - base;
+	if (head > 0)
+		munmap(base, head);
+	if (align - head > 0)
+		munmap(aligned + size, align - head);
+
+#ifdef MADV_HUGEPAGE
+	madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+	return aligned;
+#endif
+}
+
 // 释放从堆上申请的空间
-inline static void SystemFree(void* ptr)
+// 注意: munmap需要知道长度, 所以这里要把页数也传进来(VirtualFree用不到)
+inline static void SystemFree(void* ptr, size_t kpage)
 {
 #ifdef _WIN32
-	VirtualFree(ptr, 0, MEM_RELEASE);
+	// MEM_RELEASE 只能释放 VirtualAlloc 返回的整块; 切分过的大span只是其中一段, 只能把物理内存解除提交
+	if (!VirtualFree(ptr, 0, MEM_RELEASE))
+		VirtualFree(ptr, kpage << 13, MEM_DECOMMIT);
 #else
-	// sbrk unmmap等
+	munmap(ptr, kpage << 13);
 #endif
 }
 
+// 把一段内存的物理页还给操作系统, 但保留虚拟地址区间
+// 之后再访问这段内存时, 系统会重新分配物理页, 所以不需要重新映射
+inline static void SystemRelease(void* ptr, size_t kpage)
+{
+#ifdef _WIN32
+	VirtualAlloc(ptr, kpage << 13, MEM_RESET, PAGE_READWRITE);
+#else
+	// MADV_DONTNEED 立即释放物理页, RSS 马上就会降下来
+	// (MADV_FREE 要等内存紧张时内核才回收, RSS 不会立刻下降)
+	madvise(ptr, kpage << 13, MADV_DONTNEED);
+#endif
+}
+
+// 对象池用的锁
+// fork 的时候别的线程可能正拿着某个池子的锁, 子进程里这把锁就永远解不开了(见 AtFork.h)
+// 池子散落在各个模块里(有的是函数内的静态变量), 所以每把锁构造时把自己挂进一个全局链表, fork 前按链表全部加锁
+#ifdef _WIN32
+typedef std::mutex PoolMutex;
+#else
+class PoolMutex : public std::mutex
+{
+public:
+	PoolMutex()
+	{
+		std::unique_lock<std::mutex> lock(_registryMtx);
+		_next = _head;
+		if (_head != nullptr)
+			_head->_prev = this;
+		_head = this;
+	}
+
+	~PoolMutex()
+	{
+		std::unique_lock<std::mutex> lock(_registryMtx);
+		if (_prev != nullptr)
+			_prev->_next = _next;
+		else
+			_head = _next;
+		if (_next != nullptr)
+			_next->_prev = _prev;
+	}
+
+	// fork 前调用: 先锁住链表(不让新的池子在这时候构造), 再把所有池子的锁都拿到
+	static void LockForFork()
+	{
+		_registryMtx.lock();
+		for (PoolMutex* cur = _head; cur != nullptr; cur = cur->_next)
+		{
+			cur->lock();
+		}
+	}
+
+	// fork 后父子进程都调用, 和 LockForFork 反过来
+	static void UnlockAfterFork()
+	{
+		for (PoolMutex* cur = _head; cur != nullptr; cur = cur->_next)
+		{
+			cur->unlock();
+		}
+		_registryMtx.unlock();
+	}
+
+private:
+	PoolMutex* _prev = nullptr;
+	PoolMutex* _next = nullptr;
+
+	inline static std::mutex _registryMtx;
+	inline static PoolMutex* _head = nullptr;
+};
+#endif
+
 // 定长内存池
 template<class T>
 class ObjectPool
@@ -54,17 +201,12 @@ public:
 			else  // 如果链表为空, 那么就去申请
 			{
 				// 剩余内存不够一个对象大小时, 则重新开大块空间
-				if (_remainBytes < sizeof(T))
+				// 向系统要不到内存时返回 nullptr(和 SystemAlloc 一样不抛异常)
+				if (_remainBytes < (int)sizeof(T) && !NewChunk())
 				{
-					_remainBytes = 128 * 1024;
-					//_memory = (char*)malloc(_remainBytes);
-					_memory = (char*)SystemAlloc(_remainBytes >> 13);
-					if (_memory == nullptr)
-					{
-						//printf("malloc error\n");
-						//exit(-1);
-						throw std::bad_alloc();
-					}
+					//printf("malloc error\n");
+					//exit(-1);
+					return nullptr;
 				}
 
 				// 剩余内存够一个对象大小时
@@ -94,12 +236,239 @@ public:
 
 		_freeList = obj;
 	}
+
+	// 保证下一次 New 不用向系统申请内存, 申请不到时返回 false
+	// 给拿着锁、没法处理 New 失败的调用方先预留好(比如往 std::set 里插结点)
+	bool Reserve()
+	{
+		std::unique_lock<std::mutex> lock(_mtx);
+		return _freeList != nullptr || _remainBytes >= (int)sizeof(T) || NewChunk();
+	}
+private:
+	// 重新开一块 128KB 的大块空间, 剩下的零头不要了
+	bool NewChunk()
+	{
+		//_memory = (char*)malloc(_remainBytes);
+		char* memory = (char*)SystemAlloc((128 * 1024) >> 13);
+		if (memory == nullptr)
+			return false;
+
+		_memory = memory;
+		_remainBytes = 128 * 1024;
+		return true;
+	}
+
 private:
 	char* _memory = nullptr;	//  指向内存块的指针
 	int _remainBytes = 0;	//  内存块中剩余字节数  
 	void* _freeList = nullptr;	//  管理还回来的内存对象的⾃由链表
 
-	std::mutex _mtx;
+	PoolMutex _mtx;
+};
+
+// STL 容器用的分配器: 结点从定长内存池里申请, 不走 malloc
+// (内存池自己就是 malloc, LD_PRELOAD 的时候容器再去调 malloc 就递归了)
+// 只支持一次申请一个对象, std::set / std::map 这类基于结点的容器就是这样用的
+//
+// 容器内部的结点类型(红黑树结点是三个指针 + 颜色 + 值)外面拿不到,
+// 所以所有类型共用一个按最大结点开的池子, Reserve 时不用知道结点类型
+class ObjectPoolAllocatorBase
+{
+public:
+	// 保证下一次申请结点不用向系统要内存; 拿着锁往容器里插结点之前先调用它, 返回 false 就别插了
+	// 这样插入时不会抛 bad_alloc(见 SystemAlloc 的注释)
+	static bool Reserve()
+	{
+		return Pool().Reserve();
+	}
+
+protected:
+	// 只要大小和对齐, 构造由容器自己做
+	struct alignas(alignof(std::max_align_t)) Block
+	{
+		char _data[64];
+	};
+
+	static ObjectPool<Block>& Pool()
+	{
+		static ObjectPool<Block> pool;
+		return pool;
+	}
+};
+
+template<class T>
+class ObjectPoolAllocator : public ObjectPoolAllocatorBase
+{
+public:
+	typedef T value_type;
+
+	ObjectPoolAllocator() = default;
+
+	template<class U>
+	ObjectPoolAllocator(const ObjectPoolAllocator<U>&)
+	{}
+
+	T* allocate(size_t n)
+	{
+		static_assert(sizeof(T) <= sizeof(Block) && alignof(T) <= alignof(Block), "node too large for ObjectPoolAllocator");
+		T* ptr = n == 1 ? (T*)Pool().New() : nullptr;
+		if (ptr == nullptr)
+			throw std::bad_alloc();
+		return ptr;
+	}
+
+	void deallocate(T* ptr, size_t)
+	{
+		Pool().Delete((Block*)ptr);
+	}
+
+	template<class U>
+	bool operator==(const ObjectPoolAllocator<U>&) const
+	{
+		return true;
+	}
+
+	template<class U>
+	bool operator!=(const ObjectPoolAllocator<U>&) const
+	{
+		return false;
+	}
+};
+
+// 无锁定长内存池, 接口和 ObjectPool 一样
+// Span、ThreadCache 这些元数据对象在切分/合并 Span、线程启动时都要申请释放, ObjectPool 每次都要加锁
+// 还回来的对象挂在一个无锁栈(Treiber stack)上, New/Delete 在栈不空时只需要一次 CAS
+//
+// ABA 问题: 线程A读到栈顶 a 和 a->next = b 后被挂起, 其他线程弹出 a、b 再把 a 压回去,
+// 栈顶还是 a, 但 b 已经不在栈里了, A 的 CAS 会成功并把 b 放回栈顶
+// 所以栈顶除了指针还带一个版本号, 每次修改都 +1, 上面的情况版本号变了, A 的 CAS 就会失败
+// 64 位平台用户态地址只用低 48 位, 高 16 位放版本号; 32 位平台指针和版本号各占 32 位, 都能放进一个 64 位原子变量
+//
+// 弹栈时会读栈顶对象里的 next, 这个对象可能刚被别的线程弹走在用, 读到的是垃圾值, 但此时版本号已经变了, CAS 会失败重试;
+// 池子申请的大块内存从来不还给系统, 所以这个读操作不会访问到已经解除映射的地址
+//
+// 栈空了以后才加锁从大块内存里切, 一次切一批: 留一个返回, 其余整串一次压进栈里
+template<class T>
+class LockFreeObjectPool
+{
+public:
+	T* New()
+	{
+		void* obj = Pop();
+		if (obj == nullptr)
+		{
+			obj = Refill();
+			if (obj == nullptr)
+				return nullptr;
+		}
+
+		new(obj)T;
+		return (T*)obj;
+	}
+
+	void Delete(T* obj)
+	{
+		obj->~T();
+		Push(obj, obj);
+	}
+
+private:
+	typedef uint64_t Tagged;
+
+#if UINTPTR_MAX > 0xFFFFFFFFu
+	static const int PTR_BITS = 48;
+#else
+	static const int PTR_BITS = 32;
+#endif
+	static const Tagged PTR_MASK = ((Tagged)1 << PTR_BITS) - 1;
+
+	// 一次从大块内存里切多少个对象
+	static const size_t REFILL_NUM = 32;
+
+	static void* Ptr(Tagged top)
+	{
+		return (void*)(uintptr_t)(top & PTR_MASK);
+	}
+
+	// 新的栈顶: 指针换成 ptr, 版本号在旧栈顶的基础上 +1
+	static Tagged Make(void* ptr, Tagged old)
+	{
+		return (Tagged)(uintptr_t)ptr | (((old >> PTR_BITS) + 1) << PTR_BITS);
+	}
+
+	// 把 start ... end 这一串(已经串好)压到栈顶
+	void Push(void* start, void* end)
+	{
+		Tagged old = _top.load(std::memory_order_relaxed);
+		do
+		{
+			*((void**)end) = Ptr(old);
+		} while (!_top.compare_exchange_weak(old, Make(start, old),
+			std::memory_order_release, std::memory_order_relaxed));
+	}
+
+	void* Pop()
+	{
+		Tagged old = _top.load(std::memory_order_acquire);
+		while (Ptr(old) != nullptr)
+		{
+			void* obj = Ptr(old);
+			void* next = *((void**)obj);
+			if (_top.compare_exchange_weak(old, Make(next, old),
+				std::memory_order_acquire, std::memory_order_acquire))
+			{
+				return obj;
+			}
+		}
+		return nullptr;
+	}
+
+	void* Refill()
+	{
+		std::unique_lock<std::mutex> lock(_mtx);
+
+		// 等锁的时候别的线程可能已经切好一批压进栈里了
+		void* obj = Pop();
+		if (obj != nullptr)
+			return obj;
+
+		size_t objSize = sizeof(T) < sizeof(void*) ? sizeof(void*) : sizeof(T);
+		if (_remainBytes < objSize)
+		{
+			// 向系统要不到内存时返回 nullptr
+			char* memory = (char*)SystemAlloc((128 * 1024) >> 13);
+			if (memory == nullptr)
+				return nullptr;
+			_memory = memory;
+			_remainBytes = 128 * 1024;
+		}
+
+		size_t n = _remainBytes / objSize;
+		if (n > REFILL_NUM)
+			n = REFILL_NUM;
+
+		// 第一个返回, 剩下的 n - 1 个串起来压栈
+		obj = _memory;
+		char* start = _memory + objSize;
+		char* end = _memory + (n - 1) * objSize;
+		for (char* cur = start; cur < end; cur += objSize)
+		{
+			*((void**)cur) = cur + objSize;
+		}
+		_memory += n * objSize;
+		_remainBytes -= n * objSize;
+
+		if (n > 1)
+			Push(start, end);
+		return obj;
+	}
+
+private:
+	std::atomic<Tagged> _top{ 0 };	// 还回来的对象组成的无锁栈, 低位是栈顶指针, 高位是版本号
+
+	PoolMutex _mtx;	// 只保护下面的大块内存
+	char* _memory = nullptr;
+	size_t _remainBytes = 0;
 };
 
 /*
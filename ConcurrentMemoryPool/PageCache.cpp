@@ -1,11 +1,65 @@
 ﻿#define _CRT_SECURE_NO_WARNINGS 1
 
 #include "PageCache.h"
+#include "Stats.h"
+#include "AtFork.h"
 
-// 类外初始化静态成员
-PageCache PageCache::_sInst;
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
 
-// 获取一个 K 页的 span
+#ifdef _MSC_VER
+	#include <intrin.h>
+#endif
+
+// x 最低位的 1 在第几位(x 不能为0), 编译成一条 tzcnt / bsf 指令
+static inline size_t CountTrailingZeros(uint64_t x)
+{
+#ifdef _MSC_VER
+	unsigned long index = 0;
+#ifdef _WIN64
+	_BitScanForward64(&index, x);
+#else
+	if (!_BitScanForward(&index, (unsigned long)x))
+	{
+		_BitScanForward(&index, (unsigned long)(x >> 32));
+		index += 32;
+	}
+#endif
+	return index;
+#else
+	return (size_t)__builtin_ctzll(x);
+#endif
+}
+
+PageCache::PageCache()
+{
+	// 和 CMP_SIZE_CLASSES 一样, 通过环境变量打开, 不用改代码
+	const char* mode = getenv("CMP_HUGEPAGE");
+	if (mode != nullptr)
+	{
+		if (strcmp(mode, "thp") == 0)
+			_hugePageMode = HUGEPAGE_THP;
+		else if (strcmp(mode, "hugetlb") == 0)
+			_hugePageMode = HUGEPAGE_HUGETLB;
+	}
+
+	LockStats::InitFromEnv();
+	_pageMtx.SetStats(&_pageLockStats);
+}
+
+// fork 前后拿住/放开所有的锁, 加载内存池的时候就注册好
+// 放在 page cache 里是因为它一定会被链接进来; 只有这一行的 .cpp 放进静态库的话, 链接时会被丢掉
+static const bool forkHandlersRegistered = (RegisterForkHandlers(), true);
+
+// 单调时钟, 毫秒
+static unsigned long long NowMs()
+{
+	return (unsigned long long)std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// 获取一个 K 页的 span, 向系统要不到内存时返回 nullptr
 Span* PageCache::NewSpan(size_t k)
 {
 	assert(k > 0);
@@ -13,85 +67,111 @@ Span* PageCache::NewSpan(size_t k)
 	// 如果K的页数大于128页，那么就去找堆申请
 	if (k > NPAGES - 1)
 	{
+		// 先看释放回来的大span里有没有够用的, 有的话直接复用这段地址
+		Span* large = FindLargeSpan(k);
+		if (large != nullptr)
+			return large;
+
 		//cout << "申请的page大于128页, 开始向堆申请" << endl;
 		void* ptr = SystemAlloc(k);
+		if (ptr == nullptr)
+			return nullptr;
 
 		//Span* span = new Span;
 		Span* span = _spanPool.New(); // 替换
 
+		// 三层基数树的结点是按需创建的, set之前要先确保这段页号对应的结点已经建好
+		if (span == nullptr || !_idSpanMap.Ensure((PAGE_ID)ptr >> PAGE_SHIFT, k))
+		{
+			if (span != nullptr)
+				_spanPool.Delete(span);
+			SystemFree(ptr, k);
+			return nullptr;
+		}
+		_mappedPages.Add(k);
+		_systemAllocs.Add(1);
+
 		span->_pageId = (PAGE_ID)ptr >> PAGE_SHIFT;
 		span->_n = k;
 
-		//_idSpanMap[span->_pageId] = span;
-		_idSpanMap.set(span->_pageId, span);	// 使用基数树优化
+		// 每一页都建立映射: memalign 这类按大于一页对齐的申请返回的是span中间的地址, 释放时也要能找到span
+		for (PAGE_ID i = 0; i < span->_n; ++i)
+		{
+			//_idSpanMap[span->_pageId] = span;
+			_idSpanMap.set(span->_pageId + i, span);	// 使用基数树优化
+		}
 
 		return span;
 	}
 
-	// 先检查第k个桶里面有没有span
-	if (!_spanLists[k].Empty())
+	// 大页 arena 里的内存要挑着切: 优先从最满的大页里切, 让空的大页一直空着, 以后能整个还给操作系统
+	if (_arenaPages > 0)
 	{
-		Span* kSpan = _spanLists[k].PopFront();
-
-		// 建立【页号 -- span】的映射，方便central cache回收小块儿内存时，查找对应的span
-		for (PAGE_ID i = 0; i < kSpan->_n; ++i)
+		Span* nSpan = FindSpanInFullestHugePage(k);
+		if (nSpan != nullptr)
 		{
-			//_idSpanMap[kSpan->_pageId + i] = kSpan;
-			_idSpanMap.set(kSpan->_pageId + i, kSpan);	// 使用基数树优化
+			EraseSpan(nSpan);
+			return CarveSpan(nSpan, k);
 		}
+	}
 
-		return kSpan;
+	// 先检查第k个桶里面有没有span, 没有的话就去后面的桶里找, 找到了就把它进行切分
+	// 不用一个一个桶往后看: 位图里记着哪些桶不空, 找第一个不空的桶就是找 >= k 的第一个为1的位
+	// 在链表头上的几个span里取地址最低的, 在用的内存尽量往低地址集中, 高地址的空闲span更容易连成大块
+	// 桶里不排序: 碎片多的时候桶会很长, 按地址插入要在 page cache 的大锁里遍历整个链表
+	size_t i = FindNonEmptyBucket(_spanBits, k);
+	if (i < NPAGES)
+	{
+		Span* nSpan = _spanLists[i].LowestAmongFirst(LOWEST_SPAN_CANDIDATES);
+		EraseSpan(nSpan);
+		return CarveSpan(nSpan, k);
 	}
-	
-	// 走到这里, 说明第k个桶里面是空的;
-	// 那么就去检查一下后面的桶里面有没有span, 如果有, 就可以把它进行切分
-	for (size_t i = k + 1; i < NPAGES; i++)
+
+	// 走到这里, 说明驻留在内存里的span都不够用了
+	// 再看看已经还给操作系统的span, 它们的虚拟地址还在, 重新访问时系统会重新分配物理页
+	i = FindNonEmptyBucket(_returnedSpanBits, k);
+	if (i < NPAGES)
 	{
-		if (!_spanLists[i].Empty())
+		Span* span = _returnedSpanLists[i].LowestAmongFirst(LOWEST_SPAN_CANDIDATES);
+		EraseSpan(span);
+		if (span->_n > k)
 		{
-			// 切分成一个k页的span，和一个n-k页的span
-			// 然后把k页的span返回给central cache
-			// 最后把n-k页的span挂到第n-k个桶中去
-			Span* nSpan = _spanLists[i].PopFront();
-			//Span* kSpan = new Span;
-			Span* kSpan = _spanPool.New();
-
-			// 在nSpan的头部切一个k页下来
-			kSpan->_pageId = nSpan->_pageId;	// 页号
-			kSpan->_n = k;	// 页数
-
-			nSpan->_pageId += k;
-			nSpan->_n -= k;	//	还剩下n-k页
-
-			_spanLists[nSpan->_n].PushFront(nSpan);	// 把剩下的n-k页挂到第n-k个位置
-
-			// 存储(n-k)的Span的首尾页号跟(n-k)的Span的映射，
-			// 方便page cache回收内存时，进行的合并查找
-
-			// 假设第一页的pageId是1000，总共有5页
-			// 那么最后一页就是 1000 + 5 - 1 = 1004
-			//_idSpanMap[nSpan->_pageId] = nSpan;	// 第一页
-			//_idSpanMap[nSpan->_pageId + nSpan->_n - 1] = nSpan;	// 最后一页
-			_idSpanMap.set(nSpan->_pageId, nSpan);	// 使用基数树优化
-			_idSpanMap.set(nSpan->_pageId + nSpan->_n - 1, nSpan);	// 使用基数树优化
-
-			// 建立【页号 -- span】的映射，方便central cache回收小块儿内存时，查找对应的span
-			for (PAGE_ID i = 0; i < kSpan->_n; ++i)
+			// 只拿出需要的k页, 剩下的n-k页还是已归还的状态, 挂回去
+			Span* restSpan = _spanPool.New();
+			if (restSpan == nullptr)
 			{
-				//_idSpanMap[kSpan->_pageId + i] = kSpan;
-				_idSpanMap.set(kSpan->_pageId + i, kSpan);	// 使用基数树优化
+				PushSpan(span);
+				return nullptr;
 			}
+			restSpan->_pageId = span->_pageId + k;
+			restSpan->_n = span->_n - k;
+			restSpan->_isReturned = true;
+			span->_n = k;
 
-			return kSpan;
+			PushSpan(restSpan);
+			_idSpanMap.set(restSpan->_pageId, restSpan);
+			_idSpanMap.set(restSpan->_pageId + restSpan->_n - 1, restSpan);
 		}
+
+		// 挂到第k个桶里, 再走一遍上面的逻辑
+		span->_isReturned = false;
+		PushSpan(span);
+		return NewSpan(k);
 	}
 
 	// 走到这个位置, 说明后面没有大页的span
 	// 此时, 需要去找堆要一个128页的span
 	//Span* bigSpan = new Span;
 	Span* bigSpan = _spanPool.New();
+	if (bigSpan == nullptr)
+		return nullptr;
 
-	void* ptr = SystemAlloc(NPAGES - 1); // 根据 kpage（页数量）向 操作系统申请一大片连续虚拟内存。
+	void* ptr = SystemAllocChunk(); // 根据 kpage（页数量）向 操作系统申请一大片连续虚拟内存。
+	if (ptr == nullptr)
+	{
+		_spanPool.Delete(bigSpan);
+		return nullptr;
+	}
 	// 通常 1 页 = 8KB = 2¹³ Byte, 1KB = 1024Byte
 	// 那么第0页的起始地址为0
 	// 第一页的起始地址为 8*1024 = 1 * 8k
@@ -100,21 +180,110 @@ Span* PageCache::NewSpan(size_t k)
 	// 很简单：地址 / 8k = 页号
 	bigSpan->_pageId = (PAGE_ID)ptr >> PAGE_SHIFT; // 页号
 	bigSpan->_n = NPAGES - 1;	// 页的数量
+	_mappedPages.Add(bigSpan->_n);
 	
-	_spanLists[bigSpan->_n].PushFront(bigSpan);
+	PushSpan(bigSpan);
 
 	//cout << "申请的对象大于256KB, 那么向PageCache直接申请整页" << endl;
 	return NewSpan(k);
 }
 
 
+// 从一个已经摘下来的空闲span头部切k页出来返回, 剩下的n-k页挂回去
+// 要不到 Span 对象时把 nSpan 原样挂回去, 返回 nullptr
+Span* PageCache::CarveSpan(Span* nSpan, size_t k)
+{
+	assert(nSpan->_n >= k);
+
+	Span* kSpan = nSpan;
+	if (nSpan->_n > k)
+	{
+		// 切分成一个k页的span，和一个n-k页的span
+		// 然后把k页的span返回给central cache
+		// 最后把n-k页的span挂到第n-k个桶中去
+		//Span* kSpan = new Span;
+		kSpan = _spanPool.New();
+		if (kSpan == nullptr)
+		{
+			PushSpan(nSpan);
+			return nullptr;
+		}
+
+		// 在nSpan的头部切一个k页下来
+		kSpan->_pageId = nSpan->_pageId;	// 页号
+		kSpan->_n = k;	// 页数
+
+		nSpan->_pageId += k;
+		nSpan->_n -= k;	//	还剩下n-k页
+
+		PushSpan(nSpan);	// 把剩下的n-k页挂到第n-k个位置
+
+		// 存储(n-k)的Span的首尾页号跟(n-k)的Span的映射，
+		// 方便page cache回收内存时，进行的合并查找
+
+		// 假设第一页的pageId是1000，总共有5页
+		// 那么最后一页就是 1000 + 5 - 1 = 1004
+		//_idSpanMap[nSpan->_pageId] = nSpan;	// 第一页
+		//_idSpanMap[nSpan->_pageId + nSpan->_n - 1] = nSpan;	// 最后一页
+		_idSpanMap.set(nSpan->_pageId, nSpan);	// 使用基数树优化
+		_idSpanMap.set(nSpan->_pageId + nSpan->_n - 1, nSpan);	// 使用基数树优化
+	}
+
+	// 建立【页号 -- span】的映射，方便central cache回收小块儿内存时，查找对应的span
+	for (PAGE_ID i = 0; i < kSpan->_n; ++i)
+	{
+		//_idSpanMap[kSpan->_pageId + i] = kSpan;
+		_idSpanMap.set(kSpan->_pageId + i, kSpan);	// 使用基数树优化
+	}
+
+	HugePage* hp = GetHugePage(kSpan->_pageId);
+	if (hp != nullptr)
+	{
+		hp->_used += k;
+	}
+
+	return kSpan;
+}
+
+// 在页数 >= k 的桶里挑一个span, 挑它所在大页已经用掉的页最多的那个 (类似 tcmalloc 的 Temeraire)
+// 新的span塞进已经比较满的大页里, 空的大页和快空的大页就有机会变成整个空的大页, 可以整个还给操作系统,
+// 在用的内存集中在少数几个大页里, TLB 覆盖率也高
+// 每个桶只看前几个, 一共最多看 FILLER_CANDIDATES 个, 免得空闲span很多的时候这里太慢
+Span* PageCache::FindSpanInFullestHugePage(size_t k)
+{
+	Span* best = nullptr;
+	size_t bestUsed = 0;
+	size_t seen = 0;
+	for (size_t i = FindNonEmptyBucket(_spanBits, k); i < NPAGES && seen < FILLER_CANDIDATES; i = FindNonEmptyBucket(_spanBits, i + 1))
+	{
+		size_t n = 0;
+		for (Span* span = _spanLists[i].Begin(); span != _spanLists[i].End() && n < FILLER_BUCKET_CANDIDATES; span = span->_next)
+		{
+			// 不在 arena 里的内存(打开大页模式之前申请的)当作空的大页
+			HugePage* hp = GetHugePage(span->_pageId);
+			size_t used = hp != nullptr ? hp->_used : 0;
+
+			// 一样满的话要页数少的那个(先看到的), 少切碎大的span
+			if (best == nullptr || used > bestUsed)
+			{
+				best = span;
+				bestUsed = used;
+			}
+			++n;
+			++seen;
+		}
+	}
+	return best;
+}
+
+
 // 获取从对象到span的映射
 Span* PageCache::MapObjectToSpan(void* obj)
 {
 	PAGE_ID id = ((PAGE_ID)obj >> PAGE_SHIFT);	// 计算页号
 
 	/*
-	std::unique_lock<std::mutex> lock(_pageMtx); // 添加RAII风格的锁
+	std::unique_lock<InstrumentedMutex> lock(_pageMtx); // 添加RAII风格的锁
 	auto ret = _idSpanMap.find(id);
 	if (ret != _idSpanMap.end())
 	{
@@ -135,18 +304,44 @@ Span* PageCache::MapObjectToSpan(void* obj)
 // 释放空闲span回到Pagecache，并合并相邻的span
 void PageCache::ReleaseSpanToPageCache(Span* span)
 {
-	// 如果span的页数大于128页, 说明是找堆申请的, 直接还给堆
+	// 如果span的页数大于128页, 说明是找堆申请的
+	// 以前直接还给堆, 每次申请释放都是一对 mmap/munmap(还有所有核的 TLB shootdown 和重新缺页);
+	// 现在先缓存起来, 下次申请大span时复用这段地址
+	// 缓存的总页数有上限, 放得太久的也会还给堆, 见 TrimLargeSpans
 	if (span->_n > NPAGES - 1)
 	{
-		void* ptr = (void*)(span->_pageId << PAGE_SHIFT);
-		SystemFree(ptr);
-		//delete span;
-		_spanPool.Delete(span);
+		span->_isUse = false;
+		span->_isReturned = false;
 
-		//cout << "把从堆上申请的【大于128页的span】还给堆" << endl;
+		// 集合的结点要不到(地址空间用完了)就不缓存, 直接还给系统, 拿着锁插入时不能抛 bad_alloc
+		if (!SpanSet::allocator_type::Reserve())
+		{
+			UnmapLargeSpan(span);
+			return;
+		}
+		InsertLargeSpan(span, NowMs());
+		IncrementalScavenge(span->_n);	// 里面会按上限和衰减时间修剪缓存
 		return;
 	}
 
+	// 合并以后span->_n就变了, 先记下释放回来的页数
+	size_t n = span->_n;
+
+	HugePage* hp = GetHugePage(span->_pageId);
+	if (hp != nullptr)
+	{
+		assert(hp->_used >= n);
+		hp->_used -= n;
+		hp->_resident = true;
+	}
+
+	InsertFreeSpan(span);
+	IncrementalScavenge(n);
+}
+
+// 合并相邻的同状态(驻留/已归还)的空闲span, 然后挂到对应的桶里
+void PageCache::InsertFreeSpan(Span* span)
+{
 	// 对span前后的页, 尝试进行合并, 缓解内存碎片问题（解决外碎片）
 	while (1)
 	{
@@ -172,6 +367,18 @@ void PageCache::ReleaseSpanToPageCache(Span* span)
 			break;
 		}
 
+		// 一个驻留、一个已归还, 状态不同不合并
+		if (prevSpan->_isReturned != span->_isReturned)
+		{
+			break;
+		}
+
+		// 不跨大页合并: arena 里的span都落在一个大页里, 大页变空时才能找齐它的span整个归还
+		if (_arenaPages > 0 && GetHugePage(prevSpan->_pageId) != GetHugePage(span->_pageId))
+		{
+			break;
+		}
+
 		// 此时合并出超过128页的span没办法管理，不合并了
 		if (prevSpan->_n + span->_n > NPAGES - 1)
 		{
@@ -182,7 +389,7 @@ void PageCache::ReleaseSpanToPageCache(Span* span)
 		span->_pageId = prevSpan->_pageId;
 		span->_n += prevSpan->_n;
 
-		_spanLists[prevSpan->_n].Erase(prevSpan);
+		EraseSpan(prevSpan);
 		//delete prevSpan;
 		_spanPool.Delete(prevSpan);
 
@@ -213,6 +420,18 @@ void PageCache::ReleaseSpanToPageCache(Span* span)
 			break;
 		}
 
+		// 一个驻留、一个已归还, 状态不同不合并
+		if (nextSpan->_isReturned != span->_isReturned)
+		{
+			break;
+		}
+
+		// 不跨大页合并: arena 里的span都落在一个大页里, 大页变空时才能找齐它的span整个归还
+		if (_arenaPages > 0 && GetHugePage(nextSpan->_pageId) != GetHugePage(span->_pageId))
+		{
+			break;
+		}
+
 		// 此时合并出超过128页的span没办法管理，不合并了
 		if (nextSpan->_n + span->_n > NPAGES - 1)
 		{
@@ -222,17 +441,644 @@ void PageCache::ReleaseSpanToPageCache(Span* span)
 		// 除开上述三种情况以后，开始合并
 		span->_n += nextSpan->_n;
 
-		_spanLists[nextSpan->_n].Erase(nextSpan);
+		EraseSpan(nextSpan);
 		//delete nextSpan;
 		_spanPool.Delete(nextSpan);
 	}
 
 	// 合并好以后，挂到对应的位置，并且要在map中建立首尾页的映射
-	_spanLists[span->_n].PushFront(span);
+	PushSpan(span);
 	span->_isUse = false;
 	
 	//_idSpanMap[span->_pageId] = span;
 	//_idSpanMap[span->_pageId + span->_n - 1] = span;
 	_idSpanMap.set(span->_pageId, span);	// 使用基数树进行优化 
 	_idSpanMap.set(span->_pageId + span->_n - 1, span);	// 使用基数树进行优化
-}
\ No newline at end of file
+}
+
+// 把一个驻留的空闲span的物理页还给操作系统, 返回归还的页数
+size_t PageCache::ReleaseSpan(Span* span)
+{
+	assert(!span->_isUse && !span->_isReturned);
+
+	// 超过128页的span不合并, 直接挪到已归还的集合里(在时间链表里的位置不变)
+	if (span->_n > NPAGES - 1)
+	{
+		_largeSpans.erase(span);
+		SystemRelease((void*)(span->_pageId << PAGE_SHIFT), span->_n);
+		span->_isReturned = true;
+		_returnedLargeSpans.insert(span);
+		_freePages.Sub(span->_n);
+		_returnedPages.Add(span->_n);
+		return span->_n;
+	}
+
+	// 所在的大页已经整个空了, 就把整个大页一起还回去, 以后再用时内核还能按大页映射
+	HugePage* hp = GetHugePage(span->_pageId);
+	if (hp != nullptr && hp->_used == 0)
+	{
+		return ReleaseHugePage(hp);
+	}
+
+	EraseSpan(span);
+
+	size_t n = span->_n;
+	SystemRelease((void*)(span->_pageId << PAGE_SHIFT), n);
+	span->_isReturned = true;
+
+	// 和相邻的已归还span合并, 挂到已归还的桶里
+	InsertFreeSpan(span);
+	return n;
+}
+
+// 把一个整个空闲的大页还给操作系统, 返回归还的页数(原来就已经归还的页不算)
+// 大页里全是空闲span, 而且都不跨大页, 从大页的第一页开始顺着span往后走就能找齐
+size_t PageCache::ReleaseHugePage(HugePage* hp)
+{
+	assert(hp->_used == 0);
+	const PAGE_ID end = hp->_pageId + HUGEPAGE_PAGES;
+
+	// 先把驻留的span都摘下来标记成已归还, 整个大页一次 madvise
+	// arena 是按顺序切的, 大页后面可能还有一段没切出去(没有span), 那段从来没被访问过, 走到那里就停
+	size_t pages = 0;
+	for (PAGE_ID id = hp->_pageId; id < end;)
+	{
+		Span* span = (Span*)_idSpanMap.get(id);
+		if (span == nullptr)
+			break;
+
+		assert(span->_pageId == id && !span->_isUse);
+		if (!span->_isReturned)
+		{
+			EraseSpan(span);
+			span->_isReturned = true;
+			PushSpan(span);
+			pages += span->_n;
+		}
+		id += span->_n;
+	}
+
+	SystemRelease((void*)(hp->_pageId << PAGE_SHIFT), HUGEPAGE_PAGES);
+	hp->_resident = false;
+
+	// 再把相邻的已归还span合并起来
+	for (PAGE_ID id = hp->_pageId; id < end;)
+	{
+		Span* span = (Span*)_idSpanMap.get(id);
+		if (span == nullptr)
+			break;
+
+		EraseSpan(span);
+		InsertFreeSpan(span);
+		id = span->_pageId + span->_n;
+	}
+	return pages;
+}
+
+// 找一个整个空闲、还有驻留物理页的大页还给操作系统, 返回归还的页数, 没有就返回0
+size_t PageCache::ReleaseEmptyHugePage()
+{
+	for (HugePage* hp = _hugePages; hp != nullptr; hp = hp->_next)
+	{
+		if (hp->_used == 0 && hp->_resident)
+		{
+			size_t pages = ReleaseHugePage(hp);
+			if (pages > 0)
+				return pages;
+		}
+	}
+	return 0;
+}
+
+size_t PageCache::EmptyHugePages()
+{
+	size_t n = 0;
+	for (HugePage* hp = _hugePages; hp != nullptr; hp = hp->_next)
+	{
+		if (hp->_used == 0)
+			++n;
+	}
+	return n;
+}
+
+// 把所有空闲span的物理页都还给操作系统
+size_t PageCache::ReleaseFreeMemory()
+{
+	// 放太久的大span直接解除映射, 剩下的也把物理页还掉
+	TrimLargeSpans();
+
+	size_t pages = 0;
+	for (size_t i = 1; i < NPAGES; ++i)
+	{
+		while (!_spanLists[i].Empty())
+		{
+			pages += ReleaseSpan(_spanLists[i].Begin());
+		}
+	}
+	while (!_largeSpans.empty())
+	{
+		pages += ReleaseSpan(*_largeSpans.begin());
+	}
+	return pages;
+}
+
+void PageCache::SetReleaseRate(double rate)
+{
+	_releaseRate = rate;
+	_scavengeCounter = rate > 0 ? RELEASE_DELAY_PAGES / rate : 0;
+}
+
+// 每释放回来 RELEASE_DELAY_PAGES / rate 页, 就把一个空闲span还给操作系统
+// 这样流量高峰过后, 多出来的空闲内存会慢慢还给系统, 不会一直占着RSS
+void PageCache::IncrementalScavenge(size_t n)
+{
+	// 只有小对象在申请释放时, 缓存的大span也要按时衰减, 不能等到下一次大对象的申请释放
+	TrimLargeSpans();
+	TrimLargeSpanShards();
+
+	if (_releaseRate <= 0)
+		return;
+
+	_scavengeCounter -= n;
+	if (_scavengeCounter > 0)
+		return;
+
+	// 大页模式下先还整个空闲的大页;
+	// 还有span在用的大页不拆开还, 否则内核只能把它拆成普通页, TLB 覆盖率就下降了
+	size_t hugeReleased = _arenaPages > 0 ? ReleaseEmptyHugePage() : 0;
+	if (hugeReleased > 0)
+	{
+		_scavengeCounter = RELEASE_DELAY_PAGES * hugeReleased / (double)(NPAGES - 1) / _releaseRate;
+		return;
+	}
+
+	// 轮流从各个桶里挑一个span归还: 链表尾部是最早放进来的, 最久没被用到;
+	// 第 NPAGES 号"桶"是超过128页的span, 集合按(页数, 地址)排序, 挑最后一个, 也就是页数最多的(一样多时地址最高的):
+	// 最佳适配总是先用小的, 最大的最不容易马上被用到, 一次归还得也最多
+	for (size_t i = 0; i < NPAGES; ++i)
+	{
+		size_t index = _scavengeIndex;
+		_scavengeIndex = _scavengeIndex % NPAGES + 1;	// [1, 129] 循环
+		Span* span = nullptr;
+		if (index == NPAGES)
+		{
+			if (!_largeSpans.empty())
+				span = *_largeSpans.rbegin();
+		}
+		else if (!_spanLists[index].Empty())
+		{
+			span = _spanLists[index].End()->_prev;
+		}
+
+		if (span != nullptr)
+		{
+			if (_arenaPages > 0 && GetHugePage(span->_pageId) != nullptr)
+				continue;
+
+			size_t released = ReleaseSpan(span);
+
+			// 归还得越多, 下一次等得越久
+			_scavengeCounter = RELEASE_DELAY_PAGES * released / (double)(NPAGES - 1) / _releaseRate;
+			if (_scavengeCounter < 1)
+				_scavengeCounter = 1;
+			return;
+		}
+	}
+
+	// 没有可以归还的span了, 重新开始计数
+	_scavengeCounter = RELEASE_DELAY_PAGES / _releaseRate;
+}
+
+// 把空闲span挂到对应的桶的链表头上, 并在位图里标记这个桶不空
+void PageCache::PushSpan(Span* span)
+{
+	assert(span->_n < NPAGES);
+	GetSpanList(span).PushFront(span);
+
+	uint64_t* bits = span->_isReturned ? _returnedSpanBits : _spanBits;
+	bits[span->_n / 64] |= (uint64_t)1 << (span->_n % 64);
+	(span->_isReturned ? _returnedPages : _freePages).Add(span->_n);
+}
+
+// 从桶里摘下一个空闲span, 桶空了就清掉位图里的标记
+void PageCache::EraseSpan(Span* span)
+{
+	SpanList& list = GetSpanList(span);
+	list.Erase(span);
+	(span->_isReturned ? _returnedPages : _freePages).Sub(span->_n);
+	if (list.Empty())
+	{
+		uint64_t* bits = span->_isReturned ? _returnedSpanBits : _spanBits;
+		bits[span->_n / 64] &= ~((uint64_t)1 << (span->_n % 64));
+	}
+}
+
+// 第一个 >= k 的不空的桶, 没有就返回 NPAGES
+size_t PageCache::FindNonEmptyBucket(const uint64_t* bits, size_t k)
+{
+	for (size_t w = k / 64; w < BUCKET_BITMAP_WORDS; ++w)
+	{
+		uint64_t word = bits[w];
+		if (w == k / 64)
+			word &= ~(uint64_t)0 << (k % 64);	// k 前面的桶不要
+		if (word != 0)
+			return w * 64 + CountTrailingZeros(word);
+	}
+	return NPAGES;
+}
+
+// 在超过128页的空闲span里找一个够k页的: 页数最少的(best-fit), 一样多的取地址最低的
+// 先找物理页还驻留的, 再找已经还给操作系统的; 多出来的页切下来挂回去
+Span* PageCache::FindLargeSpan(size_t k)
+{
+	// 顺便把放太久的大span还给系统
+	TrimLargeSpans();
+
+	Span key;
+	key._n = k;
+	key._pageId = 0;
+
+	SpanSet* sets[] = { &_largeSpans, &_returnedLargeSpans };
+	for (SpanSet* set : sets)
+	{
+		auto it = set->lower_bound(&key);
+		if (it == set->end())
+			continue;
+
+		Span* span = *it;
+		EraseLargeSpan(span);
+
+		if (span->_n > k)
+		{
+			Span* restSpan = _spanPool.New();
+			if (restSpan == nullptr)
+			{
+				// 要不到 Span 对象就没法切, 原样放回去, 当作没找到
+				InsertLargeSpan(span, span->_freeTime);
+				return nullptr;
+			}
+			restSpan->_pageId = span->_pageId + k;
+			restSpan->_n = span->_n - k;
+			restSpan->_isReturned = span->_isReturned;
+			_idSpanMap.set(restSpan->_pageId, restSpan);
+			_idSpanMap.set(restSpan->_pageId + restSpan->_n - 1, restSpan);
+
+			// 剩下的不到128页就挂到桶里, 否则放回缓存(还是原来放进去的时间)
+			if (restSpan->_n > NPAGES - 1)
+				InsertLargeSpan(restSpan, span->_freeTime);
+			else
+				PushSpan(restSpan);
+
+			span->_n = k;
+		}
+
+		// 整个span的每一页都建立映射(和向系统申请的大span一样)
+		for (PAGE_ID i = 0; i < span->_n; ++i)
+		{
+			_idSpanMap.set(span->_pageId + i, span);
+		}
+		span->_isReturned = false;
+		return span;
+	}
+	return nullptr;
+}
+
+// 超过128页的空闲span放进缓存: 按 best-fit 排序的集合 + 按放进来的时间排序的链表
+// freeTime 比链表里已有的都早时(切分剩下的部分)从尾部往前找位置, 保证链表从头到尾时间越来越早
+void PageCache::InsertLargeSpan(Span* span, unsigned long long freeTime)
+{
+	span->_freeTime = freeTime;
+	(span->_isReturned ? _returnedLargeSpans : _largeSpans).insert(span);
+
+	Span* pos = _largeSpanLru.Begin();
+	while (pos != _largeSpanLru.End() && pos->_freeTime > freeTime)
+	{
+		pos = pos->_next;
+	}
+	_largeSpanLru.Insert(pos, span);
+	_largeSpanPages.Add(span->_n);
+	(span->_isReturned ? _returnedPages : _freePages).Add(span->_n);
+}
+
+void PageCache::EraseLargeSpan(Span* span)
+{
+	(span->_isReturned ? _returnedLargeSpans : _largeSpans).erase(span);
+	_largeSpanLru.Erase(span);
+	_largeSpanPages.Sub(span->_n);
+	(span->_isReturned ? _returnedPages : _freePages).Sub(span->_n);
+}
+
+// 缓存的大span超过上限, 或者放得比衰减时间还久, 就从最早放进来的开始还给系统(解除映射)
+// 反复申请释放同样大小的缓冲区时, 缓存一直会被命中, 不会放到过期; 流量过去以后这些地址空间会慢慢还回去
+void PageCache::TrimLargeSpans()
+{
+	if (_largeSpanLru.Empty())
+		return;
+
+	unsigned long long now = NowMs();
+	while (!_largeSpanLru.Empty())
+	{
+		Span* oldest = _largeSpanLru.End()->_prev;
+		if (_largeSpanPages.Get() <= _largeSpanLimit && oldest->_freeTime + _largeSpanDecayMs > now)
+			break;
+
+		EraseLargeSpan(oldest);
+		UnmapLargeSpan(oldest);
+	}
+}
+
+// 把一个空闲的大span还给系统
+void PageCache::UnmapLargeSpan(Span* span)
+{
+	// 这段地址还给系统以后可能被别的映射复用, 留着旧映射的话合并时会找到已经删掉的span
+	for (PAGE_ID i = 0; i < span->_n; ++i)
+	{
+		_idSpanMap.set(span->_pageId + i, nullptr);
+	}
+
+	void* ptr = (void*)(span->_pageId << PAGE_SHIFT);
+	SystemFree(ptr, span->_n);
+	_mappedPages.Sub(span->_n);
+	//delete span;
+	_spanPool.Delete(span);
+}
+
+void PageCache::SetLargeSpanCache(size_t pages, unsigned long long decayMs)
+{
+	_largeSpanLimit = pages;
+	_largeSpanDecayMs = decayMs;
+	TrimLargeSpans();
+}
+
+void PageCache::SetHugePageMode(HugePageMode mode)
+{
+	_hugePageMode = mode;
+}
+
+// 向系统要一块 128 页(1MB)的内存, 要不到时返回 nullptr
+// 每次单独 mmap 1MB 的话, 堆散落在很多小映射里, 内核没法用大页映射, TLB miss 很多;
+// 大页模式下先预留一段按 2MB 对齐的 arena, 再从里面按地址顺序切, 两块正好填满一个大页
+void* PageCache::SystemAllocChunk()
+{
+	const size_t chunkBytes = (NPAGES - 1) << PAGE_SHIFT;
+	void* ptr = nullptr;
+	bool fromArena = false;
+	if (_hugePageMode != HUGEPAGE_NONE)
+	{
+		if (_arenaCur == _arenaEnd)
+			NewHugePageArena();
+		if (_arenaCur != _arenaEnd)
+		{
+			ptr = _arenaCur;
+			_arenaCur += chunkBytes;
+			fromArena = true;
+		}
+	}
+
+	if (!fromArena)
+	{
+		// 没开大页, 或者平台不支持大页, 只能用普通页了
+		ptr = SystemAlloc(NPAGES - 1);
+		if (ptr == nullptr)
+			return nullptr;
+		_systemAllocs.Add(1);
+	}
+
+	// 这128页以后切分、合并时都会在基数树里建立映射, 所以这里一次性把结点建好
+	// 建不了就把这块内存退回去: arena 里的就是刚切出来的最后一块, 把指针挪回去就行
+	if (!_idSpanMap.Ensure((PAGE_ID)ptr >> PAGE_SHIFT, NPAGES - 1))
+	{
+		if (fromArena)
+			_arenaCur -= chunkBytes;
+		else
+			SystemFree(ptr, NPAGES - 1);
+		return nullptr;
+	}
+	return ptr;
+}
+
+// 预留一段新的大页 arena, 失败时 _arenaCur 和 _arenaEnd 不变(还是相等的)
+void PageCache::NewHugePageArena()
+{
+	void* arena = SystemAllocHuge(ARENA_PAGES, _hugePageMode == HUGEPAGE_HUGETLB);
+
+	// 没有预留 hugetlbfs 大页的话退回透明大页
+	if (arena == nullptr && _hugePageMode == HUGEPAGE_HUGETLB)
+		arena = SystemAllocHuge(ARENA_PAGES, false);
+	if (arena == nullptr)
+		return;
+
+	// 每个大页建一个记录使用情况的结点, 串到 _hugePages 里; 结点都要到了才开始用这段 arena
+	const size_t hugePages = ARENA_PAGES / HUGEPAGE_PAGES;
+	PAGE_ID hugeId = (PAGE_ID)arena >> HUGEPAGE_SHIFT;
+	HugePage* nodes[hugePages] = {};
+	bool ok = _hugePageMap.Ensure(hugeId, hugePages);
+	for (size_t i = 0; ok && i < hugePages; ++i)
+	{
+		nodes[i] = _hugePagePool.New();
+		ok = nodes[i] != nullptr;
+	}
+	if (!ok)
+	{
+		for (size_t i = 0; i < hugePages && nodes[i] != nullptr; ++i)
+		{
+			_hugePagePool.Delete(nodes[i]);
+		}
+		SystemFree(arena, ARENA_PAGES);
+		return;
+	}
+
+	_systemAllocs.Add(1);
+	for (size_t i = 0; i < hugePages; ++i)
+	{
+		HugePage* hp = nodes[i];
+		hp->_pageId = ((PAGE_ID)arena >> PAGE_SHIFT) + i * HUGEPAGE_PAGES;
+		hp->_next = _hugePages;
+		_hugePages = hp;
+		_hugePageMap.set(hugeId + i, hp);
+	}
+	_arenaPages += ARENA_PAGES;
+	_arenaCur = (char*)arena;
+	_arenaEnd = _arenaCur + (ARENA_PAGES << PAGE_SHIFT);
+}
+
+// 线程第一次用到时按轮询分配一个分片, 这样不同线程大多落在不同的分片上, 分片锁基本没有竞争
+PageCache::LargeSpanShard& PageCache::GetLargeSpanShard()
+{
+	static std::atomic<size_t> nextShard{ 0 };
+	static thread_local size_t shard = nextShard++ % LARGE_CACHE_SHARDS;
+	return _largeSpanShards[shard];
+}
+
+Span* PageCache::FetchLargeSpan(size_t k)
+{
+	if (k < LARGE_CACHE_MIN_PAGES || k > LARGE_CACHE_MAX_PAGES)
+		return nullptr;
+
+	LargeSpanShard& shard = GetLargeSpanShard();
+	size_t index = k - LARGE_CACHE_MIN_PAGES;
+
+	std::unique_lock<std::mutex> lock(shard._mtx);
+	if (shard._num[index] == 0)
+		return nullptr;
+
+	shard._pages.Sub(k);
+	return shard._spans[index][--shard._num[index]];
+}
+
+bool PageCache::CacheLargeSpan(Span* span)
+{
+	size_t k = span->_n;
+	if (k < LARGE_CACHE_MIN_PAGES || k > LARGE_CACHE_MAX_PAGES)
+		return false;
+
+	LargeSpanShard& shard = GetLargeSpanShard();
+	size_t index = k - LARGE_CACHE_MIN_PAGES;
+	unsigned long long now = NowMs();
+
+	std::unique_lock<std::mutex> lock(shard._mtx);
+	if (shard._num[index] == LARGE_CACHE_SLOTS || shard._pages.Get() + k > LARGE_CACHE_SHARD_PAGES)
+		return false;
+
+	// 缓存里的span对page cache来说仍然是"在使用"的, 相邻span回收时不会把它合并掉
+	assert(span->_isUse);
+	span->_freeTime = now;
+	if (now < shard._oldestFreeTime.load(std::memory_order_relaxed))
+		shard._oldestFreeTime.store(now, std::memory_order_relaxed);
+	shard._pages.Add(k);
+	shard._spans[index][shard._num[index]++] = span;
+	return true;
+}
+
+size_t PageCache::TakeShardSpans(LargeSpanShard& shard, unsigned long long freeBefore, Span** out)
+{
+	size_t n = 0;
+	unsigned long long oldest = NO_FREE_TIME;
+	for (size_t j = 0; j < LARGE_CACHE_BUCKETS; ++j)
+	{
+		// 留下的span按原来的顺序往前挪
+		size_t kept = 0;
+		for (size_t s = 0; s < shard._num[j]; ++s)
+		{
+			Span* span = shard._spans[j][s];
+			if (span->_freeTime <= freeBefore)
+			{
+				shard._pages.Sub(span->_n);
+				out[n++] = span;
+			}
+			else
+			{
+				if (span->_freeTime < oldest)
+					oldest = span->_freeTime;
+				shard._spans[j][kept++] = span;
+			}
+		}
+		shard._num[j] = kept;
+	}
+	shard._oldestFreeTime.store(oldest, std::memory_order_relaxed);
+	return n;
+}
+
+// 平时都是放掉分片锁以后才拿 _pageMtx, 这里拿着 _pageMtx 反过来拿分片锁, 所以只能 try_lock, 拿不到就等下一次
+// 摘下来的span放掉分片锁以后再还给 page cache: 还的时候又会走到这里
+void PageCache::TrimLargeSpanShards()
+{
+	unsigned long long now = 0;
+	for (size_t i = 0; i < LARGE_CACHE_SHARDS; ++i)
+	{
+		LargeSpanShard& shard = _largeSpanShards[i];
+		unsigned long long oldest = shard._oldestFreeTime.load(std::memory_order_relaxed);
+		if (oldest == NO_FREE_TIME)
+			continue;
+		if (now == 0)
+			now = NowMs();
+		if (oldest + _largeSpanDecayMs > now)
+			continue;
+
+		Span* expired[LARGE_CACHE_SHARD_SPANS];
+		size_t n = 0;
+		{
+			std::unique_lock<std::mutex> lock(shard._mtx, std::try_to_lock);
+			if (!lock.owns_lock())
+				continue;
+			n = TakeShardSpans(shard, now - _largeSpanDecayMs, expired);
+		}
+
+		for (size_t j = 0; j < n; ++j)
+		{
+			ReleaseSpanToPageCache(expired[j]);
+		}
+	}
+}
+
+void PageCache::FlushLargeSpanCache()
+{
+	for (size_t i = 0; i < LARGE_CACHE_SHARDS; ++i)
+	{
+		LargeSpanShard& shard = _largeSpanShards[i];
+
+		// 先摘下来再拿 _pageMtx, 不同时拿着两把锁
+		Span* spans[LARGE_CACHE_SHARD_SPANS];
+		size_t n = 0;
+		{
+			std::unique_lock<std::mutex> lock(shard._mtx);
+			if (shard._pages.Get() == 0)
+				continue;
+			n = TakeShardSpans(shard, NO_FREE_TIME, spans);
+		}
+
+		std::unique_lock<InstrumentedMutex> pageLock(_pageMtx);
+		for (size_t j = 0; j < n; ++j)
+		{
+			ReleaseSpanToPageCache(spans[j]);
+		}
+	}
+}
+
+size_t PageCache::LargeSpanShardPages()
+{
+	size_t pages = 0;
+	for (size_t i = 0; i < LARGE_CACHE_SHARDS; ++i)
+	{
+		pages += _largeSpanShards[i]._pages.Get();
+	}
+	return pages;
+}
+
+void PageCache::LockForFork()
+{
+	for (size_t i = 0; i < LARGE_CACHE_SHARDS; ++i)
+	{
+		_largeSpanShards[i]._mtx.lock();
+	}
+	_pageMtx.lock();
+}
+
+void PageCache::UnlockAfterFork()
+{
+	_pageMtx.unlock();
+	for (size_t i = 0; i < LARGE_CACHE_SHARDS; ++i)
+	{
+		_largeSpanShards[i]._mtx.unlock();
+	}
+}
+
+void PageCache::CollectStats(AllocatorStats& stats)
+{
+	PageHeapStats& heap = stats._pageHeap;
+	size_t mapped = _mappedPages.Get();
+	size_t free = _freePages.Get();
+	size_t returned = _returnedPages.Get();
+
+	heap._mappedBytes = mapped << PAGE_SHIFT;
+	heap._freeBytes = free << PAGE_SHIFT;
+	heap._unmappedBytes = returned << PAGE_SHIFT;
+	// 几个计数器不是同一时刻读的, 正好有span在切分/合并时可能对不上, 不要减出负数
+	heap._usedBytes = mapped > free + returned ? (mapped - free - returned) << PAGE_SHIFT : 0;
+	heap._largeSpanCacheBytes = _largeSpanPages.Get() << PAGE_SHIFT;
+	heap._hugePageArenaBytes = _arenaPages << PAGE_SHIFT;
+
+	heap._largeObjectCacheBytes = LargeSpanShardPages() << PAGE_SHIFT;
+	heap._systemAllocs = _systemAllocs.Get();
+	heap._lock.Read(_pageLockStats);
+}
@@ -1,56 +1,287 @@
-#pragma once
+﻿#pragma once
 
 #include "Common.h"
 #include "ObjectPool.h"
 #include "PageMap.h"
 
-// 1. page cacheһҳΪλspan
-// 2. Ϊ˱֤ȫֻΨһpage cache౻Ƴ˵ģʽ
+struct AllocatorStats;
+
+#include <set>
+
+// 1. page cache是一个以页为单位的span自由链表
+// 2. 为了保证全局只有唯一的page cache，这个类被设计成了单例模式。
 class PageCache
 {
 public:
-	// 3. ̬ԱȫΨһȡʵ
+	// 3. 公共静态成员函数：全局唯一获取实例的入口
 	static PageCache* getInstance()
 	{
-		return &_sInst;
+		// 第一次调用时才构造(见 CentralCache.h 的说明)
+		static PageCache sInst;
+		return &sInst;
 	}
 
 public:
-	// ϵͳkҳspan(ڴ)ҵ
+	// 大页模式
+	enum HugePageMode
+	{
+		HUGEPAGE_NONE,		// 每次向系统要 128 页, 用普通的 4KB 页
+		HUGEPAGE_THP,		// 从按 2MB 对齐的 arena 里切, 交给内核用透明大页映射
+		HUGEPAGE_HUGETLB,	// 同上, 但 arena 用 hugetlbfs 预留的大页, 没有预留时退回透明大页
+	};
+
+	// 向系统申请k页span(内存)挂到自由链表
+	// 向系统要不到内存时返回 nullptr(不抛异常), 调用方放掉锁以后再把失败交给上层
 	Span* NewSpan(size_t k);
 
-	// ȡӶspanӳ
+	// 获取从对象到span的映射
 	Span* MapObjectToSpan(void* obj);
 
-	// ͷſspanصPagecacheϲڵspan
+	// 释放空闲span回到Pagecache，并合并相邻的span
 	void ReleaseSpanToPageCache(Span* span);
+
+	// 把所有空闲span的物理页都还给操作系统(保留虚拟地址), 返回归还的页数
+	size_t ReleaseFreeMemory();
+
+	// 设置自动归还的速度: 每向page cache释放 RELEASE_DELAY_PAGES / rate 页, 就归还一个空闲span
+	// rate 越大归还越积极, 0 表示不自动归还
+	void SetReleaseRate(double rate);
+
+	// 大对象(>256KB)快速路径: 从当前线程对应的分片缓存里拿一个k页的span, 没有就返回nullptr
+	// 只加分片自己的小锁, 不需要加 _pageMtx
+	Span* FetchLargeSpan(size_t k);
+
+	// 大对象释放快速路径: 把span放进当前线程对应的分片缓存
+	// 放不下返回false, 由调用者加 _pageMtx 走 ReleaseSpanToPageCache
+	bool CacheLargeSpan(Span* span);
+
+	// 把所有分片缓存里的span都还给page cache (内部会加 _pageMtx, 调用前不要持有它)
+	void FlushLargeSpanCache();
+
+	// 设置大页模式, 只影响之后新预留的 arena, 已经切出去的内存不变
+	// 默认值从环境变量 CMP_HUGEPAGE 读取: thp / hugetlb, 不设置就是 HUGEPAGE_NONE
+	void SetHugePageMode(HugePageMode mode);
+
+	HugePageMode GetHugePageMode()
+	{
+		return _hugePageMode;
+	}
+
+	// 超过128页的空闲span缓存: 最多缓存 pages 页, 放进来超过 decayMs 毫秒没被用到就还给系统(解除映射)
+	// pages 为0就是以前的行为, 释放了马上还给系统
+	// 大对象分片缓存里的span也按 decayMs 衰减: 放久了还给 page cache
+	void SetLargeSpanCache(size_t pages, unsigned long long decayMs);
+
+	// 缓存了多少页超过128页的空闲span
+	size_t LargeSpanCachePages()
+	{
+		return _largeSpanPages.Get();
+	}
+
+	// 大对象分片缓存里一共有多少页, 不加分片锁
+	size_t LargeSpanShardPages();
+
+	// 一共预留了多少页的大页 arena
+	size_t HugePageArenaPages()
+	{
+		return _arenaPages;
+	}
+
+	// arena 里整个空闲(没有页在使用)的大页个数
+	size_t EmptyHugePages();
+
+	// 把映射、空闲、已归还的字节数等填进统计, 只读计数器, 不加 _pageMtx
+	void CollectStats(AllocatorStats& stats);
+
+	// fork 前后拿住/放开分片缓存的锁和 _pageMtx(见 AtFork.h)
+	// 拿着 _pageMtx 时对分片锁只 try_lock(见 TrimLargeSpanShards), 所以先拿分片锁再拿 _pageMtx 不会死锁
+	void LockForFork();
+	void UnlockAfterFork();
 private:
-	SpanList _spanLists[NPAGES];	// ҳӳ
+	// 大对象span分片缓存的参数
+	static const size_t LARGE_CACHE_SHARDS = 8;	// 分片数, 线程按轮询分到不同分片上
+	static const size_t LARGE_CACHE_MIN_PAGES = (MAX_BYTES >> PAGE_SHIFT) + 1;	// 33页, 大于256KB
+	static const size_t LARGE_CACHE_MAX_PAGES = 2 * (NPAGES - 1);	// 256页, 2MB
+	static const size_t LARGE_CACHE_SLOTS = 4;	// 每个分片每种页数最多缓存几个span
+	static const size_t LARGE_CACHE_SHARD_PAGES = 512;	// 每个分片最多缓存多少页(4MB)
+	static const size_t LARGE_CACHE_BUCKETS = LARGE_CACHE_MAX_PAGES - LARGE_CACHE_MIN_PAGES + 1;
+	static const size_t LARGE_CACHE_SHARD_SPANS = LARGE_CACHE_SHARD_PAGES / LARGE_CACHE_MIN_PAGES;	// 每个分片最多缓存几个span
+	static const unsigned long long NO_FREE_TIME = ~0ull;
 
-	// ڴĵַ, ôͿԼǰڴڵҳ
-	// һmapˡҳ -- Span֮ӳ
-	// ôҾͿͨҳţҵSpanָ
-	// ȻͿ԰ڴҵӦspanȥ
-	//std::unordered_map<PAGE_ID, Span*> _idSpanMap;	// ҳ -- Span֮ӳ
+	// 一个分片: 按页数分桶, 每个桶是一个很小的栈
+	// 所有分片加起来最多缓存 LARGE_CACHE_SHARDS * LARGE_CACHE_SHARD_PAGES 页(32MB),
+	// 放进来超过 _largeSpanDecayMs 没被拿走的, 下一次有span还给 page cache 时(小对象的也算)还回去, 见 TrimLargeSpanShards
+	struct LargeSpanShard
+	{
+		std::mutex _mtx;
+		StatCounter _pages;	// 这个分片里缓存的总页数
+		// 缓存里最早放进来的span的时间, 拿走span时不更新, 所以可能比实际的早; 不加锁读, 没有过期的就不用去抢分片锁
+		std::atomic<unsigned long long> _oldestFreeTime{ NO_FREE_TIME };
+		size_t _num[LARGE_CACHE_BUCKETS] = { 0 };
+		Span* _spans[LARGE_CACHE_BUCKETS][LARGE_CACHE_SLOTS] = { { nullptr } };
+	};
+
+	// 当前线程对应的分片
+	LargeSpanShard& GetLargeSpanShard();
 
-	//std::unordered_map<PAGE_ID, size_t> _idSizeMap;	// ҳ -- size֮ӳ 
+	// 把分片里 _freeTime 不晚于 freeBefore 的span都摘下来放进 out, 返回个数; 调用方持有分片锁
+	static size_t TakeShardSpans(LargeSpanShard& shard, unsigned long long freeBefore, Span** out);
 
-	// ʹtcmallocԴʵֻŻ
-	TCMalloc_PageMap1<32 - PAGE_SHIFT> _idSpanMap;
+	// 分片缓存里放得比衰减时间还久的span还给 page cache, 调用方持有 _pageMtx
+	void TrimLargeSpanShards();
+
+	LargeSpanShard _largeSpanShards[LARGE_CACHE_SHARDS];
 
-	// ʹöڴʹnew
-	ObjectPool<Span> _spanPool;
 private:
-	// 1. ˽й캯ֹⲿͨ new/ջʵ
-	PageCache()
-	{}
+	// 根据span是否已归还, 找到它应该挂的桶
+	SpanList& GetSpanList(Span* span)
+	{
+		return span->_isReturned ? _returnedSpanLists[span->_n] : _spanLists[span->_n];
+	}
+
+	// 空闲span挂到桶里 / 从桶里摘下来, 同时维护桶不空的位图
+	void PushSpan(Span* span);
+	void EraseSpan(Span* span);
+
+	// 从桶里取span时, 链表头上最多看这么多个, 挑地址最低的
+	static const size_t LOWEST_SPAN_CANDIDATES = 8;
+
+	// 第一个 >= k 的不空的桶, 没有就返回 NPAGES
+	static size_t FindNonEmptyBucket(const uint64_t* bits, size_t k);
 
-	// 2. ֹ͸ֵ⸴Ƴʵ
-	PageCache(const PageCache&) = delete;				// ÿ
-	PageCache operator=(const PageCache&) = delete;	// øֵ
+	// 在超过128页的空闲span里找一个够k页的, 没有返回nullptr
+	Span* FindLargeSpan(size_t k);
+
+	// 超过128页的空闲span放进缓存 / 从缓存里拿出来
+	void InsertLargeSpan(Span* span, unsigned long long freeTime);
+	void EraseLargeSpan(Span* span);
+
+	// 按上限和衰减时间把缓存的大span还给系统
+	void TrimLargeSpans();
+	void UnmapLargeSpan(Span* span);
+
+	// 合并相邻的同状态(驻留/已归还)的空闲span, 然后挂到对应的桶里
+	void InsertFreeSpan(Span* span);
+
+	// 把一个驻留的空闲span的物理页还给操作系统
+	size_t ReleaseSpan(Span* span);
+
+	// 按释放回来的页数推进计数器, 到了就归还一个空闲span
+	void IncrementalScavenge(size_t n);
+
+	// 向系统要一块 128 页的内存, 要不到时返回 nullptr
+	// 打开大页模式时从 arena 里按地址顺序切, 前一个大页切满了才会用到下一个大页
+	void* SystemAllocChunk();
+	void NewHugePageArena();
+
+	// 从一个已经摘下来的空闲span头部切k页出来返回, 剩下的挂回去(要不到 Span 对象时返回 nullptr)
+	Span* CarveSpan(Span* nSpan, size_t k);
+
+	// 大页感知的分配: 在页数够的空闲span里挑所在大页最满的那个
+	Span* FindSpanInFullestHugePage(size_t k);
+
+	// arena 里每个大页(2MB)的使用情况
+	struct HugePage
+	{
+		PAGE_ID _pageId = 0;	// 大页的第一页
+		size_t _used = 0;	// 切出去还在使用的页数, 为0说明整个大页都是空闲span
+		bool _resident = false;	// 空闲页里可能还有驻留的物理页(整个归还以后为false)
+		HugePage* _next = nullptr;
+	};
+
+	// 页所在的大页, 不在 arena 里返回nullptr
+	HugePage* GetHugePage(PAGE_ID id)
+	{
+		if (_arenaPages == 0)
+			return nullptr;
+		return (HugePage*)_hugePageMap.get(id >> (HUGEPAGE_SHIFT - PAGE_SHIFT));
+	}
+
+	// 把一个整个空闲的大页还给操作系统
+	size_t ReleaseHugePage(HugePage* hp);
+
+	// 找一个整个空闲的大页还给操作系统
+	size_t ReleaseEmptyHugePage();
+
+	// 每个桶最多看几个span, 一共最多看几个
+	static const size_t FILLER_BUCKET_CANDIDATES = 4;
+	static const size_t FILLER_CANDIDATES = 16;
+
+	// 一次预留 16 个大页(32MB)的虚拟地址, 物理内存在访问时才分配
+	static const size_t ARENA_PAGES = 16 * HUGEPAGE_PAGES;
+	HugePageMode _hugePageMode = HUGEPAGE_NONE;
+	char* _arenaCur = nullptr;	// arena 里还没切出去的部分
+	char* _arenaEnd = nullptr;
+	size_t _arenaPages = 0;
+
+	HugePageMap _hugePageMap;	// 大页号 -> HugePage
+	HugePage* _hugePages = nullptr;	// 所有大页串成的链表
+	ObjectPool<HugePage> _hugePagePool;
+
+private:
+	SpanList _spanLists[NPAGES];	// 按页数映射, 物理页还驻留在内存里的空闲span
+	SpanList _returnedSpanLists[NPAGES];	// 按页数映射, 物理页已经还给操作系统的空闲span
+
+	// 哪些桶不空: 第i位为1说明第i个桶里有span, 找 >= k 的第一个不空的桶只要找第一个为1的位
+	static const size_t BUCKET_BITMAP_WORDS = (NPAGES + 63) / 64;
+	uint64_t _spanBits[BUCKET_BITMAP_WORDS] = { 0 };
+	uint64_t _returnedSpanBits[BUCKET_BITMAP_WORDS] = { 0 };
+
+	// 超过128页的空闲span, 按 (页数, 页号) 排序, lower_bound 就是够用的里面最小、地址最低的那个
+	struct SpanBestFitLess
+	{
+		bool operator()(const Span* a, const Span* b) const
+		{
+			return a->_n != b->_n ? a->_n < b->_n : a->_pageId < b->_pageId;
+		}
+	};
+	typedef std::set<Span*, SpanBestFitLess, ObjectPoolAllocator<Span*> > SpanSet;
+	SpanSet _largeSpans;	// 物理页还驻留的
+	SpanSet _returnedLargeSpans;	// 物理页已经还给操作系统的
+	SpanList _largeSpanLru;	// 上面两个集合里的span, 按放进来的时间从新到旧串起来
+	StatCounter _largeSpanPages;	// 缓存的总页数
+
+	// 默认最多缓存 32MB, 1秒没被复用就还给系统
+	// 过期的只有在 page cache 再有申请释放时才会还, 空闲下来的进程最多还挂着这么多, 所以上限不能太大
+	size_t _largeSpanLimit = (32 << 20) >> PAGE_SHIFT;
+	unsigned long long _largeSpanDecayMs = 1000;
+
+	// 默认每释放回来这么多页(8MB), 就归还一个空闲span给操作系统
+	static const size_t RELEASE_DELAY_PAGES = 1024;
+	double _releaseRate = 1.0;
+
+	// 统计用的计数器, 都在 _pageMtx 里修改
+	StatCounter _mappedPages;	// 向系统映射的页数(大页 arena 按切出去的算)
+	StatCounter _freePages;		// 空闲、物理页还驻留的页数(桶里的和超过128页的)
+	StatCounter _returnedPages;	// 空闲、物理页已经还给系统的页数
+	StatCounter _systemAllocs;	// 向系统申请内存(mmap / VirtualAlloc)的次数
+	LockStats _pageLockStats;	// _pageMtx 的竞争情况
+	double _scavengeCounter = RELEASE_DELAY_PAGES;	// 还要再释放多少页, 才归还下一个span
+	size_t _scavengeIndex = 1;	// 轮流从各个桶里挑span归还
+
+	// 我有内存块的地址, 那么就可以计算出当前内存块所在的页号
+	// 并且现在有一个map存了【页号 -- Span】之间的映射
+	// 那么我就可以通过页号，找到这个Span指针
+	// 然后就可以把内存块挂到对应的span里面去了
+	//std::unordered_map<PAGE_ID, Span*> _idSpanMap;	// 建立【页号 -- Span】之间的映射
+
+	//std::unordered_map<PAGE_ID, size_t> _idSizeMap;	// 建立【页号 -- size】之间的映射 
+
+	// 使用tcmalloc源码中实现基数树进行优化
+	//TCMalloc_PageMap1<32 - PAGE_SHIFT> _idSpanMap;
+	// 32位用一层基数树, 64位用三层基数树(见PageMap.h), 否则64位下4G以上的地址查不到span
+	PageMap _idSpanMap;
+
+	// 使用定长内存池配合脱离使用new
+	LockFreeObjectPool<Span> _spanPool;
+private:
+	// 1. 私有构造函数：禁止外部通过 new/栈实例创建
+	PageCache();
 
-	static PageCache _sInst;		// (ģʽ)
+	// 2. 禁止拷贝构造和赋值运算符（避免复制出多个实例）
+	PageCache(const PageCache&) = delete;				// 禁用拷贝构造
+	PageCache operator=(const PageCache&) = delete;	// 禁用赋值
 
 public:
-	std::mutex _pageMtx;			// , Ϊе
+	InstrumentedMutex _pageMtx;			// 加锁, 定义为公有的
 };
\ No newline at end of file
@@ -1,4 +1,6 @@
-#pragma once
+﻿#pragma once
+
+#include <type_traits>
 
 #include "Common.h"
 
@@ -37,6 +39,16 @@ public:
 	void set(Number k, void* v) {
 		array_[k] = v;
 	}
+
+	// Ensure that the map contains initialized entries "x .. x+n-1".
+	// Returns true if successful, false if we could not allocate memory.
+	bool Ensure(Number x, size_t n) {
+		// Nothing to do since flat array was allocated at start.  All
+		// that's left is to check for overflow (that is, we don't want to
+		// ensure a number y where array_[y] would be an out-of-bounds
+		// access).
+		return n <= LENGTH - x;   // an overflow-free way to do "x + n <= LENGTH"
+	}
 };
 
 // Two-level radix tree
@@ -81,7 +93,7 @@ public:
 	void set(Number k, void* v) {
 		const Number i1 = k >> LEAF_BITS;
 		const Number i2 = k & (LEAF_LENGTH - 1);
-		ASSERT(i1 < ROOT_LENGTH);
+		assert(i1 < ROOT_LENGTH);
 		root_[i1]->values[i2] = v;
 	}
 
@@ -99,6 +111,7 @@ public:
 				//if (leaf == NULL) return false;
 				static ObjectPool<Leaf>	leafPool;
 				Leaf* leaf = (Leaf*)leafPool.New();
+				if (leaf == NULL) return false;
 
 				memset(leaf, 0, sizeof(*leaf));
 				root_[i1] = leaf;
@@ -139,10 +152,22 @@ private:
 	};
 
 	Node* root_;                          // Root of radix tree
-	void* (*allocator_)(size_t);          // Memory allocator
 
+	// 结点和叶子都按需从定长内存池里申请, 不再依赖外部传入的allocator_
+	// 只有真正用到的地址区间才会建出对应的结点, 48位地址空间也只占很少的内存
 	Node* NewNode() {
-		Node* result = reinterpret_cast<Node*>((*allocator_)(sizeof(Node)));
+		//Node* result = reinterpret_cast<Node*>((*allocator_)(sizeof(Node)));
+		static ObjectPool<Node> nodePool;
+		Node* result = nodePool.New();
+		if (result != NULL) {
+			memset(result, 0, sizeof(*result));
+		}
+		return result;
+	}
+
+	Leaf* NewLeaf() {
+		static ObjectPool<Leaf> leafPool;
+		Leaf* result = leafPool.New();
 		if (result != NULL) {
 			memset(result, 0, sizeof(*result));
 		}
@@ -152,8 +177,9 @@ private:
 public:
 	typedef uintptr_t Number;
 
-	explicit TCMalloc_PageMap3(void* (*allocator)(size_t)) {
-		allocator_ = allocator;
+	//explicit TCMalloc_PageMap3(void* (*allocator)(size_t)) {
+	explicit TCMalloc_PageMap3() {
+		//allocator_ = allocator;
 		root_ = NewNode();
 	}
 
@@ -169,7 +195,7 @@ public:
 	}
 
 	void set(Number k, void* v) {
-		ASSERT(k >> BITS == 0);
+		assert(k >> BITS == 0);
 		const Number i1 = k >> (LEAF_BITS + INTERIOR_BITS);
 		const Number i2 = (k >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
 		const Number i3 = k & (LEAF_LENGTH - 1);
@@ -194,9 +220,9 @@ public:
 
 			// Make leaf node if necessary
 			if (root_->ptrs[i1]->ptrs[i2] == NULL) {
-				Leaf* leaf = reinterpret_cast<Leaf*>((*allocator_)(sizeof(Leaf)));
+				//Leaf* leaf = reinterpret_cast<Leaf*>((*allocator_)(sizeof(Leaf)));
+				Leaf* leaf = NewLeaf();
 				if (leaf == NULL) return false;
-				memset(leaf, 0, sizeof(*leaf));
 				root_->ptrs[i1]->ptrs[i2] = reinterpret_cast<Node*>(leaf);
 			}
 
@@ -209,3 +235,15 @@ public:
 	void PreallocateMoreMemory() {
 	}
 };
+
+// 按指针宽度自动选择基数树:
+// 32位: 一层基数树, 2^19项, 构造时一次性开好(2MB)
+// 64位: 三层基数树, 覆盖48位虚拟地址空间(x86-64/aarch64用户态地址都在这个范围内), 结点按需创建
+typedef std::conditional<sizeof(void*) == 4,
+	TCMalloc_PageMap1<32 - PAGE_SHIFT>,
+	TCMalloc_PageMap3<48 - PAGE_SHIFT> >::type PageMap;
+
+// 大页号(地址 >> 21) -> 大页使用情况的映射, 和 PageMap 一样按指针宽度选择
+typedef std::conditional<sizeof(void*) == 4,
+	TCMalloc_PageMap1<32 - HUGEPAGE_SHIFT>,
+	TCMalloc_PageMap3<48 - HUGEPAGE_SHIFT> >::type HugePageMap;
@@ -0,0 +1,205 @@
+﻿#define _CRT_SECURE_NO_WARNINGS 1
+
+#include "Common.h"
+
+#ifdef _WIN32
+	#include <cstdio>
+#else
+	#include <fcntl.h>
+	#include <cstdlib>
+#endif
+
+bool SizeClassTable::Build(const ClassInfo* classes, size_t n)
+{
+	if (n == 0 || n > NFREELISTS || classes[n - 1]._size != MAX_BYTES)
+		return false;
+
+	for (size_t i = 0; i < n; ++i)
+	{
+		const ClassInfo& info = classes[i];
+		if (info._size == 0 || (i > 0 && info._size <= classes[i - 1]._size))
+			return false;
+
+		// 同一格字节数组里的 size 必须落在同一个桶, 所以大小类要对齐到一格的大小
+		if (info._size % 8 != 0 || (info._size > 1024 && info._size % 128 != 0))
+			return false;
+
+		if (info._pages == 0 || info._pages > NPAGES - 1
+			|| ((size_t)info._pages << PAGE_SHIFT) < info._size)
+			return false;
+
+		if (info._numToMove == 0)
+			return false;
+	}
+
+	// 检查完了才改表, 失败时表保持不变
+	for (size_t i = 0; i < NFREELISTS; ++i)
+	{
+		_info[i] = i < n ? classes[i] : ClassInfo();
+	}
+
+	// 每一格对应第一个放得下这一格里最大 size 的大小类
+	size_t index = 0;
+	for (size_t i = 0; i < CLASS_ARRAY_SIZE; ++i)
+	{
+		while (classes[index]._size < MaxSizeOfSlot(i))
+			++index;
+		_classArray[i] = (uint8_t)index;
+	}
+	_numClasses = n;
+
+	return true;
+}
+
+// 读一个无符号整数, 跳过前面的空格和制表符
+static bool ParseNumber(const char*& cur, const char* end, size_t& value)
+{
+	while (cur < end && (*cur == ' ' || *cur == '\t'))
+		++cur;
+	if (cur == end || *cur < '0' || *cur > '9')
+		return false;
+
+	value = 0;
+	while (cur < end && *cur >= '0' && *cur <= '9')
+	{
+		value = value * 10 + (*cur - '0');
+		if (value > UINT32_MAX)
+			return false;
+		++cur;
+	}
+	return true;
+}
+
+bool SizeClassTable::Parse(const char* text, size_t len)
+{
+	ClassInfo classes[NFREELISTS];
+	size_t n = 0;
+
+	const char* cur = text;
+	const char* end = text + len;
+	while (cur < end)
+	{
+		const char* lineEnd = cur;
+		while (lineEnd < end && *lineEnd != '\n')
+			++lineEnd;
+
+		// 跳过行首空白, 空行和注释行不管
+		while (cur < lineEnd && (*cur == ' ' || *cur == '\t' || *cur == '\r'))
+			++cur;
+		if (cur < lineEnd && *cur != '#')
+		{
+			size_t size = 0, pages = 0, batch = 0;
+			if (!ParseNumber(cur, lineEnd, size) || !ParseNumber(cur, lineEnd, pages)
+				|| !ParseNumber(cur, lineEnd, batch))
+				return false;
+			if (n == NFREELISTS || pages > UINT16_MAX || batch > UINT16_MAX)
+				return false;
+
+			classes[n]._size = (uint32_t)size;
+			classes[n]._pages = (uint16_t)pages;
+			classes[n]._numToMove = (uint16_t)batch;
+			++n;
+		}
+
+		cur = lineEnd + 1;
+	}
+
+	return Build(classes, n);
+}
+
+// 大小类只能在第一次申请内存之前换, InitTable 以后就定下来了
+static std::mutex sizeClassMtx;
+static std::atomic<bool> sizeClassFrozen{ false };
+
+// 大小类文件最多这么大(208 行, 每行十几个字符, 再加上注释)
+static const size_t MAX_TABLE_FILE = 64 * 1024;
+
+// 把文件读进 buf, 返回读到的字节数, 失败返回 -1
+// 注意: 替换了 malloc 以后这里是在 malloc 里面被调用的, 所以 linux 下不能用 fopen(它会调 malloc)
+static long ReadTableFile(const char* path, char* buf, size_t cap)
+{
+#ifdef _WIN32
+	FILE* fp = fopen(path, "rb");
+	if (fp == nullptr)
+		return -1;
+	size_t n = fread(buf, 1, cap, fp);
+	bool tooLarge = (n == cap && fgetc(fp) != EOF);
+	fclose(fp);
+	return tooLarge ? -1 : (long)n;
+#else
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	size_t n = 0;
+	while (n < cap)
+	{
+		ssize_t ret = read(fd, buf + n, cap - n);
+		if (ret < 0)
+		{
+			close(fd);
+			return -1;
+		}
+		if (ret == 0)
+			break;
+		n += ret;
+	}
+	char extra;
+	bool tooLarge = (n == cap && read(fd, &extra, 1) > 0);
+	close(fd);
+	return tooLarge ? -1 : (long)n;
+#endif
+}
+
+// 调用方持有 sizeClassMtx
+static bool LoadTableLocked(const char* path)
+{
+	// 静态的缓冲区和临时表, 加载只会发生一次, 不占线程栈
+	static char buf[MAX_TABLE_FILE];
+	static SizeClassTable table;
+
+	long len = ReadTableFile(path, buf, sizeof(buf));
+	if (len < 0 || !table.Parse(buf, (size_t)len))
+		return false;
+
+	sizeClassTable = table;
+	return true;
+}
+
+bool SizeClass::LoadTable(const char* path)
+{
+	std::unique_lock<std::mutex> lock(sizeClassMtx);
+	if (sizeClassFrozen.load(std::memory_order_relaxed))
+		return false;
+
+	bool ok = LoadTableLocked(path);
+	if (ok)
+		sizeClassFrozen.store(true, std::memory_order_release);
+	return ok;
+}
+
+void SizeClass::InitTable()
+{
+	if (sizeClassFrozen.load(std::memory_order_acquire))
+		return;
+
+	std::unique_lock<std::mutex> lock(sizeClassMtx);
+	if (sizeClassFrozen.load(std::memory_order_relaxed))
+		return;
+
+	// 文件不存在或者格式不对时继续用默认的大小类
+	const char* path = getenv("CMP_SIZE_CLASSES");
+	if (path != nullptr && path[0] != '\0')
+		LoadTableLocked(path);
+
+	sizeClassFrozen.store(true, std::memory_order_release);
+}
+
+void SizeClass::LockForFork()
+{
+	sizeClassMtx.lock();
+}
+
+void SizeClass::UnlockAfterFork()
+{
+	sizeClassMtx.unlock();
+}
@@ -0,0 +1,243 @@
+﻿#define _CRT_SECURE_NO_WARNINGS 1
+
+// 大小类生成工具: 按实际的申请大小分布生成一套内碎片最小的大小类
+//
+// 用法: SizeClassGen <直方图文件> [输出文件] [--classes N] [--align 8|16]
+//   直方图文件每行 "size count"(# 开头的是注释), 比如从线上采样得到的申请大小分布
+//   输出文件每行 "size pages batch", 用 CMP_SIZE_CLASSES=输出文件 或 SizeClass::LoadTable 加载
+//   --classes  最多生成多少个大小类(默认也是最大 NFREELISTS)
+//   --align    <= 1024 字节的大小类按几字节对齐(默认 8); 给 libcmpool.so 用时要选 16,
+//              malloc 要保证返回 16 字节对齐的地址
+//
+// 做法: 候选的大小类是 <= 1024 的 align 的倍数和 > 1024 的 128 的倍数(查表的一格), 最后一个必须是 MAX_BYTES;
+// 用动态规划在候选里选出最多 N 个, 让 sum(count * (大小类 - size)) 最小.
+// 为了不让直方图里没出现的大小浪费太多, 相邻两个大小类之间的间隔不超过 max(align, 前一个的 1/8),
+// 这样任何大小的内碎片都和默认的大小类一样在 12.5% 左右以内
+
+#include "Common.h"
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <map>
+#include <limits>
+
+// 直方图: size -> count, 只保留 [1, MAX_BYTES] 之间的
+static bool ReadHistogram(const char* path, std::map<size_t, double>& hist)
+{
+	std::ifstream in(path);
+	if (!in)
+		return false;
+
+	std::string line;
+	while (std::getline(in, line))
+	{
+		size_t pos = line.find_first_not_of(" \t\r");
+		if (pos == std::string::npos || line[pos] == '#')
+			continue;
+
+		std::istringstream ss(line);
+		size_t size = 0;
+		double count = 0;
+		if (!(ss >> size >> count))
+			return false;
+		if (size >= 1 && size <= MAX_BYTES && count > 0)
+			hist[size] += count;
+	}
+	return true;
+}
+
+// 按直方图加权的内碎片(字节)
+static double Waste(const std::map<size_t, double>& hist, const std::vector<size_t>& classes)
+{
+	double waste = 0;
+	size_t c = 0;
+	for (auto& kv : hist)
+	{
+		while (classes[c] < kv.first)
+			++c;
+		waste += kv.second * (classes[c] - kv.first);
+	}
+	return waste;
+}
+
+// 两个相邻大小类之间允许的最大间隔
+static size_t MaxGap(size_t prev, size_t align)
+{
+	return std::max(align, prev / 8);
+}
+
+static std::vector<size_t> Generate(const std::map<size_t, double>& hist, size_t maxClasses, size_t align)
+{
+	// 候选的大小类, cand[0] = 0 是虚拟的起点
+	std::vector<size_t> cand(1, 0);
+	for (size_t s = align; s <= 1024; s += align)
+		cand.push_back(s);
+	for (size_t s = 1024 + 128; s <= MAX_BYTES; s += 128)
+		cand.push_back(s);
+	const size_t n = cand.size();
+
+	// 前缀和: cnt[j] / sum[j] 是 size <= cand[j] 的申请个数和字节数
+	std::vector<double> cnt(n, 0), sum(n, 0);
+	auto it = hist.begin();
+	for (size_t j = 1; j < n; ++j)
+	{
+		cnt[j] = cnt[j - 1];
+		sum[j] = sum[j - 1];
+		for (; it != hist.end() && it->first <= cand[j]; ++it)
+		{
+			cnt[j] += it->second;
+			sum[j] += it->second * it->first;
+		}
+	}
+
+	// dp[k][j]: 用 k 个大小类覆盖 (0, cand[j]] 并且最后一个是 cand[j] 时的最小内碎片
+	const double INF = std::numeric_limits<double>::infinity();
+	std::vector<std::vector<double>> dp(maxClasses + 1, std::vector<double>(n, INF));
+	std::vector<std::vector<uint16_t>> from(maxClasses + 1, std::vector<uint16_t>(n, 0));
+	dp[0][0] = 0;
+	for (size_t k = 1; k <= maxClasses; ++k)
+	{
+		for (size_t j = 1; j < n; ++j)
+		{
+			for (size_t i = j; i-- > 0;)
+			{
+				if (cand[j] > cand[i] + MaxGap(cand[i], align))
+					break;
+				if (dp[k - 1][i] == INF)
+					continue;
+
+				// (cand[i], cand[j]] 之间的申请都用 cand[j] 这个大小类
+				double cost = dp[k - 1][i] + cand[j] * (cnt[j] - cnt[i]) - (sum[j] - sum[i]);
+				if (cost < dp[k][j])
+				{
+					dp[k][j] = cost;
+					from[k][j] = (uint16_t)i;
+				}
+			}
+		}
+	}
+
+	// 内碎片一样时用更少的大小类
+	size_t bestK = 0;
+	for (size_t k = 1; k <= maxClasses; ++k)
+	{
+		if (dp[k][n - 1] < INF && (bestK == 0 || dp[k][n - 1] < dp[bestK][n - 1]))
+			bestK = k;
+	}
+
+	std::vector<size_t> classes;
+	if (bestK == 0)
+		return classes;
+	for (size_t k = bestK, j = n - 1; k > 0; j = from[k][j], --k)
+	{
+		classes.push_back(cand[j]);
+	}
+	std::reverse(classes.begin(), classes.end());
+	return classes;
+}
+
+// 一个 span 几页: 在默认规则的基础上加页, 直到切剩下的尾巴不超过 span 的 1/8
+static size_t PagesOf(size_t size)
+{
+	size_t pages = std::max(SizeClass::CalcNumMovePage(size), SizeClass::_RoundUp(size, 1 << PAGE_SHIFT) >> PAGE_SHIFT);
+	while (pages < NPAGES - 1 && ((pages << PAGE_SHIFT) % size) > ((pages << PAGE_SHIFT) / 8))
+		++pages;
+	return pages;
+}
+
+int main(int argc, char* argv[])
+{
+	const char* input = nullptr;
+	const char* output = nullptr;
+	size_t maxClasses = NFREELISTS;
+	size_t align = 8;
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (arg == "--classes" && i + 1 < argc)
+			maxClasses = std::min((size_t)std::stoul(argv[++i]), NFREELISTS);
+		else if (arg == "--align" && i + 1 < argc)
+			align = std::stoul(argv[++i]);
+		else if (input == nullptr)
+			input = argv[i];
+		else
+			output = argv[i];
+	}
+	if (input == nullptr || (align != 8 && align != 16))
+	{
+		cout << "usage: SizeClassGen <histogram> [output] [--classes N] [--align 8|16]" << endl;
+		return 1;
+	}
+
+	std::map<size_t, double> hist;
+	if (!ReadHistogram(input, hist))
+	{
+		cout << "cannot read histogram: " << input << endl;
+		return 1;
+	}
+
+	std::vector<size_t> classes = Generate(hist, maxClasses, align);
+	if (classes.empty())
+	{
+		cout << "--classes " << maxClasses << " is too few to cover 1 ~ " << MAX_BYTES << " bytes" << endl;
+		return 1;
+	}
+
+	std::vector<ClassInfo> infos;
+	for (size_t size : classes)
+	{
+		ClassInfo info;
+		info._size = (uint32_t)size;
+		info._pages = (uint16_t)PagesOf(size);
+		info._numToMove = (uint16_t)SizeClass::CalcNumMoveSize(size);
+		infos.push_back(info);
+	}
+
+	// 确认生成的大小类能被内存池加载
+	SizeClassTable table;
+	if (!table.Build(infos.data(), infos.size()))
+	{
+		cout << "generated size classes are invalid" << endl;
+		return 1;
+	}
+
+	std::vector<size_t> defaults;
+	for (size_t i = 0; i < NFREELISTS; ++i)
+	{
+		defaults.push_back(SizeClass::ClassSize(i));
+	}
+	double total = 0;
+	for (auto& kv : hist)
+	{
+		total += kv.second * kv.first;
+	}
+
+	std::ostringstream out;
+	out << "# generated by SizeClassGen from " << input << "\n";
+	out << "# " << classes.size() << " classes, internal fragmentation: default "
+		<< Waste(hist, defaults) << " bytes -> " << Waste(hist, classes) << " bytes"
+		<< " (requested " << total << " bytes)\n";
+	out << "# size pages batch\n";
+	for (auto& info : infos)
+	{
+		out << info._size << " " << info._pages << " " << info._numToMove << "\n";
+	}
+
+	if (output != nullptr)
+	{
+		std::ofstream file(output);
+		file << out.str();
+		if (!file)
+		{
+			cout << "cannot write " << output << endl;
+			return 1;
+		}
+		cout << out.str().substr(0, out.str().find("# size"));
+	}
+	else
+	{
+		cout << out.str();
+	}
+	return 0;
+}
@@ -0,0 +1,223 @@
+﻿#define _CRT_SECURE_NO_WARNINGS 1
+
+#include "Stats.h"
+
+#include <cstdio>
+#include <cstdarg>
+
+// 减出负数时取0: 各项计数器是分别读的, 彼此之间可能差几个对象
+static size_t SubOrZero(size_t a, size_t b)
+{
+	return a > b ? a - b : 0;
+}
+
+void LockStatsSnapshot::Read(const LockStats& stats)
+{
+	_acquisitions = stats._acquisitions.Get();
+	_contended = stats._contended.Get();
+	_waitNs = stats._waitNs.Get();
+	for (size_t i = 0; i < LockStats::HOLD_BUCKETS; ++i)
+	{
+		_holdHistogram[i] = stats._holdHistogram[i].Get();
+	}
+}
+
+void LockStatsSnapshot::Add(const LockStatsSnapshot& other)
+{
+	_acquisitions += other._acquisitions;
+	_contended += other._contended;
+	_waitNs += other._waitNs;
+	for (size_t i = 0; i < LockStats::HOLD_BUCKETS; ++i)
+	{
+		_holdHistogram[i] += other._holdHistogram[i];
+	}
+}
+
+void AllocatorStats::Finish()
+{
+	_numClasses = sizeClassTable._numClasses;
+	_frontCacheBytes = 0;
+	_transferCacheBytes = 0;
+	_centralFreeBytes = 0;
+	_smallInUseBytes = 0;
+	_spanTailBytes = 0;
+	_centralLock = LockStatsSnapshot();
+
+	size_t spanBytes = 0;
+	for (size_t i = 0; i < _numClasses; ++i)
+	{
+		SizeClassStats& cls = _classes[i];
+		cls._size = SizeClass::ClassSize(i);
+
+		// span 里能切的对象, 不在中心缓存、转运缓存和线程缓存里, 就在应用程序手里
+		size_t cached = cls._centralFreeObjects + cls._transferObjects + cls._frontObjects;
+		cls._inUseObjects = SubOrZero(cls._objects, cached);
+
+		_frontCacheBytes += cls._frontObjects * cls._size;
+		_transferCacheBytes += cls._transferObjects * cls._size;
+		_centralFreeBytes += cls._centralFreeObjects * cls._size;
+		_smallInUseBytes += cls._inUseObjects * cls._size;
+		_spanTailBytes += SubOrZero(cls._spanBytes, cls._objects * cls._size);
+		spanBytes += cls._spanBytes;
+		_centralLock.Add(cls._lock);
+	}
+
+	// page cache 分出去的内存, 除了中心缓存的span和大对象分片缓存, 剩下的就是正在用的大对象
+	_largeInUseBytes = SubOrZero(_pageHeap._usedBytes, spanBytes + _pageHeap._largeObjectCacheBytes);
+}
+
+// 往 string 后面追加一段格式化的文本
+static void Append(std::string& out, const char* fmt, ...)
+{
+	char buf[256];
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (n > 0)
+		out.append(buf, (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf) - 1);
+}
+
+// 一行: 字节数 + 换算成 MiB + 说明, 和 tcmalloc 的 MallocExtension::GetStats 差不多
+static void AppendBytesLine(std::string& out, const char* op, size_t bytes, const char* what)
+{
+	Append(out, "MALLOC: %s %15zu (%10.1f MiB) %s\n", op, bytes, bytes / 1048576.0, what);
+}
+
+// 一把(一组)锁的汇总
+static void AppendLockLine(std::string& out, const char* name, const LockStatsSnapshot& lock)
+{
+	Append(out, "%-20s acquisitions %12zu, contended %10zu (%5.1f%%), wait %10.3f ms\n",
+		name, lock._acquisitions, lock._contended,
+		lock._acquisitions == 0 ? 0.0 : 100.0 * lock._contended / lock._acquisitions,
+		lock._waitNs / 1e6);
+}
+
+// 持有时间直方图第 i 个桶的上界(ns), 最后一个桶没有上界
+static size_t HoldBucketLimit(size_t i)
+{
+	return (size_t)128 << i;
+}
+
+static void AppendJsonLock(std::string& out, const LockStatsSnapshot& lock)
+{
+	Append(out, "{\"acquisitions\": %zu, \"contended\": %zu, \"wait_ns\": %zu, \"hold_histogram\": [",
+		lock._acquisitions, lock._contended, lock._waitNs);
+	for (size_t i = 0; i < LockStats::HOLD_BUCKETS; ++i)
+	{
+		Append(out, "%s%zu", i == 0 ? "" : ", ", lock._holdHistogram[i]);
+	}
+	Append(out, "]}");
+}
+
+std::string AllocatorStats::ToText() const
+{
+	std::string out;
+	const size_t inUse = _smallInUseBytes + _largeInUseBytes;
+
+	Append(out, "------------------------------------------------\n");
+	AppendBytesLine(out, " ", inUse, "Bytes in use by application");
+	AppendBytesLine(out, "+", _frontCacheBytes, "Bytes in thread/cpu cache freelists");
+	AppendBytesLine(out, "+", _transferCacheBytes, "Bytes in transfer cache freelist");
+	AppendBytesLine(out, "+", _centralFreeBytes, "Bytes in central cache freelist");
+	AppendBytesLine(out, "+", _spanTailBytes, "Bytes lost at span tails");
+	AppendBytesLine(out, "+", _pageHeap._largeObjectCacheBytes, "Bytes in large object cache");
+	AppendBytesLine(out, "+", _pageHeap._freeBytes, "Bytes in page heap freelist");
+	AppendBytesLine(out, "+", _pageHeap._unmappedBytes, "Bytes released to OS (aka unmapped)");
+	Append(out, "MALLOC:   ------------\n");
+	AppendBytesLine(out, "=", _pageHeap._mappedBytes, "Virtual address space mapped");
+	Append(out, "MALLOC:\n");
+	Append(out, "MALLOC:   %15zu                  Small objects in use (bytes)\n", _smallInUseBytes);
+	Append(out, "MALLOC:   %15zu                  Large objects in use (bytes)\n", _largeInUseBytes);
+	Append(out, "MALLOC:   %15zu                  Large free spans cached (bytes)\n", _pageHeap._largeSpanCacheBytes);
+	Append(out, "MALLOC:   %15zu                  Huge page arena reserved (bytes)\n", _pageHeap._hugePageArenaBytes);
+	Append(out, "MALLOC:   %15zu                  Thread/cpu caches\n", _frontCaches);
+	Append(out, "------------------------------------------------\n");
+
+	// 每个大小类一行, 一个 span 都没有的大小类不打印
+	Append(out, "%5s %8s %8s %12s %10s %10s %10s %10s %10s\n",
+		"class", "size", "spans", "span_bytes", "objects", "in_use", "central", "transfer", "front");
+	for (size_t i = 0; i < _numClasses; ++i)
+	{
+		const SizeClassStats& cls = _classes[i];
+		if (cls._spans == 0 && cls._frontObjects == 0)
+			continue;
+		Append(out, "%5zu %8zu %8zu %12zu %10zu %10zu %10zu %10zu %10zu\n",
+			i, cls._size, cls._spans, cls._spanBytes, cls._objects,
+			cls._inUseObjects, cls._centralFreeObjects, cls._transferObjects, cls._frontObjects);
+	}
+
+	// 各级缓存之间来回的次数和锁的竞争情况, 看该调哪一级
+	Append(out, "------------------------------------------------\n");
+	AppendLockLine(out, "page heap lock", _pageHeap._lock);
+	AppendLockLine(out, "central cache locks", _centralLock);
+	Append(out, "%-20s %zu\n", "system allocs", _pageHeap._systemAllocs);
+	Append(out, "lock hold time       %12s %12s\n", "page_heap", "central");
+	for (size_t i = 0; i < LockStats::HOLD_BUCKETS; ++i)
+	{
+		char range[32];
+		if (i + 1 < LockStats::HOLD_BUCKETS)
+			snprintf(range, sizeof(range), "< %zu ns", HoldBucketLimit(i));
+		else
+			snprintf(range, sizeof(range), ">= %zu ns", HoldBucketLimit(i - 1));
+		Append(out, "  %-18s %12zu %12zu\n", range, _pageHeap._lock._holdHistogram[i], _centralLock._holdHistogram[i]);
+	}
+	Append(out, "------------------------------------------------\n");
+	Append(out, "%5s %8s %12s %12s %12s %12s %12s %12s\n",
+		"class", "size", "fetches", "too_long", "span_fetch", "lock_acq", "contended", "wait_us");
+	for (size_t i = 0; i < _numClasses; ++i)
+	{
+		const SizeClassStats& cls = _classes[i];
+		if (cls._centralFetches == 0 && cls._listTooLong == 0 && cls._lock._acquisitions == 0)
+			continue;
+		Append(out, "%5zu %8zu %12zu %12zu %12zu %12zu %12zu %12.1f\n",
+			i, cls._size, cls._centralFetches, cls._listTooLong, cls._spanFetches,
+			cls._lock._acquisitions, cls._lock._contended, cls._lock._waitNs / 1e3);
+	}
+	return out;
+}
+
+std::string AllocatorStats::ToJson() const
+{
+	std::string out;
+	Append(out, "{\n");
+	Append(out, "  \"small_in_use_bytes\": %zu,\n", _smallInUseBytes);
+	Append(out, "  \"large_in_use_bytes\": %zu,\n", _largeInUseBytes);
+	Append(out, "  \"front_caches\": %zu,\n", _frontCaches);
+	Append(out, "  \"front_cache_bytes\": %zu,\n", _frontCacheBytes);
+	Append(out, "  \"transfer_cache_bytes\": %zu,\n", _transferCacheBytes);
+	Append(out, "  \"central_free_bytes\": %zu,\n", _centralFreeBytes);
+	Append(out, "  \"span_tail_bytes\": %zu,\n", _spanTailBytes);
+	Append(out, "  \"page_heap\": {\n");
+	Append(out, "    \"mapped_bytes\": %zu,\n", _pageHeap._mappedBytes);
+	Append(out, "    \"used_bytes\": %zu,\n", _pageHeap._usedBytes);
+	Append(out, "    \"free_bytes\": %zu,\n", _pageHeap._freeBytes);
+	Append(out, "    \"unmapped_bytes\": %zu,\n", _pageHeap._unmappedBytes);
+	Append(out, "    \"large_span_cache_bytes\": %zu,\n", _pageHeap._largeSpanCacheBytes);
+	Append(out, "    \"large_object_cache_bytes\": %zu,\n", _pageHeap._largeObjectCacheBytes);
+	Append(out, "    \"hugepage_arena_bytes\": %zu,\n", _pageHeap._hugePageArenaBytes);
+	Append(out, "    \"system_allocs\": %zu,\n", _pageHeap._systemAllocs);
+	Append(out, "    \"lock\": ");
+	AppendJsonLock(out, _pageHeap._lock);
+	Append(out, "\n  },\n");
+	Append(out, "  \"central_lock\": ");
+	AppendJsonLock(out, _centralLock);
+	Append(out, ",\n");
+
+	// JSON 里所有大小类都输出, 下标就是桶号
+	Append(out, "  \"size_classes\": [");
+	for (size_t i = 0; i < _numClasses; ++i)
+	{
+		const SizeClassStats& cls = _classes[i];
+		Append(out, "%s\n    {\"size\": %zu, \"spans\": %zu, \"span_bytes\": %zu, \"objects\": %zu, \"in_use\": %zu, "
+			"\"central_free\": %zu, \"transfer\": %zu, \"front\": %zu, ",
+			i == 0 ? "" : ",", cls._size, cls._spans, cls._spanBytes, cls._objects,
+			cls._inUseObjects, cls._centralFreeObjects, cls._transferObjects, cls._frontObjects);
+		Append(out, "\"central_fetches\": %zu, \"list_too_long\": %zu, \"span_fetches\": %zu, \"lock\": ",
+			cls._centralFetches, cls._listTooLong, cls._spanFetches);
+		AppendJsonLock(out, cls._lock);
+		Append(out, "}");
+	}
+	Append(out, "\n  ]\n}\n");
+	return out;
+}
@@ -0,0 +1,78 @@
+﻿#pragma once
+
+#include "Common.h"
+
+#include <string>
+
+// 内存池的统计信息(类似 tcmalloc 的 MallocExtension::GetStats)
+// 每一级缓存都是在自己本来就持有锁的地方顺手更新计数器(StatCounter), 收集的时候只读这些计数器, 不加任何分配路径上的锁,
+// 所以不会卡住正在申请释放内存的线程; 代价是各项是在不同时刻读到的, 加起来可能和总数差一点点
+
+// 一把锁的统计(LockStats)在某一时刻的值, 只有打开了锁统计(CMP_LOCK_STATS=1)才会增长
+struct LockStatsSnapshot
+{
+	size_t _acquisitions = 0;			// 拿了几次锁
+	size_t _contended = 0;				// 其中几次要等
+	size_t _waitNs = 0;					// 一共等了多久
+	size_t _holdHistogram[LockStats::HOLD_BUCKETS] = {};	// 持有时间的分布, 见 LockStats::HoldBucket
+
+	void Read(const LockStats& stats);
+	void Add(const LockStatsSnapshot& other);
+};
+
+// 一个大小类的统计
+struct SizeClassStats
+{
+	size_t _size = 0;					// 对象大小
+	size_t _spans = 0;					// 中心缓存里这个大小类的span个数
+	size_t _spanBytes = 0;				// 这些span一共占了多少字节
+	size_t _objects = 0;				// 这些span一共能切多少个对象
+	size_t _centralFreeObjects = 0;		// span里空闲的对象(还回来的和还没切的)
+	size_t _transferObjects = 0;		// 转运缓存里的对象
+	size_t _frontObjects = 0;			// 各线程(或各CPU)缓存里的对象
+	size_t _inUseObjects = 0;			// 应用程序正在用的对象
+
+	// 各级缓存之间来回的次数(一直在统计, 不需要打开锁统计)
+	size_t _centralFetches = 0;			// 线程缓存找中心缓存要对象(FetchFromCentralCache)的次数
+	size_t _listTooLong = 0;			// 线程缓存的链表太长, 还给中心缓存(ListTooLong)的次数
+	size_t _spanFetches = 0;			// 中心缓存没有空闲对象, 找 page cache 要span的次数
+	LockStatsSnapshot _lock;			// 这个桶的桶锁
+};
+
+// page cache 的统计
+struct PageHeapStats
+{
+	size_t _mappedBytes = 0;			// 向系统映射的内存(大页 arena 里还没切出去的部分不算)
+	size_t _freeBytes = 0;				// 空闲、物理页还驻留的
+	size_t _unmappedBytes = 0;			// 空闲、物理页已经还给系统的
+	size_t _usedBytes = 0;				// 分出去的: 中心缓存的span + 大对象
+	size_t _largeSpanCacheBytes = 0;	// 超过128页的空闲span缓存, 包含在上面的空闲和已归还里
+	size_t _largeObjectCacheBytes = 0;	// 大对象分片缓存, 包含在 _usedBytes 里
+	size_t _hugePageArenaBytes = 0;		// 预留的大页 arena
+	size_t _systemAllocs = 0;			// 向系统申请内存的次数
+	LockStatsSnapshot _lock;			// _pageMtx
+};
+
+struct AllocatorStats
+{
+	size_t _numClasses = 0;
+	SizeClassStats _classes[NFREELISTS];
+	PageHeapStats _pageHeap;
+
+	// 各级缓存的汇总(由 Finish 根据上面的数据算出来)
+	size_t _frontCaches = 0;			// 线程缓存(或CPU缓存)的个数
+	size_t _frontCacheBytes = 0;		// 线程缓存(或CPU缓存)里的字节数
+	size_t _transferCacheBytes = 0;		// 转运缓存里的字节数
+	size_t _centralFreeBytes = 0;		// 中心缓存span里空闲的字节数
+	size_t _smallInUseBytes = 0;		// 应用程序正在用的小对象字节数
+	size_t _largeInUseBytes = 0;		// 应用程序正在用的大对象(>256KB)字节数
+	size_t _spanTailBytes = 0;			// span 最后不够一个对象的零头
+	LockStatsSnapshot _centralLock;		// 所有桶锁加起来
+
+	// 各级缓存把自己的计数器填进来以后, 算出每个大小类正在用的对象数和各项汇总
+	void Finish();
+
+	// 人看的文本 / 给监控系统解析的 JSON
+	std::string ToText() const;
+	std::string ToJson() const;
+};
@@ -1,89 +1,436 @@
-#define _CRT_SECURE_NO_WARNINGS 1
+﻿#define _CRT_SECURE_NO_WARNINGS 1
 
 #include "ThreadCache.h"
 #include "CentralCache.h"
+#include "PageCache.h"
+#include "Stats.h"
 
 void* ThreadCache::FetchFromCentralCache(size_t index, size_t size)
 {
-	// ʼ㷨
-	// 1. ʼһ central cache һҪ̫, ΪҪ̫˿Ҫ
-	// 2. 㲻 size Сڴ, ô batchNum ͻ᲻, ֱ
-	// 3. size Խ, һ central cache Ҫ batchNum ԽС
-	// 4. size ԽС, һ central cache Ҫ batchNum Խ()
-	size_t batchNum = min(_freeLists[index].MaxSize(), SizeClass::NumMoveSize(size));
-	// ôҪһЩĺôǣ
-	// ´Ժڴʱ, ֱ thread cache , ͲҪ central cache
-	//  thread cache 
-	if (batchNum == _freeLists[index].MaxSize())
-	{
-		_freeLists[index].MaxSize() += 1;
-	}
+	// 慢开始反馈调节算法
+	// 1. 最开始不会一次性向 central cache 一次批量要太多, 因为要太多了可能要不完
+	// 2. 如果你不断有 size 大小的内存需求, 那么 batchNum 就会不断增长, 直到上限
+	// 3. size 越大, 一次性向 central cache 要的 batchNum 就越小
+	// 4. size 越小, 一次性向 central cache 要的 batchNum 就越大(慢慢增长变大)
+	size_t batchNum = NextBatchNum(index);
 
-	//  central cache ڴ,  batchNum  size СĶ
+	// 向 central cache 申请内存, 申请 batchNum 个 size 大小的对象
 	void* start = nullptr;
 	void* end = nullptr;
 	size_t actualNum = CentralCache::getInstance()->FetchRangeObj(start, end, batchNum, size);
-	assert(actualNum > 0);
+	if (actualNum == 0)
+		return nullptr;	// 向系统要不到内存了, 这时已经没有拿着任何锁
 
-	if (1 == actualNum)		// ֻȡ 1 
+	return PushFetched(index, start, end, actualNum);
+}
+
+size_t ThreadCache::NextBatchNum(size_t index)
+{
+	size_t batchNum = std::min(_freeLists[index].MaxSize(), SizeClass::ClassNumMoveSize(index));
+	// 那么我批量找你多要一些的好处就是：
+	// 再下次我来了以后申请内存的时候, 就直接在 thread cache 申请就行, 就不需要找你 central cache了
+	// 尽量能在 thread cache 里面申请最好
+	if (batchNum == _freeLists[index].MaxSize())
+	{
+		_freeLists[index].MaxSize() += 1;
+	}
+	_centralFetches[index].Add(1);
+	return batchNum;
+}
+
+void* ThreadCache::PushFetched(size_t index, void* start, void* end, size_t n)
+{
+	if (1 == n)		// 如果只获取到了 1 个
 	{
 		assert(start == end);
 		return start;
 	}
-	else	
+	else
 	{
-		//  central cache ȡ˶, ôͰѿͷĵ 1 󷵻ظ [õ߳]
-		// ʣµĶͷ嵽 thread cache 
-		_freeLists[index].PushRange(NextObj(start), end, actualNum - 1);
+		// 如果从 central cache 获取到了多个对象, 那么就把开头的第 1 个对象返回给 [外面调用的线程]
+		// 把剩下的对象，头插到 thread cache 的自由链表中
+		_freeLists[index].PushRange(NextObj(start), end, n - 1);
+		_size += (n - 1) * SizeClass::ClassSize(index);
 		return start;
 	}
 }
 
-// ڴ
+void* ThreadCache::PopOrBatchNum(size_t index, size_t& batchNum)
+{
+	if (_freeLists[index].Empty())
+	{
+		batchNum = NextBatchNum(index);
+		return nullptr;
+	}
+	_size -= SizeClass::ClassSize(index);
+	return _freeLists[index].Pop();
+}
+
+// 申请内存对象
 void* ThreadCache::Allocate(size_t size)
 {
-	// size Ӧ <= 258kb 
+	// size 应该是 <= 258kb 的
 	assert(size <= MAX_BYTES);
 
-	// ҵӦͰأ
-	//  size = 7Ӧȡ 8 ֽڣôҵ 8ֽ ӦͰأ
-	size_t alignSize = SizeClass::RoundUp(size);
-	size_t index = SizeClass::Index(size); 
-	if (!_freeLists[index].Empty()) // Ϊ, ô˵ȥͰȡڴ
+	// 如何找到对应的桶呢？
+	// 比如 size = 7，应该是取申请 8 字节，那么如何找到 8字节 对应的桶呢？
+	// 查一次表拿到桶号, 对齐大小按桶号直接取
+	size_t index = SizeClass::Index(size);
+	size_t alignSize = SizeClass::ClassSize(index);
+	void* obj = nullptr;
+	_handshake.Enter();
+	if (!_freeLists[index].Empty()) // 如果不为空, 那么说明可以去桶的下面取内存
 	{
-		return _freeLists[index].Pop();
+		_size -= alignSize;
+		obj = _freeLists[index].Pop();
 	}
-	else // ͰûôҪȥĻ桿ȥȡ
+	else // 如果【桶】下面没有自由链表，那么就要去【中心缓存】中去获取
 	{
-		return FetchFromCentralCache(index, alignSize);
+		obj = FetchFromCentralCache(index, alignSize);
 	}
+	_handshake.Leave();
+	return obj;
 }
 
 
-// ͷڴ
+// 释放内存对象
 void ThreadCache::Deallocate(void* ptr, size_t size)
 {
 	assert(size <= MAX_BYTES);
 	assert(ptr);
 
-	// 㵱ǰ size ĸͰ棨Ͱ = 飬 size ӳ䵽ĸλã
-	// ҳӳͰȻѶȥ
+	void* start = nullptr;
+	void* end = nullptr;
+	_handshake.Enter();
+	size_t n = PushAndTakeOverflow(ptr, size, start, end);
+	if (n > 0)
+	{
+		CentralCache::getInstance()->InsertRange(start, end, n, size);
+	}
+
+	// 整个线程缓存的字节数超过了它的额度, 缩一缩
+	if (_size > _maxSize.load(std::memory_order_relaxed))
+	{
+		Scavenge();
+	}
+	_handshake.Leave();
+}
+
+size_t ThreadCache::PushAndTakeOverflow(void* ptr, size_t size, void*& start, void*& end)
+{
+	// 计算你当前 size 在哪个桶里面（桶 = 数组，即 size 被映射到了数组的哪个位置）
+	// 找出映射的自由链表桶，然后把对象插入进去
 	size_t index = SizeClass::Index(size);
 	_freeLists[index].Push(ptr);
+	_size += SizeClass::ClassSize(index);
 
-	// ȴһڴʱ, Ϳʼһlistcentral cache
+	// 当链表长度大于一次批量申请的内存时, 就开始还一段list给central cache
 	if (_freeLists[index].Size() >= _freeLists[index].MaxSize())
 	{
-		ListTooLong(_freeLists[index], size);
+		return PopOverflow(_freeLists[index], size, start, end);
 	}
+	return 0;
 }
 
-// ͷŶʱʱڴصĻ
+// 释放对象时，链表过长时，回收内存回到中心缓存
 void ThreadCache::ListTooLong(FreeList& list, size_t size)
 {
 	void* start = nullptr;
 	void* end = nullptr;
-	list.PopRange(start, end, list.MaxSize());	// ȡһڴ
+	size_t n = PopOverflow(list, size, start, end);
+	CentralCache::getInstance()->InsertRange(start, end, n, size);
+}
+
+size_t ThreadCache::PopOverflow(FreeList& list, size_t size, void*& start, void*& end)
+{
+	// 取一次批量的内存出来
+	// 慢开始把 MaxSize 涨到头以后会比 NumMoveSize 多 1, 这里最多按一整批还, 这样能直接放进转运缓存
+	size_t batchNum = SizeClass::NumMoveSize(size);
+	size_t n = std::min(list.Size(), batchNum);
+	list.PopRange(start, end, n);
+	_size -= n * SizeClass::RoundUp(size);
+	_listTooLong[SizeClass::Index(size)].Add(1);
+
+	// 释放时慢开始也要涨: 只释放不申请的线程(比如生产者-消费者里的消费者)不会走 FetchFromCentralCache,
+	// MaxSize 一直是 1 的话它每次只能还一个对象, 永远凑不成一整批
+	if (list.MaxSize() < batchNum)
+	{
+		list.MaxSize() += 1;
+	}
+	return n;
+}
+
+// 线程退出时，把所有桶里缓存的对象全部还给中心缓存
+void ThreadCache::ReleaseAll()
+{
+	for (size_t i = 0; i < NFREELISTS; ++i)
+	{
+		FreeList& list = _freeLists[i];
+		if (list.Empty())
+			continue;
+
+		void* start = nullptr;
+		void* end = nullptr;
+		list.PopRange(start, end, list.Size());
+
+		// 桶里只存了对象, 没有存对象大小, 通过第一个对象所在的span拿到大小
+		size_t size = PageCache::getInstance()->MapObjectToSpan(start)->_objSize;
+		CentralCache::getInstance()->ReleaseListToSpans(start, size);
+	}
+	_size = 0;
+}
+
+// 全局预算: 所有已注册的 ThreadCache 串在一起, 用一把锁保护
+static std::mutex threadCacheMtx;
+static ThreadCache* threadCacheHead = nullptr;
+// 还没有分给任何线程的额度, 可能是负数(线程太多时每个线程也至少给 MIN_CACHE_SIZE)
+static long long unclaimedCacheSpace = ThreadCache::OVERALL_CACHE_SIZE;
+static ThreadCache* nextMemorySteal = nullptr;	// 下一次从谁那里偷
+// 已经退出的线程的计数, 线程退出时加进来, 这样统计里不会少了它们
+static size_t exitedCentralFetches[NFREELISTS] = { 0 };
+static size_t exitedListTooLong[NFREELISTS] = { 0 };
+
+// 缓存的总字节数超过上限了: 每个桶还一半给中心缓存, 再想办法把上限调大一点
+// 一次批量申请可能一下子拿回很多对象(大小类表里批量数可以配得很大), 减半一次不一定够, 所以减到不超额为止
+void ThreadCache::Scavenge()
+{
+	ShrinkToMaxSize();
+
+	// 这个线程还在频繁释放, 说明它是活跃的, 给它多一点额度
+	IncreaseCacheLimit();
+}
+
+void ThreadCache::ShrinkToMaxSize()
+{
+	while (_size > _maxSize.load(std::memory_order_relaxed))
+	{
+		for (size_t i = 0; i < NFREELISTS; ++i)
+		{
+			FreeList& list = _freeLists[i];
+			if (list.Empty())
+				continue;
+
+			size_t n = (list.Size() + 1) / 2;
+			void* start = nullptr;
+			void* end = nullptr;
+			list.PopRange(start, end, n);
+
+			size_t size = PageCache::getInstance()->MapObjectToSpan(start)->_objSize;
+			_size -= n * size;
+			CentralCache::getInstance()->ReleaseListToSpans(start, size);
+		}
+	}
+}
+
+// 先从全局剩余的预算里拿, 拿不到就轮流从其他线程那里"偷"一点额度
+// 空闲线程的额度会被慢慢偷光(但不会低于 MIN_CACHE_SIZE), 活跃线程的额度会越来越大
+void ThreadCache::IncreaseCacheLimit()
+{
+	std::unique_lock<std::mutex> lock(threadCacheMtx);
+	if (unclaimedCacheSpace > 0)
+	{
+		unclaimedCacheSpace -= STEAL_AMOUNT;
+		_maxSize += STEAL_AMOUNT;
+		return;
+	}
+
+	// 最多试10个线程, 避免线程很多的时候一直在这里遍历
+	for (int i = 0; i < 10; ++i)
+	{
+		if (nextMemorySteal == nullptr)
+			nextMemorySteal = threadCacheHead;
+		ThreadCache* victim = nextMemorySteal;
+		nextMemorySteal = victim->_next;
+
+		if (victim == this)
+			continue;
+
+		size_t victimMax = victim->_maxSize.load(std::memory_order_relaxed);
+		if (victimMax <= MIN_CACHE_SIZE)
+			continue;
+
+		victim->_maxSize -= STEAL_AMOUNT;
+		_maxSize += STEAL_AMOUNT;
+
+		// 被偷的线程还在申请释放的话, 它下一次释放时发现自己超额了会自己缩; 空闲的线程就由这里替它缩
+		victim->TrimIfIdle();
+		return;
+	}
+}
+
+// 拿着注册链表的锁, victim 不会在这期间退出
+void ThreadCache::TrimIfIdle()
+{
+	// 它正在申请释放的话就不等了, 它自己下一次释放时发现超额会缩
+	_handshake.Claim();
+	AsymmetricBarrier::Heavy();
+	if (!_handshake.Busy())
+	{
+		ShrinkToMaxSize();
+	}
+	_handshake.Release();
+}
+
+void ThreadCache::SetOverallCacheSize(size_t bytes)
+{
+	std::unique_lock<std::mutex> lock(threadCacheMtx);
+	size_t claimed = 0;
+	for (ThreadCache* tc = threadCacheHead; tc != nullptr; tc = tc->_next)
+	{
+		claimed += tc->_maxSize.load(std::memory_order_relaxed);
+	}
+	unclaimedCacheSpace = (long long)bytes - (long long)claimed;
+}
+
+long long ThreadCache::UnclaimedCacheSpace()
+{
+	std::unique_lock<std::mutex> lock(threadCacheMtx);
+	return unclaimedCacheSpace;
+}
+
+void ThreadCache::LockForFork()
+{
+	threadCacheMtx.lock();
+}
+
+void ThreadCache::UnlockAfterFork()
+{
+	threadCacheMtx.unlock();
+}
+
+// 桶的长度是各个线程自己改的, 这里读到的可能稍微过时
+void ThreadCache::AddStats(AllocatorStats& stats)
+{
+	for (size_t i = 0; i < NFREELISTS; ++i)
+	{
+		stats._classes[i]._frontObjects += _freeLists[i].Size();
+		stats._classes[i]._centralFetches += _centralFetches[i].Get();
+		stats._classes[i]._listTooLong += _listTooLong[i].Get();
+	}
+	++stats._frontCaches;
+}
+
+// 线程退出时先拿这把锁把 ThreadCache 摘下来再还给定长内存池, 所以遍历的时候链表上的 ThreadCache 都不会被回收
+void ThreadCache::CollectStats(AllocatorStats& stats)
+{
+	std::unique_lock<std::mutex> lock(threadCacheMtx);
+	for (ThreadCache* tc = threadCacheHead; tc != nullptr; tc = tc->_next)
+	{
+		tc->AddStats(stats);
+	}
+	for (size_t i = 0; i < NFREELISTS; ++i)
+	{
+		stats._classes[i]._centralFetches += exitedCentralFetches[i];
+		stats._classes[i]._listTooLong += exitedListTooLong[i];
+	}
+}
+
+// 所有线程的 ThreadCache 都从这个定长内存池里申请
+static LockFreeObjectPool<ThreadCache>& ThreadCachePool()
+{
+	static LockFreeObjectPool<ThreadCache> tcPool;
+	return tcPool;
+}
+
+// 这个线程的 ThreadCache 已经在线程退出时回收了
+static thread_local bool tlsThreadCacheReleased = false;
+
+// 线程退出时会自动调用它的析构函数:
+// 把 ThreadCache 里缓存的对象还给 central cache, 再把 ThreadCache 对象本身还给定长内存池
+// 否则线程退出以后, 它自由链表里的对象和 ThreadCache 对象本身就永远泄漏了
+struct ThreadCacheReleaser
+{
+	~ThreadCacheReleaser()
+	{
+		tlsThreadCacheReleased = true;
+
+		ThreadCache* tc = pTLSthreadcache;
+		if (tc == nullptr)
+			return;
+
+		pTLSthreadcache = nullptr;
+		ThreadCache::Destroy(tc);
+	}
+};
+
+ThreadCache* ThreadCache::Create()
+{
+	if (tlsThreadCacheReleased)
+		return nullptr;
+
+	// 第一次创建 ThreadCache 时确定用哪一套大小类
+	SizeClass::InitTable();
+	// 申请释放路径上要用的轻量屏障, 要在第一次用之前初始化
+	AsymmetricBarrier::Init();
+
+	ThreadCache* tc = ThreadCachePool().New();
+	if (tc == nullptr)
+		return nullptr;	// 向系统要不到内存, 这次申请释放走不带缓存的路径
+	{
+		// 注册到全局链表里, 从全局预算里分一份初始额度
+		// 预算不够时也给 MIN_CACHE_SIZE(剩余额度变成负数), 给多少就记多少, Destroy 时按 _maxSize 还回去才对得上
+		std::unique_lock<std::mutex> lock(threadCacheMtx);
+		unclaimedCacheSpace -= MIN_CACHE_SIZE;
+		tc->_maxSize = MIN_CACHE_SIZE;
+
+		tc->_next = threadCacheHead;
+		if (threadCacheHead != nullptr)
+			threadCacheHead->_prev = tc;
+		threadCacheHead = tc;
+	}
+
+	// 先设置 TLS 指针, 再构造 releaser:
+	// 注册 thread_local 析构函数时 glibc 会调 calloc, 替换了 malloc 以后这个 calloc 又会走回内存池,
+	// 这时 pTLSthreadcache 已经有值了, 就不会再递归进 Create
+	pTLSthreadcache = tc;
+
+	// 函数内的 thread_local 对象在每个线程第一次走到这里时构造, 线程退出时析构
+	static thread_local ThreadCacheReleaser releaser;
+	(void)releaser;
+
+	return tc;
+}
+
+void ThreadCache::Destroy(ThreadCache* tc)
+{
+	{
+		// 先从全局链表里摘掉, 额度还回去; 摘下来以后别的线程就不会再来收它的缓存了
+		std::unique_lock<std::mutex> lock(threadCacheMtx);
+		unclaimedCacheSpace += tc->_maxSize.load(std::memory_order_relaxed);
+		for (size_t i = 0; i < NFREELISTS; ++i)
+		{
+			exitedCentralFetches[i] += tc->_centralFetches[i].Get();
+			exitedListTooLong[i] += tc->_listTooLong[i].Get();
+		}
+		if (nextMemorySteal == tc)
+			nextMemorySteal = tc->_next;
+		if (tc->_prev != nullptr)
+			tc->_prev->_next = tc->_next;
+		else
+			threadCacheHead = tc->_next;
+		if (tc->_next != nullptr)
+			tc->_next->_prev = tc->_prev;
+	}
+
+	tc->ReleaseAll();
+	ThreadCachePool().Delete(tc);
+}
+
+void* ThreadCache::AllocateUncached(size_t size)
+{
+	assert(size <= MAX_BYTES);
+
+	void* start = nullptr;
+	void* end = nullptr;
+	size_t actualNum = CentralCache::getInstance()->FetchRangeObj(start, end, 1, SizeClass::RoundUp(size));
+	return actualNum == 0 ? nullptr : start;
+}
+
+void ThreadCache::DeallocateUncached(void* ptr, size_t size)
+{
+	assert(size <= MAX_BYTES);
 
-	CentralCache::getInstance()->ReleaseListToSpans(start, size);
+	// ReleaseListToSpans 按链表处理, 单个对象就是只有一个结点的链表
+	NextObj(ptr) = nullptr;
+	CentralCache::getInstance()->ReleaseListToSpans(ptr, size);
 }
\ No newline at end of file
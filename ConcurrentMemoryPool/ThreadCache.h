@@ -1,31 +1,123 @@
-#pragma once
+﻿#pragma once
 
-// 
+// 声明
 
 #include "Common.h"
 
-// thread cacheһϣӳĶ
+struct AllocatorStats;
+
+// thread cache本质是由一个哈希映射的对象自由链表构成
 class ThreadCache
 {
 public:
-	// ͷڴ
+	// 申请和释放内存对象, 申请不到时返回 nullptr
 	void* Allocate(size_t size);
 	void Deallocate(void* ptr, size_t size);
 
-	// Ļȡ
+	// 从中心缓存获取对象, 向系统要不到内存时返回 nullptr
 	void* FetchFromCentralCache(size_t index, size_t size);
 
-	// ͷŶʱʱڴصĻ
+	// 释放对象时，链表过长时，回收内存回到中心缓存
 	void ListTooLong(FreeList& list, size_t size);
+
+	// 下面三个把 Allocate / Deallocate 里和 central cache 打交道的部分拆开, 给 CpuCache 用:
+	// slab 的锁只在改自由链表时拿着, 找 central cache 要对象、还对象时放掉
+	// 桶里有对象就取一个; 桶空时返回 nullptr, 并给出这次该找 central cache 要几个(慢开始)
+	void* PopOrBatchNum(size_t index, size_t& batchNum);
+
+	// 找 central cache 要到的 n 个对象: 第一个返回给调用方, 剩下的放进桶里
+	void* PushFetched(size_t index, void* start, void* end, size_t n);
+
+	// 把对象放进桶里; 桶太长时摘下一批(start 到 end)交给调用方还给 central cache, 返回个数, 0 表示不用还
+	size_t PushAndTakeOverflow(void* ptr, size_t size, void*& start, void*& end);
+
+	// 线程退出时，把所有桶里缓存的对象全部还给中心缓存
+	void ReleaseAll();
+
+	// 创建当前线程的 ThreadCache，并注册线程退出时的回收动作
+	// (只在线程第一次申请/释放内存时走到，是慢路径)
+	// 线程退出、ThreadCache 已经回收以后(或者向系统要不到内存时)再调用会返回 nullptr, 这时要用下面的 Uncached 接口
+	static ThreadCache* Create();
+
+	// 不经过 ThreadCache, 直接找 central cache 申请/释放一个对象
+	// glibc 在线程退出的最后阶段还会调 free/malloc, 这时不能再创建 ThreadCache, 否则没人回收它
+	static void* AllocateUncached(size_t size);
+	static void DeallocateUncached(void* ptr, size_t size);
+
+	// 线程退出时注销，把它的缓存额度还给全局预算
+	static void Destroy(ThreadCache* tc);
+
+	// 设置所有 ThreadCache 加起来最多缓存多少字节(默认32MB)
+	static void SetOverallCacheSize(size_t bytes);
+
+	// 全局预算里还没分给任何线程的额度(线程太多时是负数)
+	static long long UnclaimedCacheSpace();
+
+	// fork 前后拿住/放开注册链表的锁(见 AtFork.h)
+	// 子进程里别的线程的 ThreadCache 还挂在链表上, 缓存的对象就不要了, 只是没人再用它们
+	static void LockForFork();
+	static void UnlockAfterFork();
+
+	// 把每个桶里缓存的对象个数累加到统计里
+	void AddStats(AllocatorStats& stats);
+
+	// 统计所有已注册的 ThreadCache: 只拿注册链表的锁(线程创建/退出时才用到), 不打扰线程自己的申请释放
+	static void CollectStats(AllocatorStats& stats);
+
+	// 当前缓存的总字节数 / 允许缓存的上限
+	size_t Size() { return _size; }
+	size_t MaxSize() { return _maxSize.load(std::memory_order_relaxed); }
+
+	// 全局预算的参数
+	static const size_t OVERALL_CACHE_SIZE = 32 * 1024 * 1024;	// 默认的全局预算
+	static const size_t MIN_CACHE_SIZE = 2 * MAX_BYTES;	// 每个线程至少能缓存这么多, 保证一个最大对象也放得下
+	static const size_t STEAL_AMOUNT = 64 * 1024;	// 每次调整额度的粒度
 private:
-	// ģϣÿλöһ_freeList
+	// 这次找 central cache 要几个对象, 顺便推进慢开始
+	size_t NextBatchNum(size_t index);
+
+	// 从太长的桶里摘下一批要还给 central cache 的对象, 返回个数
+	size_t PopOverflow(FreeList& list, size_t size, void*& start, void*& end);
+
+	// 缓存的总字节数超过上限了: 每个桶还一半给中心缓存, 再想办法把上限调大一点
+	void Scavenge();
+
+	// 每个桶还一半给中心缓存, 直到缓存的总字节数不超过上限
+	void ShrinkToMaxSize();
+
+	// 先从全局剩余的预算里拿, 拿不到就轮流从其他线程那里"偷"一点额度
+	void IncreaseCacheLimit();
+
+	// 别的线程偷走额度以后调用(拿着注册链表的锁): 这个线程没在申请释放的话, 替它把超额的对象还给中心缓存
+	void TrimIfIdle();
+
+private:
+	// 用数组来模拟哈希表，每个数组的位置都挂了一个【_freeList】
 	FreeList _freeLists[NFREELISTS];
+
+	// 每个桶找中心缓存要了几次对象 / 还了几次对象, 只有自己的线程改, 统计时别的线程读
+	StatCounter _centralFetches[NFREELISTS];
+	StatCounter _listTooLong[NFREELISTS];
+
+	size_t _size = 0;	// 所有桶里缓存的对象的总字节数
+	// 允许缓存的字节数上限, 会被其他线程偷走一部分, 所以是原子的
+	// 不是通过 Create 创建的(比如 CpuCache 里的)不受全局预算限制
+	std::atomic<size_t> _maxSize{ SIZE_MAX };
+
+	// 空闲的线程不会再释放对象, 只调小它的上限的话, 它缓存的对象就一直挂着, 所以偷额度的线程要替它收回来
+	// 自己的线程申请释放时 Enter / Leave, 和替它收缓存的线程互斥
+	ClaimHandshake _handshake;
+
+	// 所有线程的 ThreadCache 串成一个双向链表, 偷额度的时候要遍历
+	ThreadCache* _next = nullptr;
+	ThreadCache* _prev = nullptr;
 };
 
 // TLS thread local storage
-// Ժ 3 ̣߳ô 3 ̸߳Զһ tls_threadcache
-// ڵ߳ȫֿɷʵģǲ̷ܱ߳ʵͱݵ̶߳ԡ
-static _declspec(thread) ThreadCache* pTLSthreadcache = nullptr;
-
-// ע⣺ȫֱ static ֻ֤ڵǰļɼ
+// 假设你程序启动以后有 3 个线程，那么这 3 个线程各自都会有一个 tls_threadcache
+// 这个变量在它所在的线程内是全局可访问的，但是不能被其他线程访问到，这样就保持了数据的线程独立性。
+// _declspec(thread) 只有MSVC认识, 这里换成C++11标准的 thread_local (gcc/clang 下等价于 __thread)
+// 注意：这里用 inline (C++17) 而不是 static，保证所有文件看到的是同一个变量，
+//       这样线程退出时 ThreadCache.cpp 里的回收逻辑才能把它置空。
+inline thread_local ThreadCache* pTLSthreadcache = nullptr;
 
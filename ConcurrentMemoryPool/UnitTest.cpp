@@ -1,15 +1,15 @@
-#define _CRT_SECURE_NO_WARNINGS 1
+﻿#define _CRT_SECURE_NO_WARNINGS 1
 
 #include "ObjectPool.h"
 #include "ConcurrentAlloc.h"
-// еԪ
+// 进行单元测试
 
 
 void Alloc1()
 {
 	for (size_t i = 0; i < 5; ++i)
 	{
-		void* ptr = ConcurrentAlloc(6); // һ 6 ֽ
+		void* ptr = ConcurrentAlloc(6); // 一次申请 6 字节
 	}
 }
 
@@ -17,13 +17,13 @@ void Alloc2()
 {
 	for (size_t i = 0; i < 5; ++i)
 	{
-		void* ptr = ConcurrentAlloc(7); // һ 6 ֽ
+		void* ptr = ConcurrentAlloc(7); // 一次申请 6 字节
 	}
 }
 
 void TLStest()
 {
-	//  t1 ߳ȥִ Alloc1 
+	// 创建了 t1 线程去执行 Alloc1 函数
 	std::thread t1(Alloc1);
 	t1.join();
 
@@ -34,7 +34,7 @@ void TLStest()
 
 void TestConcurrentAlloc1()
 {
-	// 
+	// 申请
 	void* p1 = ConcurrentAlloc(6);
 	void* p2 = ConcurrentAlloc(8);
 	void* p3 = ConcurrentAlloc(1);
@@ -47,7 +47,7 @@ void TestConcurrentAlloc1()
 	cout << p4 << endl;
 	cout << p5 << endl;
 
-	// ͷ
+	// 释放
 	ConcurrentFree(p1);
 	ConcurrentFree(p2);
 	ConcurrentFree(p3);
@@ -67,28 +67,28 @@ void TestConcurrentAlloc2()
 }
 
 
-// ַ֤ת
+// 验证地址转换
 void TestAddressShift()
 {
 	PAGE_ID id1 = 2000;
 	PAGE_ID id2 = 2001;
 	
-	// p1ǵһҳ, ʼַ2000
-	// p2ǵڶҳ, ʼַ2001
+	// p1是第一页, 它的起始地址是2000
+	// p2是第二页, 它的起始地址是2001
 	char* p1 = (char*)(id1 << PAGE_SHIFT);
 	char* p2 = (char*)(id2 << PAGE_SHIFT);
 
 	//cout << p1 << endl;
 	//cout << p2 << endl;
 
-	// һҳзֳɺܶСڴ
-	// ô֤һҳУеСڴĵַ2000
+	// 一页可以切分成很多的小内存块儿
+	// 那么，验证第一页中，所有的小内存块的地址都是2000
 	while (p1 < p2)
 	{
 		cout << (void*)p1 << " : " << ((PAGE_ID)p1 >> PAGE_SHIFT) << endl;
 		p1 += 8;
 	}
-/* һҳзֳСڴ棬ЩڴǱҵthread cacheеÿϣͰġ
+/* 下面就是一页被切分出的小块儿内存，这些内存就是被挂到thread cache中的每个哈希桶下面的。
 00FA0030 : 2000
 00FA0038 : 2000
 00FA0040 : 2000
@@ -101,18 +101,18 @@ void TestAddressShift()
 }
 
 
-// Զ̳߳
+// 测试多线程场景
 void MultiThreadAlloc1()
 {
-	// 
+	// 申请
 	std::vector<void*> v;
 	for (size_t i = 0; i < 5; ++i)
 	{
-		void* ptr = ConcurrentAlloc(6); // һ 6 ֽ
+		void* ptr = ConcurrentAlloc(6); // 一次申请 6 字节
 		v.push_back(ptr);
 	}
 
-	// ͷ
+	// 释放
 	for (auto e : v)
 	{
 		//ConcurrentFree(e, 6);
@@ -122,15 +122,15 @@ void MultiThreadAlloc1()
 
 void MultiThreadAlloc2()
 {
-	// 
+	// 申请
 	std::vector<void*> v;
-	for (size_t i = 0; i < 5; ++i)	//  5 
+	for (size_t i = 0; i < 5; ++i)	// 创建 5 次
 	{
-		void* ptr = ConcurrentAlloc(6); // һ 6 ֽڵڴ
+		void* ptr = ConcurrentAlloc(6); // 一次申请 6 字节的内存对象
 		v.push_back(ptr);
 	}
 
-	// ͷ
+	// 释放
 	for (auto e : v)
 	{
 		//ConcurrentFree(e, 6);
@@ -141,7 +141,7 @@ void MultiThreadAlloc2()
 
 void TestMultiThread()
 {
-	//  t1 ߳ȥִ Alloc1 
+	// 创建了 t1 线程去执行 Alloc1 函数
 	std::thread t1(MultiThreadAlloc1);
 	std::thread t2(MultiThreadAlloc2);
 
@@ -149,17 +149,17 @@ void TestMultiThread()
 	t2.join();
 }
 
-// Դڴ
+// 测试大内存
 void BigAlloc()
 {
-	// ֱȥ257KBڴ, Ϊ1KB = 1024Byte
+	// 直接去申请257KB的内存, 因为1KB = 1024Byte
 	void* p1 = ConcurrentAlloc(257 * 1024);
 	//ConcurrentFree(p1, 257 * 1024);
 	ConcurrentFree(p1);
 
 
-	// 129ҳ, һҳĴСΪ8k, 1KB = 1024Byte
-	// ܹǣ129 * 8 * 1024 Byte
+	// 申请129页, 一页的大小为8k, 1KB = 1024Byte
+	// 所以总共就是：129 * 8 * 1024 个Byte
 	void* p2 = ConcurrentAlloc(129 * 8 * 1024);
 	//ConcurrentFree(p2, 129 * 8 * 1024);
 	ConcurrentFree(p2);
@@ -167,20 +167,1359 @@ void BigAlloc()
 }
 
 
-/*
-int main()
+// 验证64位下的三层基数树: 4G以上的页号也能建立映射
+void TestPageMap()
 {
+	TCMalloc_PageMap3<48 - PAGE_SHIFT> map;
+
+	// 0x7f0000000000 附近是 linux 下 mmap 常见的地址
+	PAGE_ID id = (PAGE_ID)0x7f0000000000 >> PAGE_SHIFT;
+	int value = 0;
+
+	assert(map.get(id) == nullptr);	// 还没有建结点, 查不到
+	assert(map.Ensure(id, NPAGES - 1));
+	map.set(id, &value);
+	map.set(id + NPAGES - 2, &value);
+	assert(map.get(id) == &value);
+	assert(map.get(id + NPAGES - 2) == &value);
+	assert(map.get(id + 1) == nullptr);
+
+	// 内存池真正分配出来的对象, 也要能通过页号找回它的span
+	void* p = ConcurrentAlloc(16);
+	Span* span = PageCache::getInstance()->MapObjectToSpan(p);
+	assert(span->_objSize == 16);
+	ConcurrentFree(p);
+
+	cout << "TestPageMap passed" << endl;
+}
+
+// 验证线程退出时, ThreadCache 里缓存的对象会还给 central cache
+void TestThreadExit()
+{
+	const size_t size = 200 * 1024;	// 用一个其他测试不会用到的大小
+	const size_t n = 16;
+	void* first = nullptr;
+
+	std::thread t([&]() {
+		std::vector<void*> v;
+		for (size_t i = 0; i < n; ++i)
+		{
+			v.push_back(ConcurrentAlloc(size));
+		}
+		first = v[0];
+
+		// 倒着释放, 最后释放的 first 会留在这个线程的 ThreadCache 里
+		for (size_t i = n; i > 0; --i)
+		{
+			ConcurrentFree(v[i - 1]);
+		}
+	});
+	t.join();
+
+	// 线程已经退出, 如果它缓存的对象没有还回来, first 就再也申请不到了
+	std::vector<void*> v;
+	bool found = false;
+	for (size_t i = 0; i < n; ++i)
+	{
+		void* p = ConcurrentAlloc(size);
+		found = found || (p == first);
+		v.push_back(p);
+	}
+	assert(found);
+
+	for (auto e : v)
+	{
+		ConcurrentFree(e);
+	}
+
+	cout << "TestThreadExit passed" << endl;
+}
+
+#ifdef __linux__
+// 当前进程的常驻内存(RSS), 单位字节
+static size_t GetRSS()
+{
+	size_t vm = 0, rss = 0;
+	FILE* fp = fopen("/proc/self/statm", "r");
+	if (fp)
+	{
+		if (fscanf(fp, "%zu %zu", &vm, &rss) != 2)
+			rss = 0;
+		fclose(fp);
+	}
+	return rss * sysconf(_SC_PAGESIZE);
+}
+#endif
+
+// 验证空闲页归还给操作系统以后, 虚拟地址还能接着用
+void TestReleaseFreeMemory()
+{
+	// 先关掉自动归还, 否则 p1 释放时可能已经被自动还给系统了
+	ConcurrentSetReleaseRate(0);
+
+	const size_t size = 64 * 8 * 1024;	// 64页, 走 page cache
+	char* p1 = (char*)ConcurrentAlloc(size);
+	memset(p1, 0xAB, size);
+	ConcurrentFree(p1);
+
+#ifdef __linux__
+	size_t before = GetRSS();
+#endif
+	size_t pages = ConcurrentReleaseFreeMemory();
+	assert(pages >= 64);
+	assert(ConcurrentReleaseFreeMemory() == 0);	// 已经全部还掉了
+#ifdef __linux__
+	// 刚才写过的 64 页物理内存已经还给系统了
+	// (内核按线程缓存 RSS 计数, statm 的值会有几十个页的误差, 所以只要求降下来一半以上)
+	assert(before - GetRSS() >= size / 2);
+#endif
+
+	// 驻留的span都还掉了, 这次只能从已归还的span里拿
+	char* p2 = (char*)ConcurrentAlloc(size);
+#ifndef _WIN32
+	// MADV_DONTNEED 以后再访问, 拿到的是系统重新清零的物理页
+	assert(p2[0] == 0 && p2[size - 1] == 0);
+#endif
+	memset(p2, 0xCD, size);
+	ConcurrentFree(p2);
+
+	ConcurrentSetReleaseRate(1.0);
+
+	cout << "TestReleaseFreeMemory passed" << endl;
+}
+
+// 验证同样大小的大对象反复申请释放时, 走分片缓存, 不需要 page cache 的大锁
+void TestLargeSpanCache()
+{
+	const size_t size = 300 * 1024;
+	std::atomic<int> step{ 0 };
+	void* p1 = nullptr;
+	void* p2 = nullptr;
+
+	std::thread t([&]() {
+		p1 = ConcurrentAlloc(size);
+		ConcurrentFree(p1);	// 放进了这个线程对应的分片缓存
+		step = 1;
+
+		while (step != 2)
+			std::this_thread::yield();
+
+		// 主线程此时拿着 _pageMtx, 如果这里还要加大锁就会一直卡住
+		p2 = ConcurrentAlloc(size);
+		ConcurrentFree(p2);
+		step = 3;
+	});
+
+	while (step != 1)
+		std::this_thread::yield();
+
+	PageCache::getInstance()->_pageMtx.lock();
+	step = 2;
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (step != 3 && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::yield();
+	bool done = (step == 3);
+	PageCache::getInstance()->_pageMtx.unlock();
+
+	t.join();
+	assert(done);
+	assert(p1 == p2);
+
+	cout << "TestLargeSpanCache passed" << endl;
+}
+
+// 验证全局预算: 缓存的字节数不会超过线程的额度, 全局预算用完以后, 活跃线程会从空闲线程那里偷额度
+static void FreeMany(size_t n)
+{
+	std::vector<void*> v;
+	for (size_t i = 0; i < n; ++i)
+	{
+		// 单个桶的长度受慢开始上限限制, 多用几个桶才能超过线程的额度
+		v.push_back(ConcurrentAlloc((i % 8 + 1) * 1024));
+	}
+	for (auto e : v)
+	{
+		ConcurrentFree(e);
+		assert(pTLSthreadcache->Size() <= pTLSthreadcache->MaxSize());
+	}
+}
+
+void TestThreadCacheBudget()
+{
+	ConcurrentSetThreadCacheBudget(ThreadCache::MIN_CACHE_SIZE * 3);
+
+	std::atomic<int> step{ 0 };
+	size_t idleBefore = 0, idleAfter = 0;
+	size_t idleCachedBefore = 0, idleCachedAfter = 0;
+
+	// 先活跃一段时间, 把全局剩余的预算都拿走, 然后就空闲下来
+	std::thread idle([&]() {
+		FreeMany(20000);
+		idleBefore = pTLSthreadcache->MaxSize();
+		idleCachedBefore = pTLSthreadcache->Size();
+		step = 1;
+		while (step != 2)
+			std::this_thread::yield();
+		// 这段时间没有申请释放过, 缓存的对象是偷额度的线程替它还回去的
+		idleAfter = pTLSthreadcache->MaxSize();
+		idleCachedAfter = pTLSthreadcache->Size();
+	});
+
+	while (step != 1)
+		std::this_thread::yield();
+
+	// 全局预算已经用完了, 这个线程的额度只能从空闲线程那里偷
+	std::thread busy([&]() {
+		FreeMany(20000);
+		assert(pTLSthreadcache->MaxSize() > ThreadCache::MIN_CACHE_SIZE);
+	});
+	busy.join();
+	step = 2;
+	idle.join();
+
+	assert(idleBefore > ThreadCache::MIN_CACHE_SIZE);
+	assert(idleAfter < idleBefore && idleAfter >= ThreadCache::MIN_CACHE_SIZE);
+	assert(idleCachedBefore > idleAfter);
+	assert(idleCachedAfter < idleCachedBefore && idleCachedAfter <= idleAfter);
+
+	// 剩余预算不够 MIN_CACHE_SIZE 时新线程也拿 MIN_CACHE_SIZE, 线程退出时还回来的要和拿走的一样多,
+	// 反复创建、退出线程, 全局预算不能越来越多
+	ConcurrentSetThreadCacheBudget(ThreadCache::MIN_CACHE_SIZE * 3);
+	long long unclaimed = ThreadCache::UnclaimedCacheSpace();
+	ConcurrentSetThreadCacheBudget(ThreadCache::MIN_CACHE_SIZE * 3 - unclaimed + ThreadCache::MIN_CACHE_SIZE / 2);
+	assert(ThreadCache::UnclaimedCacheSpace() == (long long)ThreadCache::MIN_CACHE_SIZE / 2);
+	for (int i = 0; i < 10; ++i)
+	{
+		std::thread t([]() {
+			ConcurrentFree(ConcurrentAlloc(16));
+		});
+		t.join();
+	}
+	assert(ThreadCache::UnclaimedCacheSpace() == (long long)ThreadCache::MIN_CACHE_SIZE / 2);
+
+	ConcurrentSetThreadCacheBudget(ThreadCache::OVERALL_CACHE_SIZE);
+	cout << "TestThreadCacheBudget passed" << endl;
+}
+
+// 验证按 CPU 缓存的前端: 多个线程同时申请释放, 对象不会丢也不会重复
+void TestCpuCache()
+{
+	const size_t nworks = 4;
+	const size_t ntimes = 10000;
+
+	std::vector<std::thread> vthread;
+	for (size_t k = 0; k < nworks; ++k)
+	{
+		vthread.emplace_back([=]() {
+			std::vector<void*> v;
+			for (size_t i = 0; i < ntimes; ++i)
+			{
+				size_t size = (i % 64 + 1) * 8;
+				char* p = (char*)CpuCache::getInstance()->Allocate(size);
+				p[0] = (char)k;
+				p[size - 1] = (char)k;
+				v.push_back(p);
+			}
+			for (size_t i = 0; i < ntimes; ++i)
+			{
+				size_t size = (i % 64 + 1) * 8;
+				char* p = (char*)v[i];
+				// 其他线程如果拿到了同一个对象, 这里的值就被改掉了
+				assert(p[0] == (char)k && p[size - 1] == (char)k);
+				CpuCache::getInstance()->Deallocate(p, size);
+			}
+		});
+	}
+	for (auto& t : vthread)
+	{
+		t.join();
+	}
+	assert(CpuCache::getInstance()->NumCpus() >= 1);
+
+	cout << "TestCpuCache passed" << endl;
+}
+
+// 默认的大小类表要和按区间计算的原始规则完全一致; 加载的大小类表要能正确解析
+void TestSizeClassTable()
+{
+	SizeClassTable def;
+	for (size_t size = 1; size <= MAX_BYTES; ++size)
+	{
+		size_t index = def.Index(size);
+		assert(index == SizeClass::CalcIndex(size));
+		assert(def._info[index]._size == SizeClass::CalcRoundUp(size));
+		assert(def._info[index]._numToMove == SizeClass::CalcNumMoveSize(SizeClass::CalcRoundUp(size)));
+		assert(def._info[index]._pages == SizeClass::CalcNumMovePage(SizeClass::CalcRoundUp(size)));
+	}
+	assert(def.Index(0) == 0);
+
+	// 当前用的表(可能是 CMP_SIZE_CLASSES 加载的): size 落在第一个放得下它的大小类里
+	for (size_t size = 1; size <= MAX_BYTES; ++size)
+	{
+		size_t index = SizeClass::Index(size);
+		assert(SizeClass::ClassSize(index) >= size);
+		assert(index == 0 || SizeClass::ClassSize(index - 1) < size);
+	}
+	assert(SizeClass::RoundUp(MAX_BYTES + 1) == MAX_BYTES + (1 << PAGE_SHIFT));
+	if (getenv("CMP_SIZE_CLASSES") != nullptr)
+	{
+		// ctest 里用 SizeClassHistogram.txt 按 8 字节对齐生成的大小类: 200 字节的申请很多, 一定有 200 这个大小类
+		assert(SizeClass::RoundUp(200) == 200);
+	}
+
+	// 解析文本格式
+	SizeClassTable table;
+	const char text[] = "# size pages batch\n8 1 512\n\n72 2 512\r\n3200 4 81\n262144 64 2\n";
+	assert(table.Parse(text, sizeof(text) - 1));
+	assert(table._numClasses == 4);
+	assert(table._info[table.Index(9)]._size == 72);
+	assert(table._info[table.Index(73)]._size == 3200);
+	assert(table._info[table.Index(3201)]._size == MAX_BYTES);
+	assert(table._info[table.Index(3000)]._pages == 4);
+
+	// 不合法的大小类: 不是从小到大, 大于 1024 却不是 128 的倍数, 最后一个不是 MAX_BYTES, 一个 span 放不下一个对象
+	const char* bad[] = {
+		"72 1 512\n8 1 512\n262144 64 2\n",
+		"8 1 512\n3100 4 81\n262144 64 2\n",
+		"8 1 512\n3200 4 81\n",
+		"8 1 512\n262144 1 2\n",
+		"8 1 x\n262144 64 2\n",
+	};
+	for (const char* t : bad)
+	{
+		assert(!table.Parse(t, strlen(t)));
+	}
+	// 解析失败时表不变
+	assert(table._numClasses == 4);
+
+	// 已经开始申请内存了, 大小类不能再换
+	assert(!SizeClass::LoadTable("SizeClasses.txt"));
+
+	cout << "TestSizeClassTable passed" << endl;
+}
+
+// central cache 里分配满的span和还有空闲对象的span分开挂:
+// 把很多span分满, 再隔一个还一个(span 从满的链表挪回非空的链表), 再申请时对象不能重复
+void TestCentralCacheFullSpans()
+{
+	const size_t size = 4096;
+	const size_t n = 4000;
+
+	std::vector<char*> v;
+	for (size_t i = 0; i < n; ++i)
+	{
+		char* p = (char*)ConcurrentAlloc(size);
+		*(size_t*)(p + 8) = i;
+		v.push_back(p);
+	}
+
+	std::vector<char*> live;
+	for (size_t i = 0; i < n; ++i)
+	{
+		if (i % 2 == 0)
+			ConcurrentFree(v[i]);
+		else
+			live.push_back(v[i]);
+	}
+	for (size_t i = 0; i < n / 2; ++i)
+	{
+		char* p = (char*)ConcurrentAlloc(size);
+		*(size_t*)(p + 8) = n + i;
+		live.push_back(p);
+	}
+
+	// 没有两个对象是同一块内存, 还活着的对象也没有被改写
+	std::vector<char*> sorted(live);
+	std::sort(sorted.begin(), sorted.end());
+	assert(std::adjacent_find(sorted.begin(), sorted.end()) == sorted.end());
+	for (size_t i = 0; i < n / 2; ++i)
+	{
+		assert(*(size_t*)(live[i] + 8) == 2 * i + 1);
+	}
+
+	for (char* p : live)
+	{
+		ConcurrentFree(p);
+	}
+
+	cout << "TestCentralCacheFullSpans passed" << endl;
+}
+
+// 转运缓存: 一个线程申请、另一个线程释放, 整批的对象经过转运缓存在线程之间转手
+void TestTransferCache()
+{
+	const size_t size = 4096;
+	const size_t n = 10000;
+	const size_t index = SizeClass::Index(size);
+
+	// 先把前面的测试留在转运缓存里的对象清掉
+	ConcurrentReleaseFreeMemory();
+	assert(CentralCache::getInstance()->NumTransferBatches(index) == 0);
+
+	std::vector<void*> v(n);
+	std::thread producer([&]() {
+		for (size_t i = 0; i < n; ++i)
+		{
+			v[i] = ConcurrentAlloc(size);
+		}
+	});
+	producer.join();
+
+	std::thread consumer([&]() {
+		for (size_t i = 0; i < n; ++i)
+		{
+			ConcurrentFree(v[i]);
+		}
+	});
+	consumer.join();
+
+	// 消费者只释放不申请, 慢开始涨上来以后一整批一整批地还, 先放进转运缓存
+	assert(CentralCache::getInstance()->NumTransferBatches(index) > 0);
+
+	std::thread producer2([&]() {
+		for (size_t i = 0; i < n; ++i)
+		{
+			v[i] = ConcurrentAlloc(size);
+		}
+#ifndef CMP_PER_CPU_CACHE
+		// 申请的慢开始涨到一整批以后, 先从转运缓存里拿
+		assert(CentralCache::getInstance()->NumTransferBatches(index) == 0);
+#endif
+		for (size_t i = 0; i < n; ++i)
+		{
+			ConcurrentFree(v[i]);
+		}
+	});
+	producer2.join();
+
+	ConcurrentReleaseFreeMemory();
+	assert(CentralCache::getInstance()->NumTransferBatches(index) == 0);
+
+	cout << "TestTransferCache passed" << endl;
+}
+
+// 无锁定长内存池: 多个线程同时申请释放, 同一个对象不会同时发给两个线程
+void TestLockFreeObjectPool()
+{
+	struct Node
+	{
+		size_t _owner = 0;
+		size_t _val = 0;
+	};
+
+	static LockFreeObjectPool<Node> pool;
+	std::vector<std::thread> threads;
+	for (size_t t = 1; t <= 4; ++t)
+	{
+		threads.emplace_back([t]() {
+			std::vector<Node*> v;
+			for (size_t round = 0; round < 100; ++round)
+			{
+				for (size_t i = 0; i < 100; ++i)
+				{
+					Node* node = pool.New();
+					node->_owner = t;
+					node->_val = i;
+					v.push_back(node);
+				}
+				for (size_t i = 0; i < v.size(); ++i)
+				{
+					// 别的线程拿到同一个对象的话, 这里就会被改掉
+					assert(v[i]->_owner == t && v[i]->_val == i);
+					v[i]->_owner = 0;
+					pool.Delete(v[i]);
+				}
+				v.clear();
+			}
+		});
+	}
+	for (auto& t : threads)
+	{
+		t.join();
+	}
+
+	cout << "TestLockFreeObjectPool passed" << endl;
+}
+
+// span 是懒切分的: 只申请一个对象时, 不会把整个 span 的页都访问一遍
+void TestLazyCarve()
+{
+#ifdef __linux__
+	// 大页模式下内核一次缺页就映射 2MB, 没法按页看 RSS
+	if (PageCache::getInstance()->GetHugePageMode() != PageCache::HUGEPAGE_NONE)
+	{
+		cout << "TestLazyCarve skipped" << endl;
+		return;
+	}
+
+	// 这个大小类一个 span 有 31 页(248KB), 前面的测试都没用过
+	const size_t size = 6000;
+	assert(SizeClass::NumMovePage(size) * (1 << PAGE_SHIFT) >= 200 * 1024);
+
+	// 先把空闲页都还给系统, 新的 span 的页一定还没有物理内存
+	ConcurrentReleaseFreeMemory();
+	size_t before = GetRSS();
+	void* p = ConcurrentAlloc(size);
+	memset(p, 1, size);
+	size_t after = GetRSS();
+
+	// 慢开始第一次只拿一个对象, 只访问了它所在的一两页
+	assert(after < before + 64 * 1024);
+	ConcurrentFree(p);
+#endif
+
+	cout << "TestLazyCarve passed" << endl;
+}
+
+// 大页模式: 新的 128 页内存从按 2MB 对齐的 arena 里按地址顺序切出来
+void TestHugePageArena()
+{
+#ifdef __linux__
+	PageCache* pc = PageCache::getInstance();
+	PageCache::HugePageMode oldMode = pc->GetHugePageMode();
+	ConcurrentSetHugePageMode(PageCache::HUGEPAGE_THP);
+
+	std::vector<Span*> spans;
+	{
+		std::unique_lock<InstrumentedMutex> lock(pc->_pageMtx);
+
+		// 一直拿 128 页的 span, 直到 page cache 空闲的 span 和当前 arena 都用完, 预留了一个新的 arena
+		size_t arenaPages = pc->HugePageArenaPages();
+		while (pc->HugePageArenaPages() == arenaPages)
+		{
+			spans.push_back(pc->NewSpan(NPAGES - 1));
+		}
+
+		// 新 arena 的第一块按大页对齐, 下一块紧挨着它, 两块填满同一个大页
+		Span* first = spans.back();
+		assert(((first->_pageId << PAGE_SHIFT) & (((size_t)1 << HUGEPAGE_SHIFT) - 1)) == 0);
+		Span* second = pc->NewSpan(NPAGES - 1);
+		assert(second->_pageId == first->_pageId + (NPAGES - 1));
+		spans.push_back(second);
+
+		for (auto span : spans)
+		{
+			pc->ReleaseSpanToPageCache(span);
+		}
+	}
+
+	ConcurrentSetHugePageMode(oldMode);
+#endif
+
+	cout << "TestHugePageArena passed" << endl;
+}
+
+// 大页感知的分配: 新的 span 从最满的大页里切, 整个空了的大页整个还给操作系统
+void TestHugePageFiller()
+{
+#ifdef __linux__
+	PageCache* pc = PageCache::getInstance();
+	PageCache::HugePageMode oldMode = pc->GetHugePageMode();
+	ConcurrentSetHugePageMode(PageCache::HUGEPAGE_THP);
+
+	std::vector<Span*> spans;
+	{
+		std::unique_lock<InstrumentedMutex> lock(pc->_pageMtx);
+
+		// 和 TestHugePageArena 一样, 拿到一个新 arena: a0、a1 填满第一个大页, a2、a3 填满第二个大页
+		size_t arenaPages = pc->HugePageArenaPages();
+		while (pc->HugePageArenaPages() == arenaPages)
+		{
+			spans.push_back(pc->NewSpan(NPAGES - 1));
+		}
+		Span* a0 = spans.back();
+		spans.pop_back();
+		Span* a1 = pc->NewSpan(NPAGES - 1);
+		Span* a2 = pc->NewSpan(NPAGES - 1);
+		Span* a3 = pc->NewSpan(NPAGES - 1);
+		PAGE_ID hp0 = a0->_pageId;
+		PAGE_ID hp1 = hp0 + HUGEPAGE_PAGES;
+		assert(a2->_pageId == hp1 && a3->_pageId == hp1 + HUGEPAGE_PAGES / 2);
+
+		// 第一个大页整个空了, 第二个大页还用着一半
+		pc->ReleaseSpanToPageCache(a0);
+		pc->ReleaseSpanToPageCache(a1);
+		pc->ReleaseSpanToPageCache(a3);
+		size_t empty = pc->EmptyHugePages();
+
+		// 按地址顺序会切第一个大页, 大页感知的分配不会去动空的第一个大页, 而是切 a3 所在的(或者别的更满的)大页
+		Span* s = pc->NewSpan(1);
+		assert(s->_pageId < hp0 || s->_pageId >= hp1);
+		pc->ReleaseSpanToPageCache(s);
+
+		// 第二个大页的最后一个在用的span也还回来, 大页整个空了, 归还时整个大页一起还
+		pc->ReleaseSpanToPageCache(a2);
+		assert(pc->EmptyHugePages() == empty + 1);
+		pc->ReleaseFreeMemory();
+		Span* first = pc->MapObjectToSpan((void*)(hp1 << PAGE_SHIFT));
+		Span* second = pc->MapObjectToSpan((void*)((hp1 + HUGEPAGE_PAGES / 2) << PAGE_SHIFT));
+		assert(first->_isReturned && first->_pageId == hp1 && first->_n == HUGEPAGE_PAGES / 2);
+		assert(second->_isReturned && second->_pageId == hp1 + HUGEPAGE_PAGES / 2);
+
+		for (auto span : spans)
+		{
+			pc->ReleaseSpanToPageCache(span);
+		}
+	}
+
+	ConcurrentSetHugePageMode(oldMode);
+#endif
+
+	cout << "TestHugePageFiller passed" << endl;
+}
+
+// page cache 的空闲span: 桶里取链表头上几个里地址最低的, 超过128页的按 best-fit 复用
+void TestPageCacheBestFit()
+{
+	// 头插以后链表是 20 10 30, 只在前面 limit 个里找页号最小的
+	Span spans[3];
+	spans[0]._pageId = 30;
+	spans[1]._pageId = 10;
+	spans[2]._pageId = 20;
+	SpanList list;
+	assert(list.LowestAmongFirst(3) == list.End());
+	for (auto& span : spans)
+	{
+		list.PushFront(&span);
+	}
+	assert(list.LowestAmongFirst(1)->_pageId == 20);
+	assert(list.LowestAmongFirst(3)->_pageId == 10);
+	list.Erase(&spans[1]);
+	assert(list.LowestAmongFirst(3)->_pageId == 20);
+	list.PopFront();
+	list.PopFront();
+	assert(list.Empty());
+
+	// 超过128页的span释放以后留在 page cache 里, 再申请时挑够用的里面最小的那个
+	PageCache* pc = PageCache::getInstance();
+	{
+		std::unique_lock<InstrumentedMutex> lock(pc->_pageMtx);
+		// 页数取得比较怪, 前面的测试不会留下这么大的空闲span
+		Span* s1000 = pc->NewSpan(1000);
+		Span* s900 = pc->NewSpan(900);
+		PAGE_ID id1000 = s1000->_pageId;
+		PAGE_ID id900 = s900->_pageId;
+		pc->ReleaseSpanToPageCache(s1000);
+		pc->ReleaseSpanToPageCache(s900);
+
+		// 不再向系统要新的, 复用900页的那个, 剩下的1页挂到桶里
+		Span* s899 = pc->NewSpan(899);
+		assert(s899->_pageId == id900 && s899->_n == 899);
+		assert(pc->MapObjectToSpan((void*)((id900 + 898) << PAGE_SHIFT)) == s899);
+
+		Span* s1000again = pc->NewSpan(1000);
+		assert(s1000again->_pageId == id1000);
+
+		pc->ReleaseSpanToPageCache(s899);
+		pc->ReleaseSpanToPageCache(s1000again);
+	}
+
+	cout << "TestPageCacheBestFit passed" << endl;
+}
+
+// 超过128页的空闲span缓存: 有上限, 放久了还给系统
+void TestLargeSpanDecay()
+{
+	PageCache* pc = PageCache::getInstance();
+
+	// 上限设成0, 先把前面测试缓存的都还给系统
+	ConcurrentSetLargeSpanCache(0, 1000);
+	assert(pc->LargeSpanCachePages() == 0);
+
+	// 最多缓存 2000 页, 不按时间衰减
+	ConcurrentSetLargeSpanCache(2000 << PAGE_SHIFT, 1000 * 1000);
+	{
+		std::unique_lock<InstrumentedMutex> lock(pc->_pageMtx);
+
+		// 释放以后留在缓存里, 同样大小再申请拿到的是同一段地址
+		Span* s = pc->NewSpan(1500);
+		PAGE_ID id = s->_pageId;
+		pc->ReleaseSpanToPageCache(s);
+		assert(pc->LargeSpanCachePages() == 1500);
+		s = pc->NewSpan(1500);
+		assert(s->_pageId == id);
+		assert(pc->LargeSpanCachePages() == 0);
+
+		// 两个加起来超过上限, 先放进去的那个被还给系统
+		Span* t = pc->NewSpan(1500);
+		pc->ReleaseSpanToPageCache(s);
+		pc->ReleaseSpanToPageCache(t);
+		assert(pc->LargeSpanCachePages() == 1500);
+		t = pc->NewSpan(1500);
+		assert(pc->LargeSpanCachePages() == 0);
+		pc->ReleaseSpanToPageCache(t);
+	}
+
+	// 衰减时间改成 10ms, 等一会儿再释放一个, 之前缓存的那个已经过期了
+	ConcurrentSetLargeSpanCache(2000 << PAGE_SHIFT, 10);
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	{
+		std::unique_lock<InstrumentedMutex> lock(pc->_pageMtx);
+		Span* s = pc->NewSpan(200);
+		pc->ReleaseSpanToPageCache(s);
+		assert(pc->LargeSpanCachePages() == 200);
+	}
+
+	// 之后只有小span的申请释放, 过期的大span也要还给系统
+	{
+		std::unique_lock<InstrumentedMutex> lock(pc->_pageMtx);
+		Span* s = pc->NewSpan(1);
+		lock.unlock();
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		lock.lock();
+		pc->ReleaseSpanToPageCache(s);
+		assert(pc->LargeSpanCachePages() == 0);
+	}
+
+	// 主动归还空闲内存时也一样
+	{
+		std::unique_lock<InstrumentedMutex> lock(pc->_pageMtx);
+		Span* s = pc->NewSpan(200);
+		pc->ReleaseSpanToPageCache(s);
+		assert(pc->LargeSpanCachePages() == 200);
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	ConcurrentReleaseFreeMemory();
+	assert(pc->LargeSpanCachePages() == 0);
+
+	// 大对象分片缓存里的span也会过期: 之后只有小span的申请释放, 也要还给 page cache
+	{
+		void* p = ConcurrentAlloc(300 * 1024);
+		ConcurrentFree(p);
+		assert(pc->LargeSpanShardPages() > 0);
+
+		std::unique_lock<InstrumentedMutex> lock(pc->_pageMtx);
+		Span* s = pc->NewSpan(1);
+		lock.unlock();
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		lock.lock();
+		pc->ReleaseSpanToPageCache(s);
+		assert(pc->LargeSpanShardPages() == 0);
+	}
+
+	// 恢复默认
+	ConcurrentSetLargeSpanCache(32 << 20, 1000);
+
+	cout << "TestLargeSpanDecay passed" << endl;
+}
+
+// 统计信息: 申请/释放以后正在使用的字节数正好变化这么多, 各项加起来等于映射的总量
+void TestAllocatorStats()
+{
+	const size_t N = 1000;
+	const size_t size = 100;
+	const size_t index = SizeClass::Index(size);
+	const size_t largeSize = 3 * 1024 * 1024;	// 超过128页, 直接找 page cache
+
+	AllocatorStats before = ConcurrentGetStats();
+
+	std::vector<void*> v;
+	for (size_t i = 0; i < N; ++i)
+	{
+		v.push_back(ConcurrentAlloc(size));
+	}
+	void* large = ConcurrentAlloc(largeSize);
+
+	AllocatorStats during = ConcurrentGetStats();
+	assert(during._classes[index]._inUseObjects == before._classes[index]._inUseObjects + N);
+	assert(during._largeInUseBytes == before._largeInUseBytes + SizeClass::RoundUp(largeSize));
+	assert(during._classes[index]._spans > 0);
+
+	// page cache 映射的内存 = 分出去的 + 空闲的 + 已归还的
+	const PageHeapStats& heap = during._pageHeap;
+	assert(heap._mappedBytes == heap._usedBytes + heap._freeBytes + heap._unmappedBytes);
+
+	for (void* p : v)
+	{
+		ConcurrentFree(p);
+	}
+	ConcurrentFree(large);
+
+	AllocatorStats after = ConcurrentGetStats();
+	assert(after._classes[index]._inUseObjects == before._classes[index]._inUseObjects);
+	assert(after._largeInUseBytes == before._largeInUseBytes);
+
+	std::string text = after.ToText();
+	assert(text.find("Bytes in use by application") != std::string::npos);
+	std::string json = after.ToJson();
+	assert(json.front() == '{' && json.find("\"size_classes\"") != std::string::npos);
+
+	cout << "TestAllocatorStats passed" << endl;
+}
+
+// 堆采样: 间隔设成1字节, 每次申请都会被采到; 释放以后从采样表里删掉, 但还算在"申请过的"里面
+void TestHeapProfiler()
+{
+	HeapProfiler* hp = HeapProfiler::getInstance();
+	const size_t N = 100;
+	std::vector<void*> v;
+	v.reserve(N);
+
+	ConcurrentSetHeapSampleInterval(1);
+	ConcurrentStartAllocationProfile();
+	size_t before = hp->LiveSamples();
+
+	for (size_t i = 0; i < N; ++i)
+	{
+		v.push_back(ConcurrentAlloc(i % 2 == 0 ? 4096 : 512 * 1024));
+	}
+	size_t during = hp->LiveSamples();
+	assert(during >= before + N);
+
+	// 一半用带大小的释放, 也要能从采样表里删掉
+	for (size_t i = 0; i < N; ++i)
+	{
+		if (i % 4 == 0)
+			ConcurrentFree(v[i], 4096);
+		else
+			ConcurrentFree(v[i]);
+	}
+	assert(hp->LiveSamples() == during - N);
+
+	// 留一个没释放的, 现在的堆里就一定有它
+	void* keep = ConcurrentAlloc(1000);
+	std::string live = ConcurrentHeapProfile();
+	assert(!live.empty() && live.back() == '\n');
+
+	// 折叠栈格式: 每行是 "栈 字节数"
+	size_t lineEnd = live.find('\n');
+	size_t space = live.rfind(' ', lineEnd);
+	assert(space != std::string::npos && atoll(live.c_str() + space + 1) > 0);
+
+	std::string alloc = ConcurrentAllocationProfile();
+	assert(!alloc.empty());
+
+	ConcurrentFree(keep);
+	ConcurrentSetHeapSampleInterval(0);
+
+	cout << "TestHeapProfiler passed" << endl;
+}
+
+static size_t HoldCount(const LockStatsSnapshot& lock)
+{
+	size_t n = 0;
+	for (size_t i = 0; i < LockStats::HOLD_BUCKETS; ++i)
+	{
+		n += lock._holdHistogram[i];
+	}
+	return n;
+}
+
+// 锁统计: 几个线程抢同一个桶, 再申请释放大对象走 page cache 的大锁
+void TestLockStats()
+{
+	const size_t size = 48;
+	const size_t index = SizeClass::Index(size);
+
+	ConcurrentSetLockStats(true);
+	AllocatorStats before = ConcurrentGetStats();
+
+	std::vector<std::thread> threads;
+	for (int t = 0; t < 4; ++t)
+	{
+		threads.emplace_back([=]() {
+			for (int round = 0; round < 20; ++round)
+			{
+				std::vector<void*> v;
+				for (int i = 0; i < 2000; ++i)
+				{
+					v.push_back(ConcurrentAlloc(size));
+				}
+				for (void* p : v)
+				{
+					ConcurrentFree(p);
+				}
+			}
+		});
+	}
+	for (auto& t : threads)
+	{
+		t.join();
+	}
+	ConcurrentFree(ConcurrentAlloc(3 * 1024 * 1024));
+
+	ConcurrentSetLockStats(false);
+	AllocatorStats after = ConcurrentGetStats();
+
+	// 线程已经退出了, 它们的计数也要算进来
+	const SizeClassStats& b = before._classes[index];
+	const SizeClassStats& a = after._classes[index];
+	assert(a._centralFetches > b._centralFetches);
+	assert(a._listTooLong > b._listTooLong);
+	assert(a._lock._acquisitions > b._lock._acquisitions);
+	assert(after._pageHeap._lock._acquisitions > before._pageHeap._lock._acquisitions);
+	assert(after._pageHeap._systemAllocs > 0);
+
+	// 每次统计了的拿锁都记了持有时间
+	assert(HoldCount(after._pageHeap._lock) - HoldCount(before._pageHeap._lock)
+		== after._pageHeap._lock._acquisitions - before._pageHeap._lock._acquisitions);
+	assert(HoldCount(a._lock) - HoldCount(b._lock) == a._lock._acquisitions - b._lock._acquisitions);
+
+	// 关掉以后就不再统计了
+	ConcurrentFree(ConcurrentAlloc(3 * 1024 * 1024));
+	AllocatorStats off = ConcurrentGetStats();
+	assert(off._pageHeap._lock._acquisitions == after._pageHeap._lock._acquisitions);
+
+	cout << "TestLockStats passed" << endl;
+}
+
+// 申请释放序列的记录: 主线程申请, 一半交给另一个线程释放, 读回来的事件要和实际发生的一致
+void TestAllocTrace()
+{
+	const char* path = "cmp_alloc_trace_test.bin";
+	const size_t N = 1000;
+	const size_t size = 100;
+
+	bool ok = ConcurrentStartAllocationTrace(path);
+	assert(ok);
+	(void)ok;
+
+	std::vector<void*> v;
+	v.reserve(N);
+	for (size_t i = 0; i < N; ++i)
+	{
+		v.push_back(ConcurrentAlloc(size));
+	}
+	void* big = ConcurrentAlloc(300 * 1024);
+	// 按比一页还大的对齐申请时(见 MallocInterpose.cpp 的 DoMemalign), 调用方拿到和释放的都是 span 中间的地址
+	char* alignedBase = (char*)ConcurrentAlloc(400 * 1024);
+	void* aligned = alignedBase + 64 * 1024;
+
+	// 前一半在别的线程里释放
+	std::thread t([&]() {
+		for (size_t i = 0; i < N / 2; ++i)
+		{
+			ConcurrentFree(v[i]);
+		}
+	});
+	t.join();
+	for (size_t i = N / 2; i < N; ++i)
+	{
+		ConcurrentFree(v[i], size);
+	}
+	ConcurrentFree(big);
+	ConcurrentFree(aligned);
+
+	ConcurrentStopAllocationTrace();
+	AllocTracer* tracer = AllocTracer::getInstance();
+	assert(!tracer->IsRecording());
+
+	// 停止以后的申请不再记录
+	ConcurrentFree(ConcurrentAlloc(size));
+
+	std::vector<TraceEvent> events;
+	ok = AllocTracer::ReadTrace(path, events);
+	assert(ok);
+	assert(events.size() == tracer->RecordedEvents());
+	assert(tracer->WrittenBytes() > 0 && tracer->WrittenBytes() < events.size() * AllocTracer::MAX_RECORD_BYTES);
+
+	// 每个对象: 先是申请(大小是申请时给的), 然后是释放(大小是大小类的大小, 不管释放时给没给大小); 前一半的释放线程和申请线程不同
+	std::unordered_map<uintptr_t, size_t> index;
+	for (size_t i = 0; i < N; ++i)
+	{
+		index[(uintptr_t)v[i]] = i;
+	}
+	std::vector<int> seen(N, 0);
+	std::vector<uint32_t> allocThread(N, 0);
+	size_t bigEvents = 0, alignedEvents = 0;
+	for (size_t k = 0; k < events.size(); ++k)
+	{
+		const TraceEvent& ev = events[k];
+		assert(k == 0 || events[k - 1]._timeNs <= ev._timeNs);
+		if (ev._ptr == (uintptr_t)big && ev._size == 300 * 1024)
+			++bigEvents;
+		// 大对象的释放记录记的是 span 开头的地址, 和申请记录一样
+		if (ev._ptr == (uintptr_t)alignedBase && ev._size == 400 * 1024)
+			++alignedEvents;
+
+		auto it = index.find(ev._ptr);
+		if (it == index.end() || seen[it->second] == 2)
+			continue;
+
+		size_t i = it->second;
+		if (seen[i] == 0)
+		{
+			assert(!ev._free && ev._size == size);
+			allocThread[i] = ev._thread;
+			seen[i] = 1;
+		}
+		else
+		{
+			assert(ev._free && ev._size == SizeClass::RoundUp(size));
+			assert((i < N / 2) == (ev._thread != allocThread[i]));
+			seen[i] = 2;
+		}
+	}
+	assert(std::count(seen.begin(), seen.end(), 2) == (long)N);
+	assert(bigEvents == 2);
+	assert(alignedEvents == 2);
+
+	remove(path);
+	cout << "TestAllocTrace passed" << endl;
+}
+
+// 带大小的释放: 小对象直接回到对应的桶, 大对象照常还给 page cache
+void TestSizedFree()
+{
+	// 放到新线程里跑: 新的 ThreadCache 离额度上限还远, 释放时不会触发 Scavenge 把对象还给 central cache
+	std::thread t([]() {
+		for (size_t size : { (size_t)1, (size_t)7, (size_t)100, (size_t)1000, (size_t)5000, (size_t)MAX_BYTES })
+		{
+			void* p1 = ConcurrentAlloc(size);
+			ConcurrentFree(p1, size);
+
+			// 同一个大小类的桶是后进先出的, 刚还回去的对象马上又能申请到
+			void* p2 = ConcurrentAlloc(SizeClass::RoundUp(size));
+#ifndef CMP_PER_CPU_CACHE
+			assert(p1 == p2);
+#endif
+			ConcurrentFree(p2, SizeClass::RoundUp(size));
+		}
+
+		void* big = ConcurrentAlloc(MAX_BYTES + 1);
+		ConcurrentFree(big, MAX_BYTES + 1);
+	});
+	t.join();
+
+	cout << "TestSizedFree passed" << endl;
+}
+
+#ifdef __linux__
+#include <malloc.h>
+
+// 验证 C 的申请接口的语义(对齐、清零、realloc 保留内容)
+// 用 LD_PRELOAD=libcmpool.so 跑的时候(ctest 里的 UnitTestPreload), 测的就是 MallocInterpose.cpp 里的实现
+void TestMallocApi()
+{
+	// 大于 8 字节的申请按 16 字节对齐
+	for (size_t size = 9; size <= 1024; size += 7)
+	{
+		void* p = malloc(size);
+		assert(((uintptr_t)p & 15) == 0);
+		assert(malloc_usable_size(p) >= size);
+		free(p);
+	}
+
+	char* c = (char*)calloc(1000, 3);
+	for (size_t i = 0; i < 3000; ++i)
+	{
+		assert(c[i] == 0);
+	}
+
+	// 从小对象长到大对象, 内容要搬过去
+	for (size_t i = 0; i < 3000; ++i)
+	{
+		c[i] = (char)i;
+	}
+	c = (char*)realloc(c, 1024 * 1024);
+	for (size_t i = 0; i < 3000; ++i)
+	{
+		assert(c[i] == (char)i);
+	}
+	c = (char*)realloc(c, 100);
+	for (size_t i = 0; i < 100; ++i)
+	{
+		assert(c[i] == (char)i);
+	}
+	free(c);
+
+	// 各种对齐, 包括比一页还大的对齐
+	for (size_t align = 32; align <= 64 * 1024; align <<= 1)
+	{
+		for (size_t size : { (size_t)1, align + 1, (size_t)300 * 1024 })
+		{
+			void* p = nullptr;
+			assert(posix_memalign(&p, align, size) == 0);
+			assert(((uintptr_t)p & (align - 1)) == 0);
+			assert(malloc_usable_size(p) >= size);
+			memset(p, 0xab, size);
+
+			void* q = aligned_alloc(align, size);
+			assert(((uintptr_t)q & (align - 1)) == 0);
+			memset(q, 0xcd, size);
+
+			free(p);
+			free(q);
+		}
+	}
+	void* p = nullptr;
+	assert(posix_memalign(&p, 24, 8) == EINVAL);
+
+	free(nullptr);
+
+	cout << "TestMallocApi passed" << endl;
+}
+
+#include <sys/wait.h>
+#include <signal.h>
+
+// 别的线程正在申请释放时 fork: 子进程里只剩 fork 的这个线程, 内存池的锁要是被别的线程拿着, 子进程就卡死了
+// 用 LD_PRELOAD 跑时(ctest 里的 UnitTestPreload) malloc 也是内存池, 子进程里 libc 自己申请内存也会走到这些锁
+void TestForkUnderLoad()
+{
+	const int nworkers = 4;
+	const int nforks = 100;
+
+	std::atomic<bool> stop{ false };
+	std::vector<std::thread> workers;
+	for (int t = 0; t < nworkers; ++t)
+	{
+		workers.emplace_back([&stop, t]() {
+			size_t i = 0;
+			while (!stop.load(std::memory_order_relaxed))
+			{
+				// 大对象和小对象都有: page cache 的大锁、大对象分片锁、桶锁、转运缓存的锁都会拿到
+				size_t size = (i++ % 3 == 0) ? 300 * 1024 + t * 8192 : 16 + (i % 64) * 64;
+				void* p = malloc(size);
+				void* q = ConcurrentAlloc(size);
+				free(p);
+				ConcurrentFree(q);
+			}
+		});
+	}
+
+	int hung = 0;
+	for (int k = 0; k < nforks && hung == 0; ++k)
+	{
+		pid_t pid = fork();
+		assert(pid >= 0);
+		if (pid == 0)
+		{
+			void* p = malloc(300 * 1024);
+			free(p);
+			// 绕过自己的线程缓存, 工作线程用到的每个桶锁都拿一次; 再把各级缓存清一遍, 转运缓存、分片和 page cache 的锁都会拿到
+			for (size_t size = 16; size <= 16 + 64 * 64; size += 64)
+			{
+				ThreadCache::DeallocateUncached(ThreadCache::AllocateUncached(size), size);
+			}
+			ConcurrentFree(ConcurrentAlloc(300 * 1024));
+			ConcurrentReleaseFreeMemory();
+			_exit(0);
+		}
+
+		// 子进程 2 秒还没退出就当作卡死了
+		int status = 0;
+		bool exited = false;
+		for (int ms = 0; ms < 2000 && !exited; ++ms)
+		{
+			if (waitpid(pid, &status, WNOHANG) == pid)
+				exited = true;
+			else
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		if (!exited)
+		{
+			kill(pid, SIGKILL);
+			waitpid(pid, &status, 0);
+			++hung;
+		}
+		else
+		{
+			assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+		}
+	}
+
+	stop = true;
+	for (auto& w : workers)
+	{
+		w.join();
+	}
+	assert(hung == 0);
+
+	cout << "TestForkUnderLoad passed" << endl;
+}
+
+#include <sys/resource.h>
+
+// 进程现在用了多少虚拟地址空间
+static size_t VirtualSize()
+{
+	size_t pages = 0;
+	FILE* f = fopen("/proc/self/statm", "r");
+	if (f != nullptr)
+	{
+		if (fscanf(f, "%zu", &pages) != 1)
+			pages = 0;
+		fclose(f);
+	}
+	return pages * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// 只允许在现在的基础上再用 extra 字节的地址空间
+static void LimitAddressSpace(rlimit limit, size_t extra)
+{
+	limit.rlim_cur = VirtualSize() + extra;
+	int ret = setrlimit(RLIMIT_AS, &limit);
+	assert(ret == 0);
+	(void)ret;
+}
+
+// 一直申请 size 字节直到失败, 再全部释放, 返回申请到了几个
+// 申请到的对象用它们自己的头 8 个字节串起来, 不用 vector(vector 扩容也要申请内存)
+template<class AllocFn, class FreeFn>
+static size_t ExhaustAndRelease(size_t size, AllocFn allocFn, FreeFn freeFn)
+{
+	void* head = nullptr;
+	size_t n = 0;
+	while (void* p = allocFn(size))
+	{
+		NextObj(p) = head;
+		head = p;
+		++n;
+	}
+
+	while (head != nullptr)
+	{
+		void* next = NextObj(head);
+		freeFn(head);
+		head = next;
+	}
+	return n;
+}
+
+// 地址空间用完时申请要返回空指针, 不能卡死:
+// 以前 SystemAlloc 拿着 page cache 的锁抛 bad_alloc, 抛异常时又要 malloc, 替换了 malloc 以后就卡在同一把锁上
+// 要改进程的 RLIMIT_AS, 所以不在 main 里跑, 而是单独的 UnitTest --oom (ctest 里的 UnitTestOutOfMemory 用 LD_PRELOAD 跑, 有超时)
+void TestOutOfMemory()
+{
+	rlimit old;
+	getrlimit(RLIMIT_AS, &old);
+
+	// 小对象(central cache 要新 span 时失败)和大对象(直接向系统要时失败)
+	for (size_t size : { (size_t)200000, (size_t)2000000 })
+	{
+		// 释放的内存还在 page cache 里占着地址空间, 每次都在当前用量上再留 256MB
+		LimitAddressSpace(old, 256 * 1024 * 1024);
+
+		// 替换后的 malloc: 失败时返回 NULL 并设置 errno
+		errno = 0;
+		size_t n = ExhaustAndRelease(size, [](size_t s) { return malloc(s); }, [](void* p) { free(p); });
+		assert(n > 0);
+		assert(errno == ENOMEM);
+
+		// 释放以后又能申请到了
+		void* p = malloc(size);
+		assert(p != nullptr);
+
+		// 内存池自己的接口(这个程序里静态链接的那一份)也一样
+		LimitAddressSpace(old, 256 * 1024 * 1024);
+		n = ExhaustAndRelease(size, [](size_t s) { return ConcurrentAlloc(s); }, [](void* q) { ConcurrentFree(q); });
+		assert(n > 0);
+
+		// 按 CPU 缓存的前端: 申请失败时 slab 的自旋锁不能还拿着, 否则之后这个 CPU 上的申请释放都会一直自旋
+		if (size <= MAX_BYTES)
+		{
+			CpuCache* cc = CpuCache::getInstance();
+			LimitAddressSpace(old, 256 * 1024 * 1024);
+			n = ExhaustAndRelease(size, [cc](size_t s) { return cc->Allocate(s); }, [cc, size](void* q) { cc->Deallocate(q, size); });
+			assert(n > 0);
+			cc->Deallocate(cc->Allocate(size), size);
+		}
+
+		// operator new 失败时抛 bad_alloc
+		LimitAddressSpace(old, 256 * 1024 * 1024);
+		bool thrown = false;
+		char* q = nullptr;
+		try
+		{
+			while (true)
+			{
+				char* next = new char[size];
+				NextObj(next) = q;
+				q = next;
+			}
+		}
+		catch (const std::bad_alloc&)
+		{
+			thrown = true;
+		}
+		assert(thrown);
+		while (q != nullptr)
+		{
+			char* next = (char*)NextObj(q);
+			delete[] q;
+			q = next;
+		}
+		free(p);
+	}
+
+	setrlimit(RLIMIT_AS, &old);
+	cout << "TestOutOfMemory passed" << endl;
+}
+#endif
+
+// VS 工程里 UnitTest.cpp 和 BenchMark.cpp 编进同一个可执行程序, main 只能有一个,
+// 所以这里的 main 只在 CMake 构建 UnitTest 目标时打开 (见 CMakeLists.txt)
+#ifdef CMP_UNITTEST_MAIN
+int main(int argc, char* argv[])
+{
+#ifdef __linux__
+	if (argc > 1 && strcmp(argv[1], "--oom") == 0)
+	{
+		TestOutOfMemory();
+		return 0;
+	}
+#else
+	(void)argc;
+	(void)argv;
+#endif
+
 	//TestObjectPool();
 
-	//TLStest();
+	TLStest();
 
-	//TestConcurrentAlloc1();
+	TestConcurrentAlloc1();
 	//TestAddressShift();
 
-	//TestMultiThread();
+	TestPageMap();
+
+#ifndef CMP_PER_CPU_CACHE
+	// 按 CPU 缓存时没有线程级缓存, 线程退出也就没有要还的对象
+	TestThreadExit();
+
+	TestThreadCacheBudget();
+#endif
+
+	TestReleaseFreeMemory();
+
+	TestLargeSpanCache();
+
+	TestCpuCache();
+
+	TestSizeClassTable();
+
+	TestCentralCacheFullSpans();
+
+	TestTransferCache();
+
+	TestLazyCarve();
+
+	TestLockFreeObjectPool();
+
+	TestSizedFree();
+
+	TestHugePageArena();
+
+	TestHugePageFiller();
+
+	TestPageCacheBestFit();
+
+	TestLargeSpanDecay();
+	TestAllocatorStats();
+	TestHeapProfiler();
+	TestLockStats();
+	TestAllocTrace();
+
+#ifdef __linux__
+	TestMallocApi();
+	TestForkUnderLoad();
+#endif
+
+	TestMultiThread();
 
 	BigAlloc();
 
 	return 0;
-}*/
+}
+#endif
 
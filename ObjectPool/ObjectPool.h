@@ -4,6 +4,8 @@
 
 #include <iostream>
 #include <mutex>
+#include <atomic>
+#include <cstdint>
 #include <vector>
 
 using namespace std;
@@ -12,6 +14,7 @@ using namespace std;
 #include <windows.h>
 #else
 // linux下brk / mmap 的头文件
+#include <sys/mman.h>
 #endif
 
 // 直接去堆上按页申请空间
@@ -20,7 +23,10 @@ inline static void* SystemAlloc(size_t kpage)
 #ifdef _WIN32
 	void* ptr = VirtualAlloc(0, kpage << 13, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
 #else
-	// linux下brk mmap等
+	// linux下用mmap申请匿名私有映射
+	void* ptr = mmap(nullptr, kpage << 13, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED)
+		ptr = nullptr;
 #endif
 	if (ptr == nullptr)
 		throw std::bad_alloc();
@@ -28,12 +34,13 @@ inline static void* SystemAlloc(size_t kpage)
 }
 
 // 释放从堆上申请的空间
-inline static void SystemFree(void* ptr)
+// 注意: munmap需要知道长度, 所以这里要把页数也传进来(VirtualFree用不到)
+inline static void SystemFree(void* ptr, size_t kpage)
 {
 #ifdef _WIN32
 	VirtualFree(ptr, 0, MEM_RELEASE);
 #else
-	// sbrk unmmap等
+	munmap(ptr, kpage << 13);
 #endif
 }
 
@@ -108,6 +115,136 @@ private:
 	std::mutex _mtx;
 };
 
+// 无锁定长内存池, 接口和 ObjectPool 一样
+// Span、ThreadCache 这些元数据对象在切分/合并 Span、线程启动时都要申请释放, ObjectPool 每次都要加锁
+// 还回来的对象挂在一个无锁栈(Treiber stack)上, New/Delete 在栈不空时只需要一次 CAS
+//
+// ABA 问题: 线程A读到栈顶 a 和 a->next = b 后被挂起, 其他线程弹出 a、b 再把 a 压回去,
+// 栈顶还是 a, 但 b 已经不在栈里了, A 的 CAS 会成功并把 b 放回栈顶
+// 所以栈顶除了指针还带一个版本号, 每次修改都 +1, 上面的情况版本号变了, A 的 CAS 就会失败
+// 64 位平台用户态地址只用低 48 位, 高 16 位放版本号; 32 位平台指针和版本号各占 32 位, 都能放进一个 64 位原子变量
+//
+// 弹栈时会读栈顶对象里的 next, 这个对象可能刚被别的线程弹走在用, 读到的是垃圾值, 但此时版本号已经变了, CAS 会失败重试;
+// 池子申请的大块内存从来不还给系统, 所以这个读操作不会访问到已经解除映射的地址
+//
+// 栈空了以后才加锁从大块内存里切, 一次切一批: 留一个返回, 其余整串一次压进栈里
+template<class T>
+class LockFreeObjectPool
+{
+public:
+	T* New()
+	{
+		void* obj = Pop();
+		if (obj == nullptr)
+		{
+			obj = Refill();
+		}
+
+		new(obj)T;
+		return (T*)obj;
+	}
+
+	void Delete(T* obj)
+	{
+		obj->~T();
+		Push(obj, obj);
+	}
+
+private:
+	typedef uint64_t Tagged;
+
+#if UINTPTR_MAX > 0xFFFFFFFFu
+	static const int PTR_BITS = 48;
+#else
+	static const int PTR_BITS = 32;
+#endif
+	static const Tagged PTR_MASK = ((Tagged)1 << PTR_BITS) - 1;
+
+	// 一次从大块内存里切多少个对象
+	static const size_t REFILL_NUM = 32;
+
+	static void* Ptr(Tagged top)
+	{
+		return (void*)(uintptr_t)(top & PTR_MASK);
+	}
+
+	// 新的栈顶: 指针换成 ptr, 版本号在旧栈顶的基础上 +1
+	static Tagged Make(void* ptr, Tagged old)
+	{
+		return (Tagged)(uintptr_t)ptr | (((old >> PTR_BITS) + 1) << PTR_BITS);
+	}
+
+	// 把 start ... end 这一串(已经串好)压到栈顶
+	void Push(void* start, void* end)
+	{
+		Tagged old = _top.load(std::memory_order_relaxed);
+		do
+		{
+			*((void**)end) = Ptr(old);
+		} while (!_top.compare_exchange_weak(old, Make(start, old),
+			std::memory_order_release, std::memory_order_relaxed));
+	}
+
+	void* Pop()
+	{
+		Tagged old = _top.load(std::memory_order_acquire);
+		while (Ptr(old) != nullptr)
+		{
+			void* obj = Ptr(old);
+			void* next = *((void**)obj);
+			if (_top.compare_exchange_weak(old, Make(next, old),
+				std::memory_order_acquire, std::memory_order_acquire))
+			{
+				return obj;
+			}
+		}
+		return nullptr;
+	}
+
+	void* Refill()
+	{
+		std::unique_lock<std::mutex> lock(_mtx);
+
+		// 等锁的时候别的线程可能已经切好一批压进栈里了
+		void* obj = Pop();
+		if (obj != nullptr)
+			return obj;
+
+		size_t objSize = sizeof(T) < sizeof(void*) ? sizeof(void*) : sizeof(T);
+		if (_remainBytes < objSize)
+		{
+			_remainBytes = 128 * 1024;
+			_memory = (char*)SystemAlloc(_remainBytes >> 13);
+		}
+
+		size_t n = _remainBytes / objSize;
+		if (n > REFILL_NUM)
+			n = REFILL_NUM;
+
+		// 第一个返回, 剩下的 n - 1 个串起来压栈
+		obj = _memory;
+		char* start = _memory + objSize;
+		char* end = _memory + (n - 1) * objSize;
+		for (char* cur = start; cur < end; cur += objSize)
+		{
+			*((void**)cur) = cur + objSize;
+		}
+		_memory += n * objSize;
+		_remainBytes -= n * objSize;
+
+		if (n > 1)
+			Push(start, end);
+		return obj;
+	}
+
+private:
+	std::atomic<Tagged> _top{ 0 };	// 还回来的对象组成的无锁栈, 低位是栈顶指针, 高位是版本号
+
+	std::mutex _mtx;	// 只保护下面的大块内存
+	char* _memory = nullptr;
+	size_t _remainBytes = 0;
+};
+
 
 // 二叉树结点
 struct TreeNode
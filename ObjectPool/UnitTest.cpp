@@ -1,9 +1,76 @@
-#define _CRT_SECURE_NO_WARNINGS 1
+﻿#define _CRT_SECURE_NO_WARNINGS 1
 
 #include "ObjectPool.h"
 
+#include <thread>
+#include <chrono>
+
+// 多线程下对比 new/delete、加锁的 ObjectPool 和无锁的 LockFreeObjectPool
+// 每个线程每轮申请 N 个对象再全部释放, 统计所有线程跑完的墙上时间
+// (clock() 统计的是整个进程的 CPU 时间, 多线程时会把各线程的时间加在一起, 所以这里用 steady_clock)
+template<class Alloc, class Free>
+static long long RunThreads(size_t nthreads, size_t rounds, size_t n, Alloc alloc, Free dealloc)
+{
+	std::vector<std::thread> threads;
+	auto begin = std::chrono::steady_clock::now();
+	for (size_t k = 0; k < nthreads; ++k)
+	{
+		threads.emplace_back([&]() {
+			std::vector<TreeNode*> v;
+			v.reserve(n);
+			for (size_t i = 0; i < rounds; ++i)
+			{
+				for (size_t j = 0; j < n; ++j)
+				{
+					v.push_back(alloc());
+				}
+				for (size_t j = 0; j < n; ++j)
+				{
+					dealloc(v[j]);
+				}
+				v.clear();
+			}
+		});
+	}
+	for (auto& t : threads)
+	{
+		t.join();
+	}
+	auto end = std::chrono::steady_clock::now();
+	return (long long)std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
+}
+
+void BenchObjectPool(size_t nthreads)
+{
+	const size_t Rounds = 10;
+	const size_t N = 100000;
+
+	long long t1 = RunThreads(nthreads, Rounds, N,
+		[]() { return new TreeNode; },
+		[](TreeNode* node) { delete node; });
+
+	ObjectPool<TreeNode> pool;
+	long long t2 = RunThreads(nthreads, Rounds, N,
+		[&]() { return pool.New(); },
+		[&](TreeNode* node) { pool.Delete(node); });
+
+	LockFreeObjectPool<TreeNode> lfPool;
+	long long t3 = RunThreads(nthreads, Rounds, N,
+		[&]() { return lfPool.New(); },
+		[&](TreeNode* node) { lfPool.Delete(node); });
+
+	cout << nthreads << " threads, " << Rounds << " rounds, " << N << " objects per round:" << endl;
+	cout << "new/delete cost time:" << t1 << " ms" << endl;
+	cout << "object pool cost time:" << t2 << " ms" << endl;
+	cout << "lock-free object pool cost time:" << t3 << " ms" << endl;
+}
+
 int main()
 {
 	TestObjectPool();
+
+	BenchObjectPool(1);
+	BenchObjectPool(4);
+	BenchObjectPool(8);
 	return 0;
 }
\ No newline at end of file